@@ -0,0 +1,264 @@
+#include "bench.h"
+#include "edid-cache.h"
+#include "icc.h"
+#include <colord.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <X11/extensions/Xrandr.h>
+
+#define ICC_HEADER_SIZE 128
+
+static inline void
+write_be16 (guint8 *p, guint16 v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xFF;
+}
+
+static inline void
+write_be32 (guint8 *p, guint32 v)
+{
+	p[0] = v >> 24;
+	p[1] = (v >> 16) & 0xFF;
+	p[2] = (v >> 8) & 0xFF;
+	p[3] = v & 0xFF;
+}
+
+/* Smallest file icc_data_load() accepts, with the given VCGT tag or none */
+static gchar *
+write_profile (const gchar *dir, const gchar *name, const guint8 *vcgt, gsize vcgt_size)
+{
+	gsize size = ICC_HEADER_SIZE + 4 + (vcgt ? 12 + vcgt_size : 0);
+	guint8 *buf = g_malloc0 (size);
+	gchar *path = g_build_filename (dir, name, NULL);
+	GError *err = NULL;
+
+	write_be32 (buf, size);
+	memcpy (buf + 36, "acsp", 4);
+	if (vcgt) {
+		write_be32 (buf + ICC_HEADER_SIZE, 1);
+		memcpy (buf + ICC_HEADER_SIZE + 4, "vcgt", 4);
+		write_be32 (buf + ICC_HEADER_SIZE + 8, ICC_HEADER_SIZE + 16);
+		write_be32 (buf + ICC_HEADER_SIZE + 12, vcgt_size);
+		memcpy (buf + ICC_HEADER_SIZE + 16, vcgt, vcgt_size);
+	}
+
+	if (! g_file_set_contents (path, (const gchar *) buf, size, &err))
+		g_error ("unable to write %s: %s", path, err->message);
+
+	g_free (buf);
+	return path;
+}
+
+static gchar *
+write_table_profile (const gchar *dir, guint entries, guint entry_size)
+{
+	gsize size = 18 + 3 * entries * entry_size;
+	guint8 *tag = g_malloc0 (size);
+	gchar *name = g_strdup_printf ("table%u-%u.icc", entry_size * 8, entries);
+	gchar *path;
+	guint c, i;
+
+	memcpy (tag, "vcgt", 4);
+	write_be32 (tag + 8, 0);
+	write_be16 (tag + 12, 3);
+	write_be16 (tag + 14, entries);
+	write_be16 (tag + 16, entry_size);
+	for (c = 0; c < 3; ++c) {
+		guint8 *p = tag + 18 + c * entries * entry_size;
+		for (i = 0; i < entries; ++i) {
+			/* slightly different curve per channel */
+			guint v = (guint) (i * (0xFFFF - c * 0x400) / (entries - 1));
+			if (entry_size == 1)
+				p[i] = v >> 8;
+			else
+				write_be16 (p + 2 * i, v);
+		}
+	}
+
+	path = write_profile (dir, name, tag, size);
+	g_free (name);
+	g_free (tag);
+	return path;
+}
+
+static gchar *
+write_formula_profile (const gchar *dir)
+{
+	guint8 tag[48];
+	int c;
+
+	memset (tag, 0, sizeof (tag));
+	memcpy (tag, "vcgt", 4);
+	write_be32 (tag + 8, 1);
+	for (c = 0; c < 3; ++c) {
+		guint8 *p = tag + 12 + 12 * c;
+		write_be32 (p, (guint32) ((1.0 + 0.05 * c) * 65536));	/* gamma */
+		write_be32 (p + 4, 0);					/* min */
+		write_be32 (p + 8, 65536);				/* max */
+	}
+
+	return write_profile (dir, "formula.icc", tag, sizeof (tag));
+}
+
+struct gamma_case {
+	XRRCrtcGamma	*gamma;
+	struct icc_data	*data;
+};
+
+static void
+run_icc_to_gamma (gpointer user_data, guint64 iters)
+{
+	struct gamma_case *gc = (struct gamma_case *) user_data;
+	guint64 i;
+	for (i = 0; i < iters; ++i)
+		icc_to_gamma (gc->gamma, gc->data);
+}
+
+static void
+bench_icc_to_gamma (const gchar *kind, struct icc_data *data)
+{
+	static const int sizes[] = { 256, 1024, 4096 };
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (sizes); ++i) {
+		struct gamma_case gc;
+		gchar *name = g_strdup_printf ("icc_to_gamma/%s/%i", kind, sizes[i]);
+
+		gc.gamma = XRRAllocGamma (sizes[i]);
+		gc.data = data;
+		bench_run (name, run_icc_to_gamma, &gc);
+		XRRFreeGamma (gc.gamma);
+		g_free (name);
+	}
+}
+
+static struct icc_data *
+load_profile (const gchar *path)
+{
+	GError *err = NULL;
+	struct icc_data *data = icc_data_load (path, &err);
+	if (! data)
+		g_error ("%s", err->message);
+	return data;
+}
+
+static void
+run_icc_from_edid (gpointer user_data, guint64 iters)
+{
+	CdEdid *edid = (CdEdid *) user_data;
+	guint64 i;
+	for (i = 0; i < iters; ++i)
+		g_object_unref (icc_from_edid (edid));
+}
+
+/* What setting _ICC_PROFILE costs before the request goes out */
+static void
+run_serialize_icc (gpointer user_data, guint64 iters)
+{
+	CdIcc *icc = (CdIcc *) user_data;
+	guint64 i;
+	for (i = 0; i < iters; ++i) {
+		struct icc_data *data = icc_data_new_from_icc (icc);
+		GBytes *bytes = icc_data_get_bytes (data, NULL);
+		gsize len;
+		const guint8 *buf = g_bytes_get_data (bytes, &len);
+		g_free (icc_checksum_for_data (buf, len));
+		g_bytes_unref (bytes);
+		icc_data_unref (data);
+	}
+}
+
+static void
+run_serialize_file (gpointer user_data, guint64 iters)
+{
+	const gchar *path = (const gchar *) user_data;
+	guint64 i;
+	for (i = 0; i < iters; ++i) {
+		struct icc_data *data = load_profile (path);
+		g_bytes_unref (icc_data_get_bytes (data, NULL));
+		icc_data_unref (data);
+	}
+}
+
+static void
+run_edid_parse (gpointer user_data, guint64 iters)
+{
+	GBytes *raw = (GBytes *) user_data;
+	guint64 i;
+	for (i = 0; i < iters; ++i) {
+		edid_cache_clear ();
+		edid_info_unref (edid_cache_lookup (raw));
+	}
+}
+
+static void
+run_edid_cached (gpointer user_data, guint64 iters)
+{
+	GBytes *raw = (GBytes *) user_data;
+	guint64 i;
+	for (i = 0; i < iters; ++i)
+		edid_info_unref (edid_cache_lookup (raw));
+}
+
+void
+bench_icc (void)
+{
+	GError *err = NULL;
+	gchar *dir = g_dir_make_tmp ("xiccd-bench-XXXXXX", &err);
+	gchar *paths[5];
+	const gchar *kinds[6] = {
+		"none", "table8-256", "table16-256", "table16-1024", "formula", "lcms"
+	};
+	struct icc_data *data[6];
+	GBytes *raw = bench_make_edid (1);
+	struct edid_info *info;
+	CdIcc *icc;
+	guint i;
+
+	if (! dir)
+		g_error ("unable to create temporary directory: %s", err->message);
+
+	paths[0] = write_profile (dir, "none.icc", NULL, 0);
+	paths[1] = write_table_profile (dir, 256, 1);
+	paths[2] = write_table_profile (dir, 256, 2);
+	paths[3] = write_table_profile (dir, 1024, 2);
+	paths[4] = write_formula_profile (dir);
+
+	info = edid_cache_lookup (raw);
+	icc = icc_from_edid (info->edid);
+	if (! icc)
+		g_error ("unable to create a profile from the test EDID");
+
+	for (i = 0; i < G_N_ELEMENTS (paths); ++i)
+		data[i] = load_profile (paths[i]);
+	/* made in memory, so the whole profile goes through lcms */
+	data[5] = icc_data_new_from_icc (icc);
+
+	for (i = 0; i < G_N_ELEMENTS (data); ++i)
+		bench_icc_to_gamma (kinds[i], data[i]);
+
+	bench_run ("icc_from_edid", run_icc_from_edid, info->edid);
+	bench_run ("icc_serialize/memory", run_serialize_icc, icc);
+	bench_run ("icc_serialize/file", run_serialize_file, paths[3]);
+	bench_run ("edid_parse/uncached", run_edid_parse, raw);
+	bench_run ("edid_parse/cached", run_edid_cached, raw);
+
+	for (i = 0; i < G_N_ELEMENTS (data); ++i)
+		icc_data_unref (data[i]);
+	icc_data_clear_cache ();
+	for (i = 0; i < G_N_ELEMENTS (paths); ++i) {
+		g_unlink (paths[i]);
+		g_free (paths[i]);
+	}
+	g_rmdir (dir);
+	g_free (dir);
+
+	g_object_unref (icc);
+	edid_info_unref (info);
+	edid_cache_clear ();
+	g_bytes_unref (raw);
+}
+
+/* vim: set ts=8 sw=8 tw=0 : */
@@ -0,0 +1,160 @@
+/*
+ * The display bookkeeping is all static, so it is built right into this
+ * file. Screen states are made up instead of fetched from an X server.
+ */
+#include "../src/randr-conn-private.c"
+#include "bench.h"
+
+guint randr_signals[N_SIG];
+
+struct diff_case {
+	struct randr_conn		conn;
+	struct randr_screen_state	st;
+	gboolean			unplugged;	/* of the first output */
+};
+
+static void
+diff_case_init (struct diff_case *dc, int n)
+{
+	struct randr_screen screen;
+	int i;
+
+	memset (dc, 0, sizeof (*dc));
+	dc->conn.displays = g_ptr_array_new ();
+	dc->conn.outputs = g_hash_table_new (g_direct_hash, g_direct_equal);
+	dc->conn.screens = g_array_new (FALSE, TRUE, sizeof (struct randr_screen));
+	memset (&screen, 0, sizeof (screen));
+	screen.root = 1;
+	g_array_append_val (dc->conn.screens, screen);
+
+	screen_state_init (&dc->st);
+	dc->st.noutput = n;
+	dc->st.outputs = g_new (RROutput, n);
+	for (i = 0; i < n; ++i) {
+		struct randr_output_state os;
+
+		memset (&os, 0, sizeof (os));
+		os.output = 0x100 + i;
+		os.index = i;
+		os.name = g_strdup_printf ("DP-%i", i);
+		os.crtc = 0x200 + i;
+		os.connected = TRUE;
+		os.gamma_size = 1024;
+		os.edid = bench_make_edid (i);
+		g_array_append_val (dc->st.states, os);
+		dc->st.outputs[i] = os.output;
+	}
+	dc->st.primary = dc->st.outputs[0];
+}
+
+static void
+diff_case_clear (struct diff_case *dc)
+{
+	while (dc->conn.displays->len)
+		randr_display_free (g_ptr_array_remove_index_fast (dc->conn.displays, 0));
+	g_ptr_array_unref (dc->conn.displays);
+	g_hash_table_unref (dc->conn.outputs);
+	g_array_unref (dc->conn.screens);
+	screen_state_clear (&dc->st);
+	edid_cache_clear ();
+}
+
+static inline void
+diff_once (struct diff_case *dc)
+{
+	struct update_result res;
+
+	/* as randr_conn_private_update() does, short of emitting signals */
+	update_result_init (&res, &dc->conn);
+	iterate_outputs (&dc->conn, 1, &dc->st, &res);
+	update_result_clear (&res);
+}
+
+static void
+run_diff_steady (gpointer user_data, guint64 iters)
+{
+	struct diff_case *dc = (struct diff_case *) user_data;
+	guint64 i;
+	for (i = 0; i < iters; ++i)
+		diff_once (dc);
+}
+
+/* The first monitor goes away and comes back, every other update */
+static void
+run_diff_hotplug (gpointer user_data, guint64 iters)
+{
+	struct diff_case *dc = (struct diff_case *) user_data;
+	struct randr_output_state *os =
+		&g_array_index (dc->st.states, struct randr_output_state, 0);
+	guint64 i;
+	for (i = 0; i < iters; ++i) {
+		dc->unplugged = ! dc->unplugged;
+		os->connected = ! dc->unplugged;
+		diff_once (dc);
+	}
+}
+
+static void
+run_make_name (gpointer user_data, guint64 iters)
+{
+	struct randr_display_priv *disp = (struct randr_display_priv *) user_data;
+	guint64 i;
+	for (i = 0; i < iters; ++i)
+		g_free ((gpointer) make_name (disp));
+}
+
+static void
+bench_make_name (void)
+{
+	struct randr_conn conn;
+	struct randr_display_priv disp;
+	GBytes *raw = bench_make_edid (1);
+
+	memset (&conn, 0, sizeof (conn));
+	memset (&disp, 0, sizeof (disp));
+	disp.conn = &conn;
+	disp.pub.xrandr_name = "DP-1";
+	disp.edid_info = edid_cache_lookup (raw);
+
+	bench_run ("make_name/edid", run_make_name, &disp);
+	conn.ns = ":1";
+	bench_run ("make_name/edid-namespace", run_make_name, &disp);
+	edid_info_unref (disp.edid_info);
+	disp.edid_info = NULL;
+	bench_run ("make_name/xrandr-namespace", run_make_name, &disp);
+	conn.ns = NULL;
+	bench_run ("make_name/xrandr", run_make_name, &disp);
+
+	edid_cache_clear ();
+	g_bytes_unref (raw);
+}
+
+void
+bench_randr (void)
+{
+	static const int counts[] = { 1, 2, 4, 8, 16, 32, 64 };
+	guint i;
+
+	bench_make_name ();
+
+	for (i = 0; i < G_N_ELEMENTS (counts); ++i) {
+		struct diff_case dc;
+		gchar *name;
+
+		diff_case_init (&dc, counts[i]);
+		/* all of them are known from now on */
+		diff_once (&dc);
+
+		name = g_strdup_printf ("randr_diff/steady/%i", counts[i]);
+		bench_run (name, run_diff_steady, &dc);
+		g_free (name);
+
+		name = g_strdup_printf ("randr_diff/hotplug/%i", counts[i]);
+		bench_run (name, run_diff_hotplug, &dc);
+		g_free (name);
+
+		diff_case_clear (&dc);
+	}
+}
+
+/* vim: set ts=8 sw=8 tw=0 : */
@@ -0,0 +1,261 @@
+/*
+ * Micro-benchmarks of the daemon internals which run on every hotplug.
+ *
+ * Prints one JSON object per line so that results can be compared
+ * between releases. Times are in nanoseconds per operation.
+ */
+#include "bench.h"
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Samples shorter than this are dominated by the clock */
+#define BENCH_MIN_SAMPLE_NS	(100 * 1000)
+#define BENCH_MAX_ITERS		(1 << 24)
+
+static struct {
+	gint		samples;
+	gchar		**patterns;	/* NULL to run everything */
+} config = { 50, NULL };
+
+/*
+ * Allocations are counted by interposing malloc(), which also sees the
+ * ones made inside GLib, colord and lcms. The real allocator is reached
+ * through the aliases glibc exports for this purpose.
+ */
+#ifdef __GLIBC__
+#define BENCH_COUNT_ALLOCS 1
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static guint64 allocs;
+
+void *
+malloc (size_t size)
+{
+	__atomic_add_fetch (&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+	__atomic_add_fetch (&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+	__atomic_add_fetch (&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc (ptr, size);
+}
+
+static inline guint64
+get_allocs (void)
+{
+	return __atomic_load_n (&allocs, __ATOMIC_RELAXED);
+}
+#else
+static inline guint64
+get_allocs (void)
+{
+	return 0;
+}
+#endif
+
+static inline guint64
+now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (guint64) ts.tv_sec * G_GUINT64_CONSTANT (1000000000) + ts.tv_nsec;
+}
+
+static gboolean
+is_wanted (const gchar *name)
+{
+	gchar **p;
+
+	if (! config.patterns)
+		return TRUE;
+	for (p = config.patterns; *p; ++p) {
+		if (strstr (name, *p))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static int
+cmp_double (gconstpointer a, gconstpointer b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static inline double
+percentile (const double *sorted, int n, int p)
+{
+	return sorted[(n - 1) * p / 100];
+}
+
+void
+bench_run (const gchar *name, bench_fn fn, gpointer data)
+{
+	guint64 iters = 1;
+	guint64 total_ns = 0, total_allocs = 0;
+	double *ns_per_op;
+	int s;
+
+	if (! is_wanted (name))
+		return;
+
+	/* warms up caches too */
+	for (;;) {
+		guint64 start = now_ns ();
+		fn (data, iters);
+		if (now_ns () - start >= BENCH_MIN_SAMPLE_NS || iters >= BENCH_MAX_ITERS)
+			break;
+		iters *= 2;
+	}
+
+	ns_per_op = g_new (double, config.samples);
+	for (s = 0; s < config.samples; ++s) {
+		guint64 a = get_allocs ();
+		guint64 start = now_ns ();
+		guint64 ns;
+
+		fn (data, iters);
+		ns = now_ns () - start;
+
+		total_allocs += get_allocs () - a;
+		total_ns += ns;
+		ns_per_op[s] = (double) ns / iters;
+	}
+
+	qsort (ns_per_op, config.samples, sizeof (double), cmp_double);
+
+	printf ("{\"name\":\"%s\",\"iterations\":%" G_GUINT64_FORMAT ",\"samples\":%i,"
+		"\"ns_per_op\":%.1f,\"allocs_per_op\":",
+		name, iters * config.samples, config.samples,
+		(double) total_ns / (iters * config.samples));
+#ifdef BENCH_COUNT_ALLOCS
+	printf ("%.2f", (double) total_allocs / (iters * config.samples));
+#else
+	printf ("null");
+#endif
+	printf (",\"min\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f}\n",
+		ns_per_op[0], percentile (ns_per_op, config.samples, 50),
+		percentile (ns_per_op, config.samples, 90),
+		percentile (ns_per_op, config.samples, 99),
+		ns_per_op[config.samples - 1]);
+	fflush (stdout);
+
+	g_free (ns_per_op);
+}
+
+static inline guint
+chroma_bits (double v)
+{
+	return (guint) (v * 1024.0 + 0.5) & 0x3FF;
+}
+
+GBytes *
+bench_make_edid (guint serial)
+{
+	static const guint8 header[8] = { 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+	/* sRGB primaries and D65 */
+	static const double chroma[8] = {
+		0.640, 0.330, 0.300, 0.600, 0.150, 0.060, 0.3127, 0.3290
+	};
+	guint8 *e = g_malloc0 (128);
+	guint bits[8];
+	guint8 sum = 0;
+	int i;
+
+	memcpy (e, header, sizeof (header));
+	/* "XIC", five bits per letter */
+	e[8] = (('X' - '@') << 2) | (('I' - '@') >> 3);
+	e[9] = ((('I' - '@') & 7) << 5) | ('C' - '@');
+	e[10] = 0x01;
+	e[12] = serial & 0xFF;
+	e[13] = (serial >> 8) & 0xFF;
+	e[14] = (serial >> 16) & 0xFF;
+	e[15] = (serial >> 24) & 0xFF;
+	e[16] = 1;		/* week */
+	e[17] = 30;		/* 2020 */
+	e[18] = 1;		/* EDID 1.4 */
+	e[19] = 4;
+	e[20] = 0xA5;		/* digital, 8 bits, DisplayPort */
+	e[21] = 60;		/* cm */
+	e[22] = 34;
+	e[23] = 120;		/* gamma 2.2 */
+	e[24] = 0x06;		/* sRGB is the default color space */
+
+	for (i = 0; i < 8; ++i)
+		bits[i] = chroma_bits (chroma[i]);
+	e[25] = ((bits[0] & 3) << 6) | ((bits[1] & 3) << 4) | ((bits[2] & 3) << 2) | (bits[3] & 3);
+	e[26] = ((bits[4] & 3) << 6) | ((bits[5] & 3) << 4) | ((bits[6] & 3) << 2) | (bits[7] & 3);
+	for (i = 0; i < 8; ++i)
+		e[27 + i] = bits[i] >> 2;
+
+	/* monitor name and serial number descriptors */
+	e[57] = 0xFC;
+	memcpy (e + 59, "Bench Panel\n ", 13);
+	e[75] = 0xFF;
+	g_snprintf ((gchar *) e + 77, 14, "B%010u\n", serial);
+	e[90 + 3] = 0x10;	/* dummy */
+	e[108 + 3] = 0x10;
+
+	for (i = 0; i < 127; ++i)
+		sum += e[i];
+	e[127] = (guint8) (0x100 - sum);
+
+	return g_bytes_new_take (e, 128);
+}
+
+static GOptionEntry config_entries[] = {
+	{ "samples", 's', 0, G_OPTION_ARG_INT, &config.samples,
+		"Takes N timed samples of every benchmark", "N" },
+	{ G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_STRING_ARRAY, &config.patterns,
+		NULL, "[PATTERN...]" },
+	{ NULL }
+};
+
+int
+main (int argc, char *argv[])
+{
+	GOptionContext *opt;
+	GError *err = NULL;
+	gboolean ret;
+
+	opt = g_option_context_new (NULL);
+	g_option_context_set_summary (opt, "Runs the benchmarks whose names contain"
+				      " any of PATTERNs, or all of them");
+	g_option_context_add_main_entries (opt, config_entries, 0);
+	ret = g_option_context_parse (opt, &argc, &argv, &err);
+	g_option_context_free (opt);
+	if (! ret) {
+		g_print ("%s\n", err->message);
+		g_error_free (err);
+		return 1;
+	}
+	if (config.samples < 1) {
+		g_print ("At least one sample is needed\n");
+		return 1;
+	}
+
+	bench_icc ();
+	bench_randr ();
+
+	g_strfreev (config.patterns);
+
+	return 0;
+}
+
+/* vim: set ts=8 sw=8 tw=0 : */
@@ -0,0 +1,23 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Runs the operation being measured iters times */
+typedef void (*bench_fn) (gpointer data, guint64 iters);
+
+void bench_run (const gchar *name, bench_fn fn, gpointer data);
+
+/* Plausible EDID of a monitor, different for every serial */
+GBytes *bench_make_edid (guint serial);
+
+void bench_icc (void);
+void bench_randr (void);
+
+G_END_DECLS
+
+#endif /* __BENCH_H__ */
+
+/* vim: set ts=8 sw=8 tw=0 : */
@@ -0,0 +1,130 @@
+#include "edid-cache.h"
+#include <colord.h>
+#include <glib.h>
+#include <string.h>
+
+/* Unused entries are dropped above this */
+#define EDID_CACHE_MAX_ENTRIES 32
+
+static struct {
+	GHashTable	*table;		/* GBytes -> struct edid_info */
+	guint		hits;
+	guint		misses;
+} cache;
+
+static gchar *
+make_edid_name (CdEdid *edid)
+{
+	int i = 0;
+	const gchar *arr[8];
+	const gchar *vendor = cd_edid_get_vendor_name (edid);
+	const gchar *model = cd_edid_get_monitor_name (edid);
+	const gchar *serial = cd_edid_get_serial_number (edid);
+
+	memset (arr, 0, sizeof(arr));
+	arr[i++] = "xrandr";
+
+	if (vendor)
+		arr[i++] = vendor;
+	if (model)
+		arr[i++] = model;
+	if (serial)
+		arr[i++] = serial;
+
+	if (i <= 1)
+		return NULL;
+
+	return g_strjoinv ("-", (gchar**)arr);
+}
+
+static struct edid_info *
+edid_info_new (GBytes *raw)
+{
+	GError *err = NULL;
+	struct edid_info *info = g_new0 (struct edid_info, 1);
+
+	info->ref = 1;
+	info->raw = g_bytes_ref (raw);
+	info->edid = cd_edid_new ();
+
+	if (! cd_edid_parse (info->edid, raw, &err)) {
+		g_warning ("unable to parse EDID: %s", err->message);
+		g_clear_error (&err);
+		return info;
+	}
+
+	info->md5 = cd_edid_get_checksum (info->edid);
+	info->name = make_edid_name (info->edid);
+
+	return info;
+}
+
+struct edid_info *
+edid_info_ref (struct edid_info *info)
+{
+	g_atomic_int_inc (&info->ref);
+	return info;
+}
+
+void
+edid_info_unref (struct edid_info *info)
+{
+	if (! g_atomic_int_dec_and_test (&info->ref))
+		return;
+	g_bytes_unref (info->raw);
+	g_object_unref (info->edid);
+	g_free (info->name);
+	g_free (info);
+}
+
+static gboolean
+is_unused (gpointer key, gpointer value, gpointer user_data)
+{
+	(void) key;
+	(void) user_data;
+	return g_atomic_int_get (&((struct edid_info *) value)->ref) == 1;
+}
+
+struct edid_info *
+edid_cache_lookup (GBytes *raw)
+{
+	struct edid_info *info;
+
+	if (! cache.table)
+		cache.table = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+			NULL, (GDestroyNotify) edid_info_unref);
+
+	info = g_hash_table_lookup (cache.table, raw);
+	if (info) {
+		++cache.hits;
+		return edid_info_ref (info);
+	}
+
+	++cache.misses;
+
+	if (g_hash_table_size (cache.table) >= EDID_CACHE_MAX_ENTRIES)
+		g_hash_table_foreach_remove (cache.table, is_unused, NULL);
+
+	info = edid_info_new (raw);
+	g_hash_table_insert (cache.table, info->raw, info);
+
+	return edid_info_ref (info);
+}
+
+void
+edid_cache_get_stats (guint *hits, guint *misses)
+{
+	if (hits)
+		*hits = cache.hits;
+	if (misses)
+		*misses = cache.misses;
+}
+
+void
+edid_cache_clear (void)
+{
+	if (cache.table)
+		g_hash_table_remove_all (cache.table);
+}
+
+/* vim: set ts=8 sw=8 tw=0 : */
@@ -0,0 +1,28 @@
+#ifndef __EDID_CACHE_H__
+#define __EDID_CACHE_H__
+
+#include <colord.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Everything derived from one raw EDID blob */
+struct edid_info {
+	gint		ref;
+	GBytes		*raw;
+	CdEdid		*edid;
+	const gchar	*md5;		/* owned by edid, may be NULL */
+	gchar		*name;		/* device name, NULL if EDID lacks data */
+};
+
+struct edid_info *edid_cache_lookup (GBytes *raw);
+struct edid_info *edid_info_ref (struct edid_info *info);
+void edid_info_unref (struct edid_info *info);
+void edid_cache_get_stats (guint *hits, guint *misses);
+void edid_cache_clear (void);
+
+G_END_DECLS
+
+#endif /* __EDID_CACHE_H__ */
+
+/* vim: set ts=8 sw=8 tw=0 : */
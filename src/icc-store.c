@@ -0,0 +1,708 @@
+#include "icc-store.h"
+#include "icc.h"
+#include "stats.h"
+#include "worker.h"
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+/* Like CdIccStore, subdirectories are looked into this deep */
+#define ICC_STORE_MAX_DEPTH	2
+/* The index is written a while after the last change rather than on each */
+#define ICC_STORE_SAVE_DELAY_S	5
+
+#define ICC_INDEX_HEADER	"xiccd-icc-index 2"
+#define ICC_INDEX_NO_PROFILE	"-"
+
+/* A scan, filled in by the thread and handed over to the main loop */
+struct scan_result {
+	gchar		**roots;
+	gchar		*index_path;
+	GHashTable	*index;		/* entries of the files seen only */
+	GHashTable	*keys;		/* filename -> identity */
+	GHashTable	*files;		/* filename -> checksum */
+	GPtrArray	*dirs;
+	guint		validated;	/* found unchanged in the index */
+	guint		hashed;		/* read to get the checksum */
+	gboolean	index_changed;
+};
+
+/* A file that changed, read by a worker thread */
+struct hash_job {
+	struct icc_store *store;
+	gchar		*path;
+	gchar		*key;		/* file identity when it was looked at */
+	gchar		*cksum;		/* as hash_file () returns it */
+};
+
+static inline GHashTable *
+index_new (void)
+{
+	return g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
+
+/*
+ * Profiles may be rewritten in place at the same size within a second,
+ * hence the nanoseconds and the inode change time
+ */
+static gchar *
+file_key (const GStatBuf *st)
+{
+	return g_strdup_printf ("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%"
+				G_GINT64_FORMAT ":%" G_GINT64_FORMAT ".%09ld:%"
+				G_GINT64_FORMAT ".%09ld",
+				(guint64) st->st_dev, (guint64) st->st_ino,
+				(gint64) st->st_size,
+				(gint64) st->st_mtim.tv_sec, (long) st->st_mtim.tv_nsec,
+				(gint64) st->st_ctim.tv_sec, (long) st->st_ctim.tv_nsec);
+}
+
+/* One "identity checksum" line per file, "-" for files that are no profiles */
+static GHashTable *
+index_load (const gchar *path)
+{
+	GHashTable *index = index_new ();
+	gchar *contents = NULL;
+	gchar **lines;
+	gchar **l;
+
+	if (! g_file_get_contents (path, &contents, NULL, NULL))
+		return index;
+
+	lines = g_strsplit (contents, "\n", -1);
+	g_free (contents);
+	if (! lines[0] || strcmp (lines[0], ICC_INDEX_HEADER)) {
+		g_debug ("ignoring ICC index %s: unknown format", path);
+		goto out;
+	}
+
+	for (l = lines + 1; *l; ++l) {
+		gchar *sep = strchr (*l, ' ');
+		if (! sep)
+			continue;
+		*sep++ = '\0';
+		g_hash_table_replace (index, g_strdup (*l),
+			g_strdup (strcmp (sep, ICC_INDEX_NO_PROFILE) ? sep : ""));
+	}
+
+out:
+	g_strfreev (lines);
+	return index;
+}
+
+static void
+index_save (struct icc_store *store)
+{
+	GString *out = g_string_new (ICC_INDEX_HEADER "\n");
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	GError *err = NULL;
+	gchar *dir;
+
+	g_hash_table_iter_init (&iter, store->index);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		const gchar *cksum = (const gchar *) value;
+		g_string_append_printf (out, "%s %s\n", (const gchar *) key,
+					*cksum ? cksum : ICC_INDEX_NO_PROFILE);
+	}
+
+	dir = g_path_get_dirname (store->index_path);
+	g_mkdir_with_parents (dir, 0700);
+	g_free (dir);
+
+	if (! g_file_set_contents (store->index_path, out->str, out->len, &err)) {
+		g_warning ("unable to write ICC index: %s", err->message);
+		g_error_free (err);
+	}
+	g_string_free (out, TRUE);
+	store->index_dirty = FALSE;
+}
+
+static gboolean
+save_timeout (gpointer user_data)
+{
+	struct icc_store *store = (struct icc_store *) user_data;
+	store->save_source = 0;
+	index_save (store);
+	return G_SOURCE_REMOVE;
+}
+
+static void
+index_changed (struct icc_store *store)
+{
+	store->index_dirty = TRUE;
+	if (! store->save_source)
+		store->save_source = g_timeout_add_seconds (ICC_STORE_SAVE_DELAY_S,
+							    save_timeout, store);
+}
+
+/*
+ * Returns the checksum of a profile, "" if the file is none, NULL if it
+ * could not be read. Safe in any thread.
+ */
+static gchar *
+hash_file (const gchar *filename)
+{
+	GError *err = NULL;
+	gchar *cksum = icc_identify (filename, &err);
+
+	if (cksum)
+		return cksum;
+
+	g_debug ("ignoring %s: %s", filename, err->message);
+	/* not worth trying again unless it changes */
+	if (g_error_matches (err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA))
+		cksum = g_strdup ("");
+	g_error_free (err);
+	return cksum;
+}
+
+/* Like hash_file (), an entry found in old is carried over into res */
+static gchar *
+identify (GHashTable *old, struct scan_result *res, const gchar *filename,
+	  const GStatBuf *st, gboolean *hit)
+{
+	gchar *key = file_key (st);
+	const gchar *known = g_hash_table_lookup (old, key);
+	gchar *cksum;
+
+	*hit = (known != NULL);
+	cksum = known ? g_strdup (known) : hash_file (filename);
+	if (cksum) {
+		g_hash_table_replace (res->keys, g_strdup (filename), g_strdup (key));
+		g_hash_table_replace (res->index, key, g_strdup (cksum));
+	} else {
+		g_free (key);
+	}
+	return cksum;
+}
+
+static void
+scan_result_free (gpointer user_data)
+{
+	struct scan_result *res = (struct scan_result *) user_data;
+	g_strfreev (res->roots);
+	g_free (res->index_path);
+	g_hash_table_unref (res->index);
+	g_hash_table_unref (res->keys);
+	g_hash_table_unref (res->files);
+	g_ptr_array_unref (res->dirs);
+	g_free (res);
+}
+
+static void
+scan_dir (struct scan_result *res, GHashTable *old, const gchar *dir, int depth)
+{
+	GDir *d = g_dir_open (dir, 0, NULL);
+	const gchar *name;
+
+	if (! d)
+		return;
+	g_ptr_array_add (res->dirs, g_strdup (dir));
+
+	while ((name = g_dir_read_name (d))) {
+		gchar *path;
+		gchar *cksum;
+		GStatBuf st;
+		gboolean hit;
+
+		/* temporary files of writers among others */
+		if (name[0] == '.')
+			continue;
+
+		path = g_build_filename (dir, name, NULL);
+		if (g_stat (path, &st) < 0) {
+			g_free (path);
+			continue;
+		}
+
+		if (S_ISDIR (st.st_mode)) {
+			if (depth < ICC_STORE_MAX_DEPTH)
+				scan_dir (res, old, path, depth + 1);
+			g_free (path);
+			continue;
+		}
+		if (! S_ISREG (st.st_mode)) {
+			g_free (path);
+			continue;
+		}
+
+		cksum = identify (old, res, path, &st, &hit);
+		if (hit)
+			++res->validated;
+		else
+			++res->hashed;
+
+		if (cksum && *cksum) {
+			g_hash_table_replace (res->files, path, cksum);
+		} else {
+			g_free (cksum);
+			g_free (path);
+		}
+	}
+	g_dir_close (d);
+}
+
+static void
+scan_thread (GTask *task, gpointer src, gpointer task_data, GCancellable *cancel)
+{
+	struct scan_result *res = (struct scan_result *) task_data;
+	GHashTable *old;
+	gchar **root;
+
+	(void) src;
+	(void) cancel;
+
+	/* like CD_ICC_STORE_SEARCH_FLAGS_CREATE_LOCATION */
+	g_mkdir_with_parents (res->roots[0], 0700);
+
+	old = index_load (res->index_path);
+	for (root = res->roots; *root; ++root)
+		scan_dir (res, old, *root, 0);
+	/* files gone since drop out of the index */
+	res->index_changed = res->hashed
+		|| g_hash_table_size (old) != g_hash_table_size (res->index);
+	g_hash_table_unref (old);
+
+	g_task_return_boolean (task, TRUE);
+}
+
+/* A file that is gone or changed leaves no entry behind in the index */
+static void
+drop_key (struct icc_store *store, const gchar *path)
+{
+	const gchar *key = g_hash_table_lookup (store->keys, path);
+
+	if (! key)
+		return;
+	if (g_hash_table_remove (store->index, key))
+		index_changed (store);
+	g_hash_table_remove (store->keys, path);
+}
+
+static void
+set_key (struct icc_store *store, const gchar *path, const gchar *key)
+{
+	const gchar *old = g_hash_table_lookup (store->keys, path);
+
+	if (old && ! strcmp (old, key))
+		return;
+	drop_key (store, path);
+	g_hash_table_replace (store->keys, g_strdup (path), g_strdup (key));
+}
+
+static void
+add_file (struct icc_store *store, const gchar *filename, gchar *cksum)
+{
+	g_hash_table_replace (store->files, g_strdup (filename), cksum);
+	store->added (filename, cksum, store->user_data);
+}
+
+static void
+forget_dir (struct icc_store *store, const gchar *dir)
+{
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	gchar *prefix = g_strconcat (dir, G_DIR_SEPARATOR_S, NULL);
+
+	/* moved away as a whole, nothing is said about what was inside */
+	g_hash_table_iter_init (&iter, store->keys);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		if (! g_str_has_prefix ((const gchar *) key, prefix))
+			continue;
+		if (g_hash_table_remove (store->index, value))
+			index_changed (store);
+		g_hash_table_iter_remove (&iter);
+	}
+
+	g_hash_table_iter_init (&iter, store->files);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		if (! g_str_has_prefix ((const gchar *) key, prefix))
+			continue;
+		store->removed (key, value, store->user_data);
+		g_hash_table_iter_remove (&iter);
+	}
+
+	g_hash_table_iter_init (&iter, store->monitors);
+	while (g_hash_table_iter_next (&iter, &key, NULL)) {
+		if (g_str_has_prefix ((const gchar *) key, prefix))
+			g_hash_table_iter_remove (&iter);
+	}
+	g_hash_table_remove (store->monitors, dir);
+	g_free (prefix);
+}
+
+static void
+forget_path (struct icc_store *store, const gchar *path)
+{
+	const gchar *cksum = g_hash_table_lookup (store->files, path);
+
+	drop_key (store, path);
+	if (! cksum) {
+		if (g_hash_table_contains (store->monitors, path))
+			forget_dir (store, path);
+		return;
+	}
+
+	store->removed (path, cksum, store->user_data);
+	g_hash_table_remove (store->files, path);
+}
+
+static void watch_dir (struct icc_store *store, const gchar *dir);
+
+/* G_MAXINT for directories in none of the roots */
+static int
+dir_depth (struct icc_store *store, const gchar *dir)
+{
+	gchar **root;
+	const gchar *p;
+	int depth = 0;
+
+	for (root = store->roots; *root; ++root) {
+		if (g_str_has_prefix (dir, *root))
+			break;
+	}
+	if (! *root)
+		return G_MAXINT;
+
+	for (p = dir + strlen (*root); *p; ++p) {
+		if (*p == G_DIR_SEPARATOR)
+			++depth;
+	}
+	return depth;
+}
+
+static void add_dir (struct icc_store *store, const gchar *dir);
+
+/* Takes cksum, as hash_file () returns it */
+static void
+update_file (struct icc_store *store, const gchar *path, gchar *cksum)
+{
+	const gchar *known = g_hash_table_lookup (store->files, path);
+
+	if (known && cksum && ! strcmp (known, cksum)) {
+		g_free (cksum);
+		return;
+	}
+
+	/* rewritten with different contents, or no profile any more */
+	if (known) {
+		store->removed (path, known, store->user_data);
+		g_hash_table_remove (store->files, path);
+	}
+	if (cksum && *cksum)
+		add_file (store, path, cksum);
+	else
+		g_free (cksum);
+}
+
+static void
+hash_job_free (gpointer user_data)
+{
+	struct hash_job *job = (struct hash_job *) user_data;
+	g_free (job->path);
+	g_free (job->key);
+	g_free (job->cksum);
+	g_free (job);
+}
+
+static void
+hash_thread (GTask *task, gpointer src, gpointer task_data, GCancellable *cancel)
+{
+	struct hash_job *job = (struct hash_job *) task_data;
+
+	(void) src;
+	(void) cancel;
+
+	job->cksum = hash_file (job->path);
+	g_task_return_boolean (task, TRUE);
+}
+
+static void
+hash_done (GObject *src, GAsyncResult *result, gpointer user_data)
+{
+	struct hash_job *job = g_task_get_task_data (G_TASK (result));
+	struct icc_store *store = job->store;
+	gchar *key;
+	GStatBuf st;
+	GError *err = NULL;
+
+	(void) src;
+	(void) user_data;
+
+	if (! g_task_propagate_boolean (G_TASK (result), &err)) {
+		/* the store is gone already */
+		g_error_free (err);
+		return;
+	}
+
+	if (g_stat (job->path, &st) < 0) {
+		forget_path (store, job->path);
+		return;
+	}
+	/* changed again while it was read, the monitor has queued another look */
+	key = file_key (&st);
+	if (strcmp (key, job->key)) {
+		g_free (key);
+		return;
+	}
+	g_free (key);
+
+	stats_add (STATS_ICC_STORE_HASHED, 1);
+	if (job->cksum) {
+		g_hash_table_replace (store->index, g_strdup (job->key),
+				      g_strdup (job->cksum));
+		index_changed (store);
+		set_key (store, job->path, job->key);
+	} else {
+		drop_key (store, job->path);
+	}
+	update_file (store, job->path, job->cksum);
+	job->cksum = NULL;
+}
+
+static void
+check_path (struct icc_store *store, const gchar *path)
+{
+	gchar *name = g_path_get_basename (path);
+	const gchar *known;
+	struct hash_job *job;
+	GTask *task;
+	GStatBuf st;
+	gboolean hidden = (name[0] == '.');
+
+	g_free (name);
+	if (hidden)
+		return;
+
+	if (g_stat (path, &st) < 0) {
+		forget_path (store, path);
+		return;
+	}
+
+	if (S_ISDIR (st.st_mode)) {
+		if (dir_depth (store, path) <= ICC_STORE_MAX_DEPTH
+		    && ! g_hash_table_contains (store->monitors, path))
+			add_dir (store, path);
+		return;
+	}
+	if (! S_ISREG (st.st_mode))
+		return;
+
+	job = g_new0 (struct hash_job, 1);
+	job->key = file_key (&st);
+	known = g_hash_table_lookup (store->index, job->key);
+	if (known) {
+		stats_add (STATS_ICC_STORE_VALIDATED, 1);
+		set_key (store, path, job->key);
+		update_file (store, path, g_strdup (known));
+		hash_job_free (job);
+		return;
+	}
+
+	/* a large file on a slow disk must not hold up the X connection */
+	job->store = store;
+	job->path = g_strdup (path);
+	task = g_task_new (NULL, store->cancel, hash_done, NULL);
+	g_task_set_task_data (task, job, hash_job_free);
+	worker_run (task, hash_thread);
+	g_object_unref (task);
+}
+
+static void
+add_dir (struct icc_store *store, const gchar *dir)
+{
+	GDir *d = g_dir_open (dir, 0, NULL);
+	const gchar *name;
+
+	if (! d)
+		return;
+	watch_dir (store, dir);
+	while ((name = g_dir_read_name (d))) {
+		gchar *path = g_build_filename (dir, name, NULL);
+		check_path (store, path);
+		g_free (path);
+	}
+	g_dir_close (d);
+}
+
+static void
+monitor_changed_cb (GFileMonitor *mon, GFile *file, GFile *other,
+		    GFileMonitorEvent ev, gpointer user_data)
+{
+	struct icc_store *store = (struct icc_store *) user_data;
+	gchar *path = g_file_get_path (file);
+
+	(void) mon;
+	(void) other;
+
+	switch (ev) {
+	case G_FILE_MONITOR_EVENT_CREATED:
+	case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+		check_path (store, path);
+		break;
+	case G_FILE_MONITOR_EVENT_DELETED:
+		forget_path (store, path);
+		break;
+	default:
+		break;
+	}
+	g_free (path);
+}
+
+static void
+watch_dir (struct icc_store *store, const gchar *dir)
+{
+	GFile *file = g_file_new_for_path (dir);
+	GError *err = NULL;
+	GFileMonitor *mon;
+
+	mon = g_file_monitor_directory (file, G_FILE_MONITOR_NONE, store->cancel, &err);
+	g_object_unref (file);
+	if (! mon) {
+		g_warning ("unable to watch %s: %s", dir, err->message);
+		g_error_free (err);
+		return;
+	}
+
+	g_signal_connect (mon, "changed", G_CALLBACK (monitor_changed_cb), store);
+	g_hash_table_replace (store->monitors, g_strdup (dir), mon);
+}
+
+static void
+scan_done (GObject *src, GAsyncResult *result, gpointer user_data)
+{
+	struct icc_store *store = (struct icc_store *) user_data;
+	struct scan_result *res = g_task_get_task_data (G_TASK (result));
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	GPtrArray *gone;
+	GError *err = NULL;
+	guint i;
+
+	(void) src;
+
+	if (! g_task_propagate_boolean (G_TASK (result), &err)) {
+		/* the store is gone already */
+		g_error_free (err);
+		return;
+	}
+
+	g_hash_table_unref (store->index);
+	store->index = g_hash_table_ref (res->index);
+	g_hash_table_unref (store->keys);
+	store->keys = g_hash_table_ref (res->keys);
+	if (res->index_changed)
+		index_changed (store);
+
+	stats_add (STATS_ICC_STORE_VALIDATED, res->validated);
+	stats_add (STATS_ICC_STORE_HASHED, res->hashed);
+	g_debug ("%u profiles found, %u files validated by the index, %u read",
+		 g_hash_table_size (res->files), res->validated, res->hashed);
+
+	g_hash_table_iter_init (&iter, res->files);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		add_file (store, key, value);
+		g_hash_table_iter_steal (&iter);
+		g_free (key);
+	}
+
+	/*
+	 * Nothing was watched while the thread was busy: each directory is
+	 * listed again once its monitor is in place. Unchanged files are found
+	 * in the index, so this costs a stat () each.
+	 */
+	for (i = 0; i < res->dirs->len; ++i) {
+		const gchar *dir = g_ptr_array_index (res->dirs, i);
+		/* a subdirectory may have been added with its parent */
+		if (! g_hash_table_contains (store->monitors, dir))
+			add_dir (store, dir);
+	}
+	gone = g_ptr_array_new_with_free_func (g_free);
+	g_hash_table_iter_init (&iter, store->files);
+	while (g_hash_table_iter_next (&iter, &key, NULL)) {
+		if (! g_file_test ((const gchar *) key, G_FILE_TEST_EXISTS))
+			g_ptr_array_add (gone, g_strdup (key));
+	}
+	for (i = 0; i < gone->len; ++i)
+		forget_path (store, g_ptr_array_index (gone, i));
+	g_ptr_array_unref (gone);
+
+	if (store->ready)
+		store->ready (store->user_data);
+}
+
+void
+icc_store_init (struct icc_store *store, icc_store_func added,
+		icc_store_func removed, icc_store_ready_func ready,
+		gpointer user_data)
+{
+	/* where CD_ICC_STORE_SEARCH_KIND_USER looks */
+	store->roots = g_new0 (gchar *, 3);
+	store->roots[0] = g_build_filename (g_get_user_data_dir (), "icc", NULL);
+	store->roots[1] = g_build_filename (g_get_home_dir (), ".color", "icc", NULL);
+	store->index_path = g_build_filename (g_get_user_cache_dir (), "xiccd",
+					      "icc-index", NULL);
+	store->files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	store->monitors = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+						 g_object_unref);
+	store->index = index_new ();
+	store->keys = index_new ();
+	store->index_dirty = FALSE;
+	store->save_source = 0;
+	store->cancel = g_cancellable_new ();
+	store->added = added;
+	store->removed = removed;
+	store->ready = ready;
+	store->user_data = user_data;
+}
+
+/* In a worker thread, what is found is announced from the main loop */
+void
+icc_store_scan (struct icc_store *store)
+{
+	GTask *task = g_task_new (NULL, store->cancel, scan_done, store);
+	struct scan_result *res = g_new0 (struct scan_result, 1);
+
+	res->roots = g_strdupv (store->roots);
+	res->index_path = g_strdup (store->index_path);
+	res->index = index_new ();
+	res->keys = index_new ();
+	res->files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	res->dirs = g_ptr_array_new_with_free_func (g_free);
+
+	g_task_set_task_data (task, res, scan_result_free);
+	/* the same few threads as every other profile read */
+	worker_run (task, scan_thread);
+	g_object_unref (task);
+}
+
+gboolean
+icc_store_has_file (struct icc_store *store, const gchar *filename)
+{
+	return g_hash_table_contains (store->files, filename);
+}
+
+void
+icc_store_finalize (struct icc_store *store)
+{
+	g_cancellable_cancel (store->cancel);
+	g_object_unref (store->cancel);
+	if (store->save_source)
+		g_source_remove (store->save_source);
+	if (store->index_dirty)
+		index_save (store);
+
+	g_hash_table_unref (store->monitors);
+	g_hash_table_unref (store->files);
+	g_hash_table_unref (store->index);
+	g_hash_table_unref (store->keys);
+	g_free (store->index_path);
+	g_strfreev (store->roots);
+}
+
+/* vim: set ts=8 sw=8 tw=0 : */
@@ -0,0 +1,46 @@
+#ifndef __ICC_STORE_H__
+#define __ICC_STORE_H__
+
+#include <gio/gio.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef void (*icc_store_func) (const gchar *filename, const gchar *checksum,
+				gpointer user_data);
+typedef void (*icc_store_ready_func) (gpointer user_data);
+
+/*
+ * The profiles in the user's icc directories, by filename. Checksums are
+ * kept in an index by device, inode, size, mtime and ctime across restarts,
+ * so that an unchanged file is never read again.
+ */
+struct icc_store {
+	gchar		**roots;	/* the first one is created if missing */
+	gchar		*index_path;
+	GHashTable	*files;		/* filename -> checksum */
+	GHashTable	*monitors;	/* directory -> GFileMonitor */
+	GHashTable	*index;		/* file identity -> checksum, "" if no profile */
+	GHashTable	*keys;		/* filename -> its identity in the index */
+	gboolean	index_dirty;
+	guint		save_source;
+	GCancellable	*cancel;
+
+	icc_store_func	added;
+	icc_store_func	removed;
+	icc_store_ready_func ready;	/* after the first scan */
+	gpointer	user_data;
+};
+
+void icc_store_init (struct icc_store *store, icc_store_func added,
+		     icc_store_func removed, icc_store_ready_func ready,
+		     gpointer user_data);
+void icc_store_finalize (struct icc_store *store);
+void icc_store_scan (struct icc_store *store);
+gboolean icc_store_has_file (struct icc_store *store, const gchar *filename);
+
+G_END_DECLS
+
+#endif /* __ICC_STORE_H__ */
+
+/* vim: set ts=8 sw=8 tw=0 : */
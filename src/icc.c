@@ -1,53 +1,639 @@
 #include "icc.h"
+#include "ramp-cache.h"
+#include "stats.h"
 #include <colord.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <gio/gio.h>
 #include <glib.h>
+#include <glib/gstdio.h>
+#include <lcms2.h>
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <X11/extensions/Xrandr.h>
 
+/* Curves are sampled this many entries at a time, on the stack */
+#define RAMP_BLOCK 256
+
+/*
+ * Kernels below are plain loops over planar arrays which the compiler
+ * vectorizes. Called with a constant size they have no remainder loop.
+ */
+static inline void
+linear_ramp (guint16 *out, int size)
+{
+	const guint32 max = size - 1;
+	int i;
+	/* i * 0xFFFF / max, rounded to nearest */
+	for (i = 0; i < size; ++i)
+		out[i] = ((guint32) i * 0xFFFF + max / 2) / max;
+}
+
+static inline void
+quantize (guint16 *out, const float *in, int n)
+{
+	int i;
+	/* rounded to nearest, truncating would darken by half a step; clamped
+	 * as integers since float comparisons keep the loop from vectorizing */
+	for (i = 0; i < n; ++i) {
+		gint32 v = (gint32) (in[i] * 65535.0f + 0.5f);
+		v = v < 0 ? 0 : v;
+		v = v > 0xFFFF ? 0xFFFF : v;
+		out[i] = v;
+	}
+}
+
 static void
 reset_gamma (XRRCrtcGamma *gamma)
+{
+	const gsize bytes = gamma->size * sizeof (*gamma->red);
+
+	switch (gamma->size) {
+	case 256:
+		linear_ramp (gamma->red, 256);
+		break;
+	case 1024:
+		linear_ramp (gamma->red, 1024);
+		break;
+	case 4096:
+		linear_ramp (gamma->red, 4096);
+		break;
+	default:
+		linear_ramp (gamma->red, gamma->size);
+		break;
+	}
+	memcpy (gamma->green, gamma->red, bytes);
+	memcpy (gamma->blue, gamma->red, bytes);
+}
+
+/* Reads one curve at the n positions in [0, 1] given */
+typedef void (*sample_func) (const void *curve, const float *pos, float *val, int n);
+
+static void
+sample_curve (unsigned short *out, int size, sample_func sample, const void *curve)
+{
+	float pos[RAMP_BLOCK];
+	float val[RAMP_BLOCK];
+	const float scale = 1.0f / (size - 1);
+	int base, n, i;
+
+	/* 256, 1024 and 4096 entries all come in full blocks */
+	for (base = 0; base < size; base += n) {
+		n = MIN (RAMP_BLOCK, size - base);
+		for (i = 0; i < n; ++i)
+			pos[i] = (base + i) * scale;
+		sample (curve, pos, val, n);
+		if (n == RAMP_BLOCK)
+			quantize (out + base, val, RAMP_BLOCK);
+		else
+			quantize (out + base, val, n);
+	}
+}
+
+static void
+sample_lcms (const void *curve, const float *pos, float *val, int n)
 {
 	int i;
-	for (i = 0; i < gamma->size; ++i) {
-		guint value = i * 0xFFFF / (gamma->size - 1);
-		gamma->red[i]   = value;
-		gamma->green[i] = value;
-		gamma->blue[i]  = value;
+	for (i = 0; i < n; ++i)
+		val[i] = cmsEvalToneCurveFloat ((const cmsToneCurve *) curve, pos[i]);
+}
+
+static gboolean
+lcms_to_gamma (XRRCrtcGamma *gamma, CdIcc *icc)
+{
+	cmsHPROFILE lcms;
+	cmsToneCurve **vcgt = NULL;
+
+	/* straight from lcms, cd_icc_get_vcgt() allocates every entry */
+	lcms = cd_icc_get_handle (icc);
+	if (lcms)
+		vcgt = (cmsToneCurve **) cmsReadTag (lcms, cmsSigVcgtTag);
+	if (! vcgt || ! vcgt[0] || ! vcgt[1] || ! vcgt[2])
+		return FALSE;
+
+	sample_curve (gamma->red, gamma->size, sample_lcms, vcgt[0]);
+	sample_curve (gamma->green, gamma->size, sample_lcms, vcgt[1]);
+	sample_curve (gamma->blue, gamma->size, sample_lcms, vcgt[2]);
+	return TRUE;
+}
+
+/*
+ * Just enough of ICC to get at the vcgt tag, the rest of a profile (LUTs
+ * of several megabytes in calibrated ones) is never looked at.
+ */
+
+#define ICC_HEADER_SIZE		128
+#define ICC_TAG_ENTRY_SIZE	12
+#define ICC_SIG_ACSP		0x61637370
+#define ICC_SIG_VCGT		0x76636774
+
+/* Apple's vcgt tag, which is not part of the ICC standard */
+#define VCGT_HEADER_SIZE	12
+#define VCGT_TYPE_TABLE		0
+#define VCGT_TYPE_FORMULA	1
+
+static inline guint16
+read_be16 (const guint8 *p)
+{
+	return ((guint16) p[0] << 8) | p[1];
+}
+
+static inline guint32
+read_be32 (const guint8 *p)
+{
+	return ((guint32) p[0] << 24) | ((guint32) p[1] << 16)
+	     | ((guint32) p[2] << 8) | p[3];
+}
+
+static inline float
+read_s15f16 (const guint8 *p)
+{
+	return (gint32) read_be32 (p) / 65536.0f;
+}
+
+struct vcgt_table {
+	const guint8	*data;
+	guint		entries;
+	guint		entry_size;	/* 1 or 2 bytes */
+};
+
+static inline float
+vcgt_table_entry (const struct vcgt_table *tab, guint i)
+{
+	if (tab->entry_size == 1)
+		return tab->data[i] / 255.0f;
+	return read_be16 (tab->data + 2 * i) / 65535.0f;
+}
+
+static void
+sample_table (const void *curve, const float *pos, float *val, int n)
+{
+	const struct vcgt_table *tab = (const struct vcgt_table *) curve;
+	const float last = tab->entries - 1;
+	int i;
+
+	/* linear interpolation between entries, like lcms does */
+	for (i = 0; i < n; ++i) {
+		float x = pos[i] * last;
+		guint j = (guint) x;
+		float frac;
+		if (j >= tab->entries - 1)
+			j = tab->entries - 2;
+		frac = x - j;
+		val[i] = vcgt_table_entry (tab, j) * (1.0f - frac)
+		       + vcgt_table_entry (tab, j + 1) * frac;
 	}
 }
 
-void
-icc_to_gamma (XRRCrtcGamma *gamma, CdIcc *icc)
+static void
+copy_table (unsigned short *out, const struct vcgt_table *tab)
 {
-	GPtrArray *vcgt = NULL;
 	guint i;
+	if (tab->entry_size == 1) {
+		for (i = 0; i < tab->entries; ++i)
+			out[i] = tab->data[i] * 257;
+	} else {
+		for (i = 0; i < tab->entries; ++i)
+			out[i] = read_be16 (tab->data + 2 * i);
+	}
+}
+
+struct vcgt_formula {
+	float		gamma;
+	float		min;
+	float		max;
+};
+
+static void
+sample_formula (const void *curve, const float *pos, float *val, int n)
+{
+	const struct vcgt_formula *f = (const struct vcgt_formula *) curve;
+	int i;
+	for (i = 0; i < n; ++i)
+		val[i] = f->min + (f->max - f->min) * powf (pos[i], f->gamma);
+}
+
+static gboolean
+vcgt_table_to_gamma (XRRCrtcGamma *gamma, const guint8 *tag, gsize len)
+{
+	unsigned short *out[3];
+	struct vcgt_table tab;
+	guint channels;
+	gsize chan_size;
+	int c;
+
+	if (len < VCGT_HEADER_SIZE + 6)
+		return FALSE;
+
+	channels = read_be16 (tag + VCGT_HEADER_SIZE);
+	tab.entries = read_be16 (tag + VCGT_HEADER_SIZE + 2);
+	tab.entry_size = read_be16 (tag + VCGT_HEADER_SIZE + 4);
+	/* lcms refuses anything but three channels, a profile must not look
+	 * different depending on which of the two read it */
+	if (channels != 3 || tab.entries < 2
+	    || (tab.entry_size != 1 && tab.entry_size != 2))
+		return FALSE;
+
+	chan_size = (gsize) tab.entries * tab.entry_size;
+	if (3 * chan_size > len - VCGT_HEADER_SIZE - 6)
+		return FALSE;
+
+	out[0] = gamma->red;
+	out[1] = gamma->green;
+	out[2] = gamma->blue;
+
+	for (c = 0; c < 3; ++c) {
+		tab.data = tag + VCGT_HEADER_SIZE + 6 + c * chan_size;
+		/* usually the table is made for exactly this CRTC */
+		if (tab.entries == (guint) gamma->size)
+			copy_table (out[c], &tab);
+		else
+			sample_curve (out[c], gamma->size, sample_table, &tab);
+	}
+
+	return TRUE;
+}
+
+static gboolean
+vcgt_formula_to_gamma (XRRCrtcGamma *gamma, const guint8 *tag, gsize len)
+{
+	unsigned short *out[3];
+	struct vcgt_formula f[3];
+	int c;
+
+	if (len < VCGT_HEADER_SIZE + 36)
+		return FALSE;
+
+	for (c = 0; c < 3; ++c) {
+		const guint8 *p = tag + VCGT_HEADER_SIZE + 12 * c;
+		f[c].gamma = read_s15f16 (p);
+		f[c].min = read_s15f16 (p + 4);
+		f[c].max = read_s15f16 (p + 8);
+		if (f[c].gamma <= 0.0f)
+			return FALSE;
+	}
+
+	out[0] = gamma->red;
+	out[1] = gamma->green;
+	out[2] = gamma->blue;
+
+	for (c = 0; c < 3; ++c)
+		sample_curve (out[c], gamma->size, sample_formula, &f[c]);
+
+	return TRUE;
+}
+
+static gboolean
+vcgt_to_gamma (XRRCrtcGamma *gamma, const guint8 *tag, gsize len)
+{
+	if (len < VCGT_HEADER_SIZE || read_be32 (tag) != ICC_SIG_VCGT)
+		return FALSE;
+
+	switch (read_be32 (tag + 8)) {
+	case VCGT_TYPE_TABLE:
+		return vcgt_table_to_gamma (gamma, tag, len);
+	case VCGT_TYPE_FORMULA:
+		return vcgt_formula_to_gamma (gamma, tag, len);
+	default:
+		return FALSE;
+	}
+}
+
+static gboolean
+parse_profile (struct icc_data *data, GError **err)
+{
+	gsize len;
+	const guint8 *buf = g_bytes_get_data (data->bytes, &len);
+	guint32 size, count, i;
+
+	if (len < ICC_HEADER_SIZE + 4 || read_be32 (buf + 36) != ICC_SIG_ACSP) {
+		g_set_error (err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			     "%s is not an ICC profile", data->filename);
+		return FALSE;
+	}
+
+	size = read_be32 (buf);
+	count = read_be32 (buf + ICC_HEADER_SIZE);
+	if (size > len || size < ICC_HEADER_SIZE + 4
+	    || count > (size - ICC_HEADER_SIZE - 4) / ICC_TAG_ENTRY_SIZE) {
+		g_set_error (err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			     "ICC profile %s is truncated", data->filename);
+		return FALSE;
+	}
+
+	for (i = 0; i < count; ++i) {
+		const guint8 *entry = buf + ICC_HEADER_SIZE + 4 + i * ICC_TAG_ENTRY_SIZE;
+		guint32 offset = read_be32 (entry + 4);
+		guint32 tag_size = read_be32 (entry + 8);
+
+		if (read_be32 (entry) != ICC_SIG_VCGT)
+			continue;
+		if (offset > size || tag_size > size - offset)
+			break; /* CdIcc will have to make sense of it */
+		data->vcgt = buf + offset;
+		data->vcgt_size = tag_size;
+		break;
+	}
+
+	return TRUE;
+}
+
+gchar *
+icc_checksum_for_data (const guint8 *buf, gsize len)
+{
+	static const guint8 no_id[16];
+	const guint8 *id = buf + 84;
+	GString *str;
+	int i;
+
+	/* same as CdIcc: the profile ID if there is one, else MD5 of the data */
+	if (len < ICC_HEADER_SIZE || ! memcmp (id, no_id, sizeof (no_id)))
+		return g_compute_checksum_for_data (G_CHECKSUM_MD5, buf, len);
+
+	str = g_string_sized_new (33);
+	for (i = 0; i < 16; ++i)
+		g_string_append_printf (str, "%02x", id[i]);
+	return g_string_free (str, FALSE);
+}
+
+/* Unused entries are dropped above this */
+#define ICC_CACHE_MAX_ENTRIES 8
+
+static GHashTable *icc_cache;	/* filename -> struct icc_data */
+/* profiles are loaded by worker threads, see worker.h */
+G_LOCK_DEFINE_STATIC (icc_cache);
+
+static inline gint64
+timespec_ns (const struct timespec *ts)
+{
+	return (gint64) ts->tv_sec * G_GINT64_CONSTANT (1000000000) + ts->tv_nsec;
+}
+
+/* A profile may be rewritten in place at the same size within a second */
+static inline gboolean
+same_file (const struct icc_data *data, const GStatBuf *st)
+{
+	return data->dev == (guint64) st->st_dev && data->inode == (guint64) st->st_ino
+	    && data->size == (goffset) st->st_size
+	    && data->mtime == timespec_ns (&st->st_mtim)
+	    && data->ctime == timespec_ns (&st->st_ctim);
+}
 
+static void
+icc_cache_shrink (void)
+{
+	GHashTableIter it;
+	gpointer val;
+
+	if (g_hash_table_size (icc_cache) <= ICC_CACHE_MAX_ENTRIES)
+		return;
+
+	g_hash_table_iter_init (&it, icc_cache);
+	while (g_hash_table_iter_next (&it, NULL, &val)) {
+		struct icc_data *data = (struct icc_data *) val;
+		if (g_atomic_int_get (&data->ref) == 1)
+			g_hash_table_iter_remove (&it);
+	}
+}
+
+struct icc_data *
+icc_data_load (const gchar *filename, GError **err)
+{
+	struct icc_data *data;
+	GStatBuf st;
+	gchar *contents;
+	gsize len;
+
+	if (g_stat (filename, &st) < 0) {
+		int errsv = errno;
+		g_set_error (err, G_FILE_ERROR, g_file_error_from_errno (errsv),
+			     "unable to stat %s: %s", filename, g_strerror (errsv));
+		return NULL;
+	}
+
+	G_LOCK (icc_cache);
+	if (! icc_cache)
+		icc_cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+						   (GDestroyNotify) icc_data_unref);
+
+	data = g_hash_table_lookup (icc_cache, filename);
+	if (data && same_file (data, &st)) {
+		icc_data_ref (data);
+		G_UNLOCK (icc_cache);
+		stats_add (STATS_ICC_LOADS_CACHED, 1);
+		return data;
+	}
+	G_UNLOCK (icc_cache);
+
+	stats_add (STATS_ICC_LOADS, 1);
+
+	data = g_new0 (struct icc_data, 1);
+	data->ref = 1;
+	g_mutex_init (&data->lock);
+	data->filename = g_strdup (filename);
+	data->dev = st.st_dev;
+	data->inode = st.st_ino;
+	data->size = st.st_size;
+	data->mtime = timespec_ns (&st.st_mtim);
+	data->ctime = timespec_ns (&st.st_ctim);
+
+	/*
+	 * A copy, shared by everyone who gets it from the cache: the file may
+	 * be rewritten in place while it is used, and a mapping of it would
+	 * then fault or no longer match the checksum
+	 */
+	if (! g_file_get_contents (filename, &contents, &len, err)) {
+		icc_data_unref (data);
+		return NULL;
+	}
+	data->bytes = g_bytes_new_take (contents, len);
+	if (! parse_profile (data, err)) {
+		icc_data_unref (data);
+		return NULL;
+	}
+	data->checksum = icc_checksum_for_data ((const guint8 *) contents, len);
+
+	/* replaces an outdated entry, or one loaded meanwhile by another thread */
+	G_LOCK (icc_cache);
+	g_hash_table_replace (icc_cache, data->filename, icc_data_ref (data));
+	icc_cache_shrink ();
+	G_UNLOCK (icc_cache);
+
+	return data;
+}
+
+struct icc_data *
+icc_data_new_from_icc (CdIcc *icc)
+{
+	struct icc_data *data = g_new0 (struct icc_data, 1);
+
+	data->ref = 1;
+	g_mutex_init (&data->lock);
+	data->icc = g_object_ref (icc);
+	data->checksum = g_strdup (cd_icc_get_checksum (icc));
+
+	return data;
+}
+
+struct icc_data *
+icc_data_ref (struct icc_data *data)
+{
+	g_atomic_int_inc (&data->ref);
+	return data;
+}
+
+void
+icc_data_unref (struct icc_data *data)
+{
+	if (! g_atomic_int_dec_and_test (&data->ref))
+		return;
+	if (data->bytes)
+		g_bytes_unref (data->bytes);
+	if (data->icc)
+		g_object_unref (data->icc);
+	g_free (data->checksum);
+	g_free (data->filename);
+	g_mutex_clear (&data->lock);
+	g_free (data);
+}
+
+CdIcc *
+icc_data_get_icc (struct icc_data *data, GError **err)
+{
+	CdIcc *icc;
+
+	/* a parse of one profile must not hold up threads using another */
+	g_mutex_lock (&data->lock);
+	if (data->icc)
+		goto out;
+
+	icc = cd_icc_new ();
+	if (! cd_icc_load_data (icc, g_bytes_get_data (data->bytes, NULL),
+				g_bytes_get_size (data->bytes),
+				CD_ICC_LOAD_FLAGS_FALLBACK_MD5, err)) {
+		g_object_unref (icc);
+		goto out;
+	}
+	data->icc = icc;
+
+out:
+	icc = data->icc;
+	g_mutex_unlock (&data->lock);
+	return icc;
+}
+
+/* The whole profile, a new reference the caller has to unref */
+GBytes *
+icc_data_get_bytes (struct icc_data *data, GError **err)
+{
+	GBytes *bytes;
+
+	/* read once loaded, never changed */
+	if (data->filename)
+		return g_bytes_ref (data->bytes);
+
+	/* made in memory, e.g. from EDID, so there is no file */
+	g_mutex_lock (&data->lock);
+	if (! data->bytes)
+		data->bytes = cd_icc_save_data (data->icc, CD_ICC_SAVE_FLAGS_NONE, err);
+	bytes = data->bytes ? g_bytes_ref (data->bytes) : NULL;
+	g_mutex_unlock (&data->lock);
+	return bytes;
+}
+
+void
+icc_data_clear_cache (void)
+{
+	G_LOCK (icc_cache);
+	if (icc_cache)
+		g_hash_table_remove_all (icc_cache);
+	G_UNLOCK (icc_cache);
+}
+
+void
+icc_to_gamma (XRRCrtcGamma *gamma, struct icc_data *data)
+{
+	CdIcc *icc;
+	GError *err = NULL;
+	gboolean ret;
+
+	if (gamma->size < 2) {
+		g_critical ("gamma size %i is too small", gamma->size);
+		return;
+	}
+
+	if (! data) {
+		reset_gamma (gamma);
+		return;
+	}
+
+	if (data->filename) {
+		if (! data->vcgt) {
+			g_debug ("ICC profile has no VCGT");
+			reset_gamma (gamma);
+			return;
+		}
+		if (vcgt_to_gamma (gamma, data->vcgt, data->vcgt_size))
+			return;
+		g_debug ("unusual VCGT in %s, parsing the whole profile", data->filename);
+	}
+
+	icc = icc_data_get_icc (data, &err);
 	if (! icc) {
+		g_critical ("unable to load ICC profile: %s", err->message);
+		g_error_free (err);
 		reset_gamma (gamma);
-		goto out;
+		return;
 	}
 
-	vcgt = cd_icc_get_vcgt (icc, gamma->size, NULL);
-	if (! vcgt) {
+	/* lcms caches what it reads from a profile, unlocked */
+	g_mutex_lock (&data->lock);
+	ret = lcms_to_gamma (gamma, icc);
+	g_mutex_unlock (&data->lock);
+	if (! ret) {
 		g_debug ("ICC profile has no VCGT");
 		reset_gamma (gamma);
-		goto out;
 	}
+}
 
-	g_assert (vcgt->len == (guint) gamma->size);
+/*
+ * From the ramp cache if it was made before, size entries per channel.
+ * NULL if no ramp can be that size.
+ */
+struct gamma_ramp *
+icc_make_ramp (struct icc_data *data, int size)
+{
+	/* "linear" can never clash with a real MD5 checksum */
+	const gchar *cksum = data ? data->checksum : "linear";
+	struct gamma_ramp *ramp = NULL;
+	XRRCrtcGamma gamma;
 
-	for (i = 0; i < vcgt->len; ++i) {
-		CdColorRGB *color = (CdColorRGB *) g_ptr_array_index (vcgt, i);
-		gamma->red[i]   = color->R * 0xFFFF;
-		gamma->green[i] = color->G * 0xFFFF;
-		gamma->blue[i]  = color->B * 0xFFFF;
+	/* icc_to_gamma () would leave it unfilled */
+	if (size < 2) {
+		g_critical ("gamma size %i is too small", size);
+		return NULL;
 	}
 
-out:
-	if (vcgt)
-		g_ptr_array_unref (vcgt);
-}
+	if (cksum) {
+		ramp = ramp_cache_lookup (cksum, size);
+		if (ramp)
+			return ramp;
+	}
 
+	ramp = gamma_ramp_new (size);
+	gamma.size = ramp->size;
+	gamma.red = ramp->red;
+	gamma.green = ramp->green;
+	gamma.blue = ramp->blue;
+	icc_to_gamma (&gamma, data);
+
+	if (cksum)
+		ramp_cache_insert (cksum, ramp);
+
+	return ramp;
+}
 
 CdIcc *
 icc_from_edid (CdEdid *edid)
@@ -76,21 +662,104 @@ icc_from_edid (CdEdid *edid)
 	return icc;
 }
 
+static gboolean
+write_all (int fd, const guint8 *buf, gsize len)
+{
+	while (len) {
+		gssize n = write (fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return FALSE;
+		buf += n;
+		len -= n;
+	}
+	return TRUE;
+}
+
+/*
+ * Through a hidden file in the same directory renamed over filename, so that
+ * a directory monitor never sees half of it.
+ */
+gboolean
+icc_save_atomically (CdIcc *icc, const gchar *filename, GError **err)
+{
+	gchar *dir = g_path_get_dirname (filename);
+	gchar *base = g_path_get_basename (filename);
+	gchar *tmp = g_strdup_printf ("%s%c.%s.XXXXXX", dir, G_DIR_SEPARATOR, base);
+	GBytes *bytes;
+	gboolean ret = FALSE;
+	int errsv;
+	int fd;
+
+	bytes = cd_icc_save_data (icc, CD_ICC_SAVE_FLAGS_NONE, err);
+	if (! bytes)
+		goto out;
+
+	g_mkdir_with_parents (dir, 0700);
+	fd = g_mkstemp_full (tmp, O_WRONLY, 0644);
+	if (fd < 0) {
+		errsv = errno;
+		g_set_error (err, G_FILE_ERROR, g_file_error_from_errno (errsv),
+			     "unable to create %s: %s", tmp, g_strerror (errsv));
+		goto out;
+	}
+
+	if (! write_all (fd, g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes))
+	    || fsync (fd) < 0) {
+		errsv = errno;
+		close (fd);
+		g_unlink (tmp);
+		g_set_error (err, G_FILE_ERROR, g_file_error_from_errno (errsv),
+			     "unable to write %s: %s", tmp, g_strerror (errsv));
+		goto out;
+	}
+	close (fd);
+
+	if (g_rename (tmp, filename) < 0) {
+		errsv = errno;
+		g_unlink (tmp);
+		g_set_error (err, G_FILE_ERROR, g_file_error_from_errno (errsv),
+			     "unable to rename %s: %s", tmp, g_strerror (errsv));
+		goto out;
+	}
+	ret = TRUE;
+
+out:
+	if (bytes)
+		g_bytes_unref (bytes);
+	g_free (tmp);
+	g_free (base);
+	g_free (dir);
+	return ret;
+}
+
+/* The checksum CdIcc would have, without parsing the profile */
 gchar *
-icc_identify (GFile *file)
+icc_identify (const gchar *filename, GError **err)
 {
+	GMappedFile *map;
+	const guint8 *buf;
+	gsize len;
 	gchar *retval = NULL;
-	CdIcc *icc = cd_icc_new ();
-	gboolean ret;
 
-	ret = cd_icc_load_file (icc, file, CD_ICC_LOAD_FLAGS_FALLBACK_MD5, NULL, NULL);
-	if (! ret)
+	map = g_mapped_file_new (filename, FALSE, err);
+	if (! map)
+		return NULL;
+
+	buf = (const guint8 *) g_mapped_file_get_contents (map);
+	len = g_mapped_file_get_length (map);
+	if (len < ICC_HEADER_SIZE || read_be32 (buf + 36) != ICC_SIG_ACSP) {
+		g_set_error (err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			     "%s is not an ICC profile", filename);
 		goto out;
+	}
 
-	retval = g_strdup (cd_icc_get_checksum (icc));
+	/* mapped: with a profile ID in the header nothing else is read */
+	retval = icc_checksum_for_data (buf, len);
 
 out:
-	g_object_unref (icc);
+	g_mapped_file_unref (map);
 	return retval;
 }
 
@@ -5,9 +5,41 @@
 #include <glib.h>
 #include <X11/extensions/Xrandr.h>
 
-void icc_to_gamma (XRRCrtcGamma *gamma, CdIcc *icc);
+struct gamma_ramp;
+
+/* A profile as far as gamma ramps and _ICC_PROFILE are concerned */
+struct icc_data {
+	gint		ref;
+	gchar		*filename;	/* NULL if made in memory */
+	const guint8	*vcgt;		/* tag inside bytes, NULL if none */
+	gsize		vcgt_size;
+	gchar		*checksum;	/* profile ID, or MD5 of the data */
+	CdIcc		*icc;		/* fully parsed, only once needed */
+	GBytes		*bytes;		/* the whole profile as read, or made in memory once needed */
+	GMutex		lock;		/* guards icc, and bytes made in memory */
+
+	/* to tell whether the file has changed */
+	guint64		dev;
+	guint64		inode;
+	goffset		size;
+	gint64		mtime;		/* in nanoseconds */
+	gint64		ctime;		/* in nanoseconds */
+};
+
+struct icc_data *icc_data_load (const gchar *filename, GError **err);
+struct icc_data *icc_data_new_from_icc (CdIcc *icc);
+struct icc_data *icc_data_ref (struct icc_data *data);
+void icc_data_unref (struct icc_data *data);
+CdIcc *icc_data_get_icc (struct icc_data *data, GError **err);
+GBytes *icc_data_get_bytes (struct icc_data *data, GError **err);
+void icc_data_clear_cache (void);
+gchar *icc_checksum_for_data (const guint8 *buf, gsize len);
+
+void icc_to_gamma (XRRCrtcGamma *gamma, struct icc_data *data);
+struct gamma_ramp *icc_make_ramp (struct icc_data *data, int size);
 CdIcc *icc_from_edid (CdEdid *edid);
-gchar *icc_identify (GFile *file);
+gboolean icc_save_atomically (CdIcc *icc, const gchar *filename, GError **err);
+gchar *icc_identify (const gchar *filename, GError **err);
 
 #endif /* __ICC_H__ */
 
@@ -0,0 +1,153 @@
+#include "latency.h"
+#include "stats.h"
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Only the most recent hotplugs are kept for the distributions */
+#define LATENCY_SAMPLES 256
+
+static const gchar *const stage_names[LATENCY_N_STAGES] = {
+	"event", "display added", "device created", "profile loaded", "gamma set"
+};
+
+/* Monotonic times of the stages a display went through, 0 if not yet */
+struct latency_track {
+	gint64		at[LATENCY_N_STAGES];
+};
+
+/* Time from the event to a stage, in microseconds */
+struct latency_dist {
+	gint64		samples[LATENCY_SAMPLES];
+	guint		count;		/* ever recorded, the last ones are kept */
+};
+
+static struct {
+	GHashTable		*pending;	/* display name -> struct latency_track */
+	gint64			started;	/* until the first display is done */
+	struct latency_dist	dist[LATENCY_N_STAGES];
+} lat;
+
+static void
+record (enum latency_stage stage, gint64 usec)
+{
+	struct latency_dist *d = &lat.dist[stage];
+	d->samples[d->count % LATENCY_SAMPLES] = usec;
+	++d->count;
+}
+
+static void
+finish (const gchar *display, const struct latency_track *t)
+{
+	GString *msg = g_string_new (NULL);
+	int s;
+
+	for (s = LATENCY_EVENT + 1; s < LATENCY_N_STAGES; ++s) {
+		if (! t->at[s])
+			continue;
+		record (s, t->at[s] - t->at[LATENCY_EVENT]);
+		g_string_append_printf (msg, ", %s after %.1f ms", stage_names[s],
+					(t->at[s] - t->at[LATENCY_EVENT]) / 1000.0);
+	}
+
+	stats_observe (STATS_HOTPLUG_TIME, t->at[LATENCY_GAMMA_SET] - t->at[LATENCY_EVENT]);
+	g_debug ("display %s%s", display, msg->str);
+	g_string_free (msg, TRUE);
+
+	if (lat.started) {
+		g_message ("first display %s calibrated %.1f ms after startup", display,
+			   (t->at[LATENCY_GAMMA_SET] - lat.started) / 1000.0);
+		lat.started = 0;
+	}
+}
+
+/* The first display calibrated after this is reported once */
+void
+latency_startup (gint64 started)
+{
+	lat.started = started;
+}
+
+void
+latency_begin (const gchar *display, gint64 event_time)
+{
+	struct latency_track *t;
+
+	if (! lat.pending)
+		lat.pending = g_hash_table_new_full (g_str_hash, g_str_equal,
+						     g_free, g_free);
+
+	t = g_new0 (struct latency_track, 1);
+	t->at[LATENCY_EVENT] = event_time ? event_time : g_get_monotonic_time ();
+	/* the same monitor back again starts over */
+	g_hash_table_replace (lat.pending, g_strdup (display), t);
+}
+
+void
+latency_mark (const gchar *display, enum latency_stage stage)
+{
+	struct latency_track *t;
+
+	if (! lat.pending)
+		return;
+	t = g_hash_table_lookup (lat.pending, display);
+	/* not a new display, or it already got there */
+	if (! t || t->at[stage])
+		return;
+
+	t->at[stage] = g_get_monotonic_time ();
+
+	if (stage == LATENCY_GAMMA_SET) {
+		finish (display, t);
+		g_hash_table_remove (lat.pending, display);
+	}
+}
+
+void
+latency_forget (const gchar *display)
+{
+	if (lat.pending)
+		g_hash_table_remove (lat.pending, display);
+}
+
+static int
+cmp_usec (gconstpointer a, gconstpointer b)
+{
+	gint64 x = *(const gint64 *) a;
+	gint64 y = *(const gint64 *) b;
+	return (x > y) - (x < y);
+}
+
+void
+latency_report (void)
+{
+	gint64 sorted[LATENCY_SAMPLES];
+	int s;
+
+	for (s = LATENCY_EVENT + 1; s < LATENCY_N_STAGES; ++s) {
+		const struct latency_dist *d = &lat.dist[s];
+		guint n = MIN (d->count, LATENCY_SAMPLES);
+
+		if (! n)
+			continue;
+
+		memcpy (sorted, d->samples, n * sizeof (gint64));
+		qsort (sorted, n, sizeof (gint64), cmp_usec);
+		g_message ("hotplug to %s: %u times, median %.1f ms, 90%% %.1f ms,"
+			   " 99%% %.1f ms, max %.1f ms", stage_names[s], d->count,
+			   sorted[(n - 1) / 2] / 1000.0, sorted[(n - 1) * 90 / 100] / 1000.0,
+			   sorted[(n - 1) * 99 / 100] / 1000.0, sorted[n - 1] / 1000.0);
+	}
+}
+
+void
+latency_clear (void)
+{
+	if (lat.pending) {
+		g_hash_table_unref (lat.pending);
+		lat.pending = NULL;
+	}
+	memset (lat.dist, 0, sizeof (lat.dist));
+}
+
+/* vim: set ts=8 sw=8 tw=0 : */
@@ -0,0 +1,29 @@
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* What happens between a monitor showing up and its ramp being on the CRTC */
+enum latency_stage {
+	LATENCY_EVENT,			/* RandR told us */
+	LATENCY_DISPLAY_ADDED,
+	LATENCY_DEVICE_CREATED,		/* in colord */
+	LATENCY_PROFILE_LOADED,
+	LATENCY_GAMMA_SET,
+	LATENCY_N_STAGES
+};
+
+void latency_startup (gint64 started);
+void latency_begin (const gchar *display, gint64 event_time);
+void latency_mark (const gchar *display, enum latency_stage stage);
+void latency_forget (const gchar *display);
+void latency_report (void);
+void latency_clear (void);
+
+G_END_DECLS
+
+#endif /* __LATENCY_H__ */
+
+/* vim: set ts=8 sw=8 tw=0 : */
@@ -0,0 +1,185 @@
+#include "op-queue.h"
+#include <gio/gio.h>
+#include <glib.h>
+
+struct op_chain {
+	gchar			*key;
+	struct op_queue		*queue;
+	GQueue			pending;	/* of struct op, oldest first */
+	struct op		*running;	/* NULL if idle */
+};
+
+static void
+op_free (struct op *op)
+{
+	op->klass->free (op);
+}
+
+static void
+op_chain_free (struct op_chain *chain)
+{
+	struct op *op;
+
+	while ((op = g_queue_pop_head (&chain->pending)) != NULL)
+		op_free (op);
+	/* its callback is still to come and will find no chain */
+	if (chain->running)
+		chain->running->chain = NULL;
+	g_free (chain->key);
+	g_free (chain);
+}
+
+static void
+op_chain_run_next (struct op_chain *chain)
+{
+	struct op *op = g_queue_pop_head (&chain->pending);
+
+	if (! op) {
+		/* frees the chain */
+		g_hash_table_remove (chain->queue->chains, chain->key);
+		return;
+	}
+
+	g_debug ("%s %s", op->klass->name, chain->key);
+	chain->running = op;
+	trace_span_begin (&op->span);
+	op->klass->run (op);
+}
+
+void
+op_queue_init (struct op_queue *queue)
+{
+	queue->chains = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+					       (GDestroyNotify) op_chain_free);
+	queue->cancel = g_cancellable_new ();
+	queue->held = FALSE;
+	queue->closed = FALSE;
+}
+
+void
+op_queue_finalize (struct op_queue *queue)
+{
+	g_cancellable_cancel (queue->cancel);
+	g_hash_table_unref (queue->chains);
+	g_object_unref (queue->cancel);
+}
+
+void
+op_init (struct op *op, const struct op_class *klass)
+{
+	op->klass = klass;
+	op->chain = NULL;
+	op->cancel = NULL;
+	trace_span_init (&op->span, klass->name, NULL, NULL);
+}
+
+void
+op_queue_push (struct op_queue *queue, const gchar *key, struct op *op)
+{
+	struct op_chain *chain;
+	GList *l;
+
+	if (queue->closed) {
+		g_debug ("%s %s dropped", op->klass->name, key);
+		op_free (op);
+		return;
+	}
+
+	chain = g_hash_table_lookup (queue->chains, key);
+	if (! chain) {
+		chain = g_new0 (struct op_chain, 1);
+		chain->key = g_strdup (key);
+		chain->queue = queue;
+		g_queue_init (&chain->pending);
+		g_hash_table_insert (queue->chains, chain->key, chain);
+	}
+
+	if (op->klass->supersedes) {
+		struct op *old;
+		while ((old = g_queue_pop_head (&chain->pending)) != NULL) {
+			g_debug ("%s %s dropped by %s", old->klass->name, key,
+				 op->klass->name);
+			op_free (old);
+		}
+	} else if (op->klass->equal) {
+		for (l = chain->pending.head; l; l = l->next) {
+			struct op *old = (struct op *) l->data;
+			if (old->klass == op->klass && op->klass->equal (old, op)) {
+				g_debug ("%s %s already queued", op->klass->name, key);
+				op_free (op);
+				return;
+			}
+		}
+	}
+
+	op->chain = chain;
+	op->cancel = queue->cancel;
+	g_queue_push_tail (&chain->pending, op);
+
+	if (! chain->running && ! queue->held)
+		op_chain_run_next (chain);
+}
+
+/* Operations are queued but not run, e.g. until colord is there */
+void
+op_queue_hold (struct op_queue *queue)
+{
+	queue->held = TRUE;
+}
+
+void
+op_queue_release (struct op_queue *queue)
+{
+	GHashTableIter it;
+	gpointer val;
+	GPtrArray *idle;
+	guint i;
+
+	if (! queue->held)
+		return;
+	queue->held = FALSE;
+
+	/* running an operation may add or remove chains */
+	idle = g_ptr_array_new ();
+	g_hash_table_iter_init (&it, queue->chains);
+	while (g_hash_table_iter_next (&it, NULL, &val)) {
+		if (! ((struct op_chain *) val)->running)
+			g_ptr_array_add (idle, g_strdup (((struct op_chain *) val)->key));
+	}
+	for (i = 0; i < idle->len; ++i) {
+		struct op_chain *chain = g_hash_table_lookup (queue->chains,
+							      g_ptr_array_index (idle, i));
+		if (chain && ! chain->running)
+			op_chain_run_next (chain);
+		g_free (g_ptr_array_index (idle, i));
+	}
+	g_ptr_array_unref (idle);
+}
+
+/* What is queued is dropped, and so is anything pushed later */
+void
+op_queue_close (struct op_queue *queue)
+{
+	g_debug ("dropping %u queues of operations", g_hash_table_size (queue->chains));
+	queue->closed = TRUE;
+	queue->held = FALSE;
+	g_hash_table_remove_all (queue->chains);
+}
+
+void
+op_done (struct op *op)
+{
+	struct op_chain *chain = op->chain;
+
+	trace_span_end (&op->span);
+	op_free (op);
+
+	if (! chain)
+		return;
+
+	chain->running = NULL;
+	if (! chain->queue->held)
+		op_chain_run_next (chain);
+}
+
+/* vim: set ts=8 sw=8 tw=0 : */
@@ -0,0 +1,54 @@
+#ifndef __OP_QUEUE_H__
+#define __OP_QUEUE_H__
+
+#include "trace.h"
+#include <gio/gio.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+struct op;
+struct op_chain;
+
+struct op_class {
+	const gchar	*name;
+	/* starts the operation, which calls op_done () when finished */
+	void		(*run) (struct op *op);
+	void		(*free) (struct op *op);
+	/* a queued operation equal to a new one makes the latter redundant,
+	 * NULL if operations of the class never are */
+	gboolean	(*equal) (const struct op *a, const struct op *b);
+	/* operations queued before this one are pointless */
+	gboolean	supersedes;
+};
+
+/* Embedded at the start of every operation */
+struct op {
+	const struct op_class	*klass;
+	struct op_chain		*chain;		/* NULL if orphaned */
+	GCancellable		*cancel;	/* for async calls made by run */
+	struct trace_span	span;		/* from run to op_done () */
+};
+
+/* Asynchronous operations on objects, run in order one at a time per key */
+struct op_queue {
+	GHashTable		*chains;	/* key -> struct op_chain */
+	GCancellable		*cancel;
+	gboolean		held;		/* nothing is run until released */
+	gboolean		closed;		/* nothing is queued any more */
+};
+
+void op_queue_init (struct op_queue *queue);
+void op_queue_finalize (struct op_queue *queue);
+void op_queue_push (struct op_queue *queue, const gchar *key, struct op *op);
+void op_queue_hold (struct op_queue *queue);
+void op_queue_release (struct op_queue *queue);
+void op_queue_close (struct op_queue *queue);
+void op_init (struct op *op, const struct op_class *klass);
+void op_done (struct op *op);
+
+G_END_DECLS
+
+#endif /* __OP_QUEUE_H__ */
+
+/* vim: set ts=8 sw=8 tw=0 : */
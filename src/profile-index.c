@@ -0,0 +1,82 @@
+#include "profile-index.h"
+#include <colord.h>
+#include <glib.h>
+
+void
+profile_index_init (struct profile_index *index)
+{
+	index->by_edid = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+						(GDestroyNotify) g_ptr_array_unref);
+	index->edid_of = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
+
+void
+profile_index_finalize (struct profile_index *index)
+{
+	g_hash_table_unref (index->edid_of);
+	g_hash_table_unref (index->by_edid);
+}
+
+static gint
+find_profile (GPtrArray *profiles, const gchar *path)
+{
+	guint i;
+	for (i = 0; i < profiles->len; ++i) {
+		CdProfile *profile = g_ptr_array_index (profiles, i);
+		if (! g_strcmp0 (cd_profile_get_object_path (profile), path))
+			return i;
+	}
+	return -1;
+}
+
+void
+profile_index_add (struct profile_index *index, const gchar *edid_md5,
+		   CdProfile *profile)
+{
+	const gchar *path = cd_profile_get_object_path (profile);
+	GPtrArray *profiles;
+
+	if (! path)
+		return;
+
+	/* a profile does not change its metadata but may be reported twice */
+	profile_index_remove (index, path);
+
+	profiles = g_hash_table_lookup (index->by_edid, edid_md5);
+	if (! profiles) {
+		profiles = g_ptr_array_new_with_free_func (g_object_unref);
+		g_hash_table_insert (index->by_edid, g_strdup (edid_md5), profiles);
+	}
+	g_ptr_array_add (profiles, g_object_ref (profile));
+	g_hash_table_insert (index->edid_of, g_strdup (path), g_strdup (edid_md5));
+}
+
+void
+profile_index_remove (struct profile_index *index, const gchar *path)
+{
+	const gchar *edid_md5 = g_hash_table_lookup (index->edid_of, path);
+	GPtrArray *profiles;
+	gint i;
+
+	if (! edid_md5)
+		return;
+
+	profiles = g_hash_table_lookup (index->by_edid, edid_md5);
+	if (profiles) {
+		i = find_profile (profiles, path);
+		if (i >= 0)
+			g_ptr_array_remove_index_fast (profiles, i);
+		if (profiles->len == 0)
+			g_hash_table_remove (index->by_edid, edid_md5);
+	}
+	/* frees edid_md5 */
+	g_hash_table_remove (index->edid_of, path);
+}
+
+GPtrArray *
+profile_index_lookup (struct profile_index *index, const gchar *edid_md5)
+{
+	return g_hash_table_lookup (index->by_edid, edid_md5);
+}
+
+/* vim: set ts=8 sw=8 tw=0 : */
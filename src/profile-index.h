@@ -0,0 +1,26 @@
+#ifndef __PROFILE_INDEX_H__
+#define __PROFILE_INDEX_H__
+
+#include <colord.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Profiles made for a particular monitor, by EDID checksum */
+struct profile_index {
+	GHashTable	*by_edid;	/* EDID md5 -> GPtrArray of CdProfile */
+	GHashTable	*edid_of;	/* D-Bus object path -> EDID md5 */
+};
+
+void profile_index_init (struct profile_index *index);
+void profile_index_finalize (struct profile_index *index);
+void profile_index_add (struct profile_index *index, const gchar *edid_md5,
+			CdProfile *profile);
+void profile_index_remove (struct profile_index *index, const gchar *path);
+GPtrArray *profile_index_lookup (struct profile_index *index, const gchar *edid_md5);
+
+G_END_DECLS
+
+#endif /* __PROFILE_INDEX_H__ */
+
+/* vim: set ts=8 sw=8 tw=0 : */
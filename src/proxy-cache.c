@@ -0,0 +1,107 @@
+#include "proxy-cache.h"
+#include "stats.h"
+#include <glib.h>
+#include <glib-object.h>
+
+struct proxy_cache_entry {
+	gchar		*id;
+	gchar		*path;
+	GObject		*proxy;
+};
+
+static void
+proxy_cache_entry_free (struct proxy_cache_entry *entry)
+{
+	g_free (entry->id);
+	g_free (entry->path);
+	g_object_unref (entry->proxy);
+	g_free (entry);
+}
+
+void
+proxy_cache_init (struct proxy_cache *cache, const gchar *name)
+{
+	cache->name = name;
+	cache->by_id = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+					      (GDestroyNotify) proxy_cache_entry_free);
+	cache->by_path = g_hash_table_new (g_str_hash, g_str_equal);
+}
+
+void
+proxy_cache_finalize (struct proxy_cache *cache)
+{
+	g_hash_table_unref (cache->by_path);
+	g_hash_table_unref (cache->by_id);
+}
+
+static void
+proxy_cache_drop (struct proxy_cache *cache, struct proxy_cache_entry *entry)
+{
+	g_debug ("forgetting %s %s", cache->name, entry->id);
+	g_hash_table_remove (cache->by_path, entry->path);
+	g_hash_table_remove (cache->by_id, entry->id);
+}
+
+void
+proxy_cache_add (struct proxy_cache *cache, const gchar *id, const gchar *path,
+		 gpointer proxy)
+{
+	struct proxy_cache_entry *entry;
+
+	if (! id || ! path)
+		return;
+
+	entry = g_hash_table_lookup (cache->by_id, id);
+	if (entry) {
+		if (entry->proxy == proxy)
+			return;
+		proxy_cache_drop (cache, entry);
+	}
+	/* an object path is never reused for another ID, but be careful */
+	entry = g_hash_table_lookup (cache->by_path, path);
+	if (entry)
+		proxy_cache_drop (cache, entry);
+
+	entry = g_new (struct proxy_cache_entry, 1);
+	entry->id = g_strdup (id);
+	entry->path = g_strdup (path);
+	entry->proxy = g_object_ref (proxy);
+	g_hash_table_insert (cache->by_id, entry->id, entry);
+	g_hash_table_insert (cache->by_path, entry->path, entry);
+}
+
+gpointer
+proxy_cache_lookup (struct proxy_cache *cache, const gchar *id)
+{
+	struct proxy_cache_entry *entry = g_hash_table_lookup (cache->by_id, id);
+
+	stats_proxy_cache (cache->name, entry != NULL);
+	return entry ? entry->proxy : NULL;
+}
+
+gpointer
+proxy_cache_lookup_path (struct proxy_cache *cache, const gchar *path)
+{
+	struct proxy_cache_entry *entry = g_hash_table_lookup (cache->by_path, path);
+
+	stats_proxy_cache (cache->name, entry != NULL);
+	return entry ? entry->proxy : NULL;
+}
+
+void
+proxy_cache_remove (struct proxy_cache *cache, const gchar *id)
+{
+	struct proxy_cache_entry *entry = g_hash_table_lookup (cache->by_id, id);
+	if (entry)
+		proxy_cache_drop (cache, entry);
+}
+
+void
+proxy_cache_remove_path (struct proxy_cache *cache, const gchar *path)
+{
+	struct proxy_cache_entry *entry = g_hash_table_lookup (cache->by_path, path);
+	if (entry)
+		proxy_cache_drop (cache, entry);
+}
+
+/* vim: set ts=8 sw=8 tw=0 : */
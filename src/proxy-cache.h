@@ -0,0 +1,29 @@
+#ifndef __PROXY_CACHE_H__
+#define __PROXY_CACHE_H__
+
+#include <glib.h>
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+/* Connected colord proxies, so that they need not be looked up again */
+struct proxy_cache {
+	const gchar	*name;		/* for messages and stats */
+	GHashTable	*by_id;		/* ID -> struct proxy_cache_entry */
+	GHashTable	*by_path;	/* D-Bus object path -> same */
+};
+
+void proxy_cache_init (struct proxy_cache *cache, const gchar *name);
+void proxy_cache_finalize (struct proxy_cache *cache);
+void proxy_cache_add (struct proxy_cache *cache, const gchar *id, const gchar *path,
+		      gpointer proxy);
+gpointer proxy_cache_lookup (struct proxy_cache *cache, const gchar *id);
+gpointer proxy_cache_lookup_path (struct proxy_cache *cache, const gchar *path);
+void proxy_cache_remove (struct proxy_cache *cache, const gchar *id);
+void proxy_cache_remove_path (struct proxy_cache *cache, const gchar *path);
+
+G_END_DECLS
+
+#endif /* __PROXY_CACHE_H__ */
+
+/* vim: set ts=8 sw=8 tw=0 : */
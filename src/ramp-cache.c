@@ -0,0 +1,159 @@
+#include "ramp-cache.h"
+#include <glib.h>
+#include <string.h>
+
+/* Enough for a few dozen 4096-entry ramps */
+#define RAMP_CACHE_LIMIT (1024 * 1024)
+
+struct ramp_cache_entry {
+	GList			link;	/* in cache.lru, data points to self */
+	gchar			*key;
+	struct gamma_ramp	*ramp;
+};
+
+static struct {
+	GHashTable	*table;
+	GQueue		lru;	/* most recently used first */
+	gsize		bytes;
+	guint		hits;
+	guint		misses;
+} cache = {
+	NULL, G_QUEUE_INIT, 0, 0, 0
+};
+/* ramps are also made by worker threads */
+G_LOCK_DEFINE_STATIC (cache);
+
+static inline gsize
+ramp_bytes (const struct gamma_ramp *ramp)
+{
+	return sizeof (*ramp) + 3 * ramp->size * sizeof (guint16);
+}
+
+struct gamma_ramp *
+gamma_ramp_new (int size)
+{
+	struct gamma_ramp *ramp;
+
+	g_assert (size > 0);
+
+	/* single block: header followed by planar red, green and blue */
+	ramp = g_malloc (sizeof (*ramp) + 3 * size * sizeof (guint16));
+	ramp->ref = 1;
+	ramp->size = size;
+	ramp->red = (guint16 *) (ramp + 1);
+	ramp->green = ramp->red + size;
+	ramp->blue = ramp->green + size;
+
+	return ramp;
+}
+
+struct gamma_ramp *
+gamma_ramp_ref (struct gamma_ramp *ramp)
+{
+	g_atomic_int_inc (&ramp->ref);
+	return ramp;
+}
+
+void
+gamma_ramp_unref (struct gamma_ramp *ramp)
+{
+	if (g_atomic_int_dec_and_test (&ramp->ref))
+		g_free (ramp);
+}
+
+static void
+ramp_cache_entry_free (struct ramp_cache_entry *entry)
+{
+	g_queue_unlink (&cache.lru, &entry->link);
+	cache.bytes -= ramp_bytes (entry->ramp);
+	gamma_ramp_unref (entry->ramp);
+	g_free (entry->key);
+	g_free (entry);
+}
+
+static inline void
+make_key (gchar *buf, gsize len, const gchar *cksum, int size)
+{
+	g_snprintf (buf, len, "%s:%i", cksum, size);
+}
+
+static void
+ramp_cache_shrink (const struct ramp_cache_entry *keep)
+{
+	while (cache.bytes > RAMP_CACHE_LIMIT) {
+		GList *tail = g_queue_peek_tail_link (&cache.lru);
+		struct ramp_cache_entry *entry;
+
+		if (! tail || tail->data == keep)
+			break;
+
+		entry = (struct ramp_cache_entry *) tail->data;
+		g_debug ("evicting gamma ramp %s", entry->key);
+		g_hash_table_remove (cache.table, entry->key);
+	}
+}
+
+struct gamma_ramp *
+ramp_cache_lookup (const gchar *cksum, int size)
+{
+	gchar key[128];
+	struct ramp_cache_entry *entry = NULL;
+	struct gamma_ramp *ramp = NULL;
+
+	make_key (key, sizeof (key), cksum, size);
+
+	G_LOCK (cache);
+	if (cache.table)
+		entry = g_hash_table_lookup (cache.table, key);
+
+	if (! entry) {
+		++cache.misses;
+		goto out;
+	}
+
+	++cache.hits;
+	g_queue_unlink (&cache.lru, &entry->link);
+	g_queue_push_head_link (&cache.lru, &entry->link);
+	ramp = gamma_ramp_ref (entry->ramp);
+
+out:
+	G_UNLOCK (cache);
+	return ramp;
+}
+
+void
+ramp_cache_insert (const gchar *cksum, struct gamma_ramp *ramp)
+{
+	struct ramp_cache_entry *entry;
+
+	entry = g_new0 (struct ramp_cache_entry, 1);
+	entry->key = g_strdup_printf ("%s:%i", cksum, ramp->size);
+	entry->ramp = gamma_ramp_ref (ramp);
+	entry->link.data = entry;
+
+	G_LOCK (cache);
+	if (! cache.table)
+		cache.table = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+			(GDestroyNotify) ramp_cache_entry_free);
+
+	/* replaces (and frees) an older entry with the same key */
+	g_hash_table_replace (cache.table, entry->key, entry);
+	g_queue_push_head_link (&cache.lru, &entry->link);
+	cache.bytes += ramp_bytes (ramp);
+
+	ramp_cache_shrink (entry);
+	G_UNLOCK (cache);
+}
+
+void
+ramp_cache_get_stats (guint *hits, guint *misses)
+{
+	G_LOCK (cache);
+	if (hits)
+		*hits = cache.hits;
+	if (misses)
+		*misses = cache.misses;
+	G_UNLOCK (cache);
+}
+
+/* vim: set ts=8 sw=8 tw=0 : */
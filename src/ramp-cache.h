@@ -0,0 +1,29 @@
+#ifndef __RAMP_CACHE_H__
+#define __RAMP_CACHE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Ready-to-upload gamma ramp, immutable once filled */
+struct gamma_ramp {
+	gint		ref;
+	int		size;
+	guint16		*red;
+	guint16		*green;
+	guint16		*blue;
+};
+
+struct gamma_ramp *gamma_ramp_new (int size);
+struct gamma_ramp *gamma_ramp_ref (struct gamma_ramp *ramp);
+void gamma_ramp_unref (struct gamma_ramp *ramp);
+
+struct gamma_ramp *ramp_cache_lookup (const gchar *cksum, int size);
+void ramp_cache_insert (const gchar *cksum, struct gamma_ramp *ramp);
+void ramp_cache_get_stats (guint *hits, guint *misses);
+
+G_END_DECLS
+
+#endif /* __RAMP_CACHE_H__ */
+
+/* vim: set ts=8 sw=8 tw=0 : */
@@ -1,6 +1,14 @@
+#include "edid-cache.h"
 #include "icc.h"
+#include "latency.h"
+#include "ramp-cache.h"
 #include "randr-conn.h"
 #include "randr-conn-private.h"
+#include "stats.h"
+#include "trace.h"
+#ifdef HAVE_XCB
+#include "randr-xcb.h"
+#endif
 #include <glib.h>
 #include <glib-object.h>
 #include <glib-unix.h>
@@ -35,6 +43,7 @@ get_output_property (struct randr_conn *conn, RROutput out, Atom prop, Atom type
 	if (prop == None)
 		return NULL;
 
+	stats_add (STATS_X_ROUND_TRIPS, 1);
 	XRRGetOutputProperty (conn->dpy, out, prop, 0, 100, False, False,
 			      AnyPropertyType, &act_type, &act_fmt,
 			      &size, &bytes_after, &data);
@@ -48,27 +57,22 @@ get_output_property (struct randr_conn *conn, RROutput out, Atom prop, Atom type
 }
 
 static gboolean
-get_output_property_atom (struct randr_conn *conn, RROutput out, Atom prop, const gchar *value_eq)
+get_output_property_atom (struct randr_conn *conn, RROutput out, Atom prop, Atom value_eq)
 {
-	char *str;
-	Atom atom;
 	gboolean retval = FALSE;
 	GBytes *raw = get_output_property (conn, out, prop, XA_ATOM, 32);
 	if (! raw)
 		return retval;
-	if (g_bytes_get_size (raw) != 4)
-		goto out;
-	atom = *((Atom *) g_bytes_get_data (raw, NULL));
-	str = XGetAtomName (conn->dpy, atom);
-	if (str) {
-		retval = (strcmp (value_eq, str) == 0);
-		XFree (str);
-	}
-out:
+	if (g_bytes_get_size (raw) == 4)
+		retval = (*((Atom *) g_bytes_get_data (raw, NULL)) == value_eq);
 	g_bytes_unref (raw);
 	return retval;
 }
 
+static void upload_gamma (struct randr_display_priv *disp, struct gamma_ramp *ramp);
+static gboolean is_main_icc_profile (struct randr_display_priv *disp);
+static void cancel_icc_upload (struct randr_screen *screen);
+
 static void
 randr_display_free (struct randr_display_priv *disp)
 {
@@ -77,45 +81,38 @@ randr_display_free (struct randr_display_priv *disp)
 	if (disp->pub.xrandr_name)
 		g_free ((gpointer) disp->pub.xrandr_name);
         g_object_unref(disp->pub.edid);
+	if (disp->edid_info)
+		edid_info_unref (disp->edid_info);
+	if (disp->applied)
+		gamma_ramp_unref (disp->applied);
 	g_free (disp);
 }
 
 static inline const gchar *
-make_name (struct randr_display_priv *disp, CdEdid *edid, gboolean use_edid)
+make_name (struct randr_display_priv *disp)
 {
-	int i = 0;
-	const gchar *arr[16];
-	const gchar *retval;
-
-	memset (arr, 0, sizeof(arr));
-	arr[i++] = "xrandr";
-
-	if (use_edid) {
-		const gchar *vendor = cd_edid_get_vendor_name (edid);
-		const gchar *model = cd_edid_get_monitor_name (edid);
-		const gchar *serial = cd_edid_get_serial_number (edid);
-
-		if (vendor)
-			arr[i++] = vendor;
-		if (model)
-			arr[i++] = model;
-		if (serial)
-			arr[i++] = serial;
+	const gchar *ns = disp->conn->ns;
+
+	if (disp->edid_info && disp->edid_info->name) {
+		const gchar *name = disp->edid_info->name;
+		if (! ns)
+			return g_strdup (name);
+		/* "xrandr-Vendor-..." becomes "xrandr-:1-Vendor-..." */
+		return g_strconcat ("xrandr-", ns, name + strlen ("xrandr"), NULL);
 	}
 
 	/* last resort: use xrandr name */
-	if (i <= 1)
-		arr[i++] = disp->pub.xrandr_name;
-
-	retval = g_strjoinv ("-", (gchar**)arr);
-
-	return retval;
+	if (ns)
+		return g_strjoin ("-", "xrandr", ns, disp->pub.xrandr_name, NULL);
+	return g_strjoin ("-", "xrandr", disp->pub.xrandr_name, NULL);
 }
 
 static inline gboolean
 is_laptop_conn (struct randr_conn *conn, RROutput out)
 {
-	return get_output_property_atom (conn, out, conn->type_atom, "Panel");
+	if (conn->panel_atom == None) /* no connector can be of that type */
+		return FALSE;
+	return get_output_property_atom (conn, out, conn->type_atom, conn->panel_atom);
 }
 
 static inline gboolean
@@ -133,164 +130,600 @@ is_laptop_name (const gchar *name)
 }
 
 static inline void
-populate_display (struct randr_display_priv *disp, GBytes *edid, RROutput out)
+populate_display (struct randr_display_priv *disp, gboolean is_panel)
 {
-	gsize edid_size = edid ? g_bytes_get_size (edid) : 0;
+	disp->pub.is_laptop = is_panel || is_laptop_name (disp->pub.xrandr_name);
 
-	disp->pub.is_laptop = is_laptop_conn (disp->conn, out)
-			   || is_laptop_name (disp->pub.xrandr_name);
+	if (disp->edid_info)
+		disp->pub.edid = g_object_ref (disp->edid_info->edid);
+	else
+		disp->pub.edid = cd_edid_new ();
 
-	disp->pub.edid = cd_edid_new ();
-	if (edid_size > 0) {
-		GError *err = NULL;
-		gboolean ok = cd_edid_parse (disp->pub.edid, edid, &err);
-		if (! ok) {
-			g_warning ("unable to parse ICC: %s", err->message);
-			g_clear_error (&err);
-		}
-	}
+	disp->pub.name = make_name (disp);
+}
 
-	disp->pub.name = make_name (disp, disp->pub.edid, (edid_size != 0));
+static inline gboolean
+same_display (const struct randr_display *a, const struct randr_display *b)
+{
+	return ! strcmp (a->name, b->name);
 }
 
-static inline struct randr_display_priv *
-process_output (struct randr_conn *conn, XRRScreenResources *rsrc,
-		RROutput out, int *outn)
+static inline gboolean
+same_edid (const struct edid_info *a, const struct edid_info *b)
 {
-	struct randr_display_priv *disp = NULL;
+	if (a == b)
+		return TRUE;
+	if (! a || ! b)
+		return FALSE;
+	return g_bytes_equal (a->raw, b->raw);
+}
 
-	XRROutputInfo *inf = XRRGetOutputInfo (conn->dpy, rsrc, out);
-	if (! inf) {
-		g_critical ("XRRGetOutputInfo() failed");
-		return NULL;
+static void
+forget_gamma (struct randr_display_priv *disp)
+{
+	disp->gamma_size = 0;
+	disp->mode = None;
+	disp->rotation = 0;
+	if (disp->applied) {
+		gamma_ramp_unref (disp->applied);
+		disp->applied = NULL;
 	}
+}
 
-	if (inf->connection != RR_Disconnected) {
-		GBytes *edid = get_output_property (conn, out, conn->edid_atom, XA_INTEGER, 8);
+/* Outcome of one topology update, signals are emitted from this */
+struct update_result {
+	GPtrArray	*added;
+	GPtrArray	*removed;	/* not in conn->displays any more */
+	GPtrArray	*changed;
+	GPtrArray	*main_before;	/* displays owning _ICC_PROFILE before */
+};
 
-		disp = g_new0 (struct randr_display_priv, 1);
-		disp->conn = conn;
-		disp->pub.id = *outn;
-		disp->pub.xrandr_name = g_strdup (inf->name);
-		disp->crtc = inf->crtc;
+static inline void
+update_result_init (struct update_result *res, struct randr_conn *conn)
+{
+	guint i;
 
-		populate_display (disp, edid, out);
+	res->added = g_ptr_array_new ();
+	res->removed = g_ptr_array_new_with_free_func ((GDestroyNotify) randr_display_free);
+	res->changed = g_ptr_array_new ();
+	res->main_before = g_ptr_array_new ();
 
-		if (edid)
-			g_bytes_unref (edid);
+	for (i = 0; i < conn->displays->len; ++i) {
+		struct randr_display_priv *disp = g_ptr_array_index (conn->displays, i);
+		if (is_main_icc_profile (disp))
+			g_ptr_array_add (res->main_before, disp);
+	}
+}
+
+static inline void
+update_result_clear (struct update_result *res)
+{
+	g_ptr_array_unref (res->added);
+	g_ptr_array_unref (res->removed);
+	g_ptr_array_unref (res->changed);
+	g_ptr_array_unref (res->main_before);
+}
 
-		++*outn;
+static inline gboolean
+ptr_array_has (GPtrArray *arr, gconstpointer ptr)
+{
+	guint i;
+	for (i = 0; i < arr->len; ++i) {
+		if (g_ptr_array_index (arr, i) == ptr)
+			return TRUE;
 	}
+	return FALSE;
+}
 
-	XRRFreeOutputInfo (inf);
+static inline void
+mark_changed (struct update_result *res, struct randr_display_priv *disp)
+{
+	if (ptr_array_has (res->added, disp) || ptr_array_has (res->changed, disp))
+		return;
+	g_ptr_array_add (res->changed, disp);
+}
+
+static void
+add_display (struct randr_conn *conn, struct randr_display_priv *disp,
+	     struct update_result *res)
+{
+	g_ptr_array_add (conn->displays, disp);
+	g_hash_table_insert (conn->outputs, GUINT_TO_POINTER (disp->output), disp);
+	g_ptr_array_add (res->added, disp);
+}
+
+static void
+drop_display (struct randr_conn *conn, struct randr_display_priv *disp,
+	      struct update_result *res)
+{
+	g_hash_table_remove (conn->outputs, GUINT_TO_POINTER (disp->output));
+	g_ptr_array_remove_fast (conn->displays, disp);
+	g_ptr_array_remove_fast (res->changed, disp);
+	if (g_ptr_array_remove_fast (res->added, disp)) {
+		/* nobody has heard of it yet */
+		randr_display_free (disp);
+		return;
+	}
+	g_ptr_array_add (res->removed, disp);
+}
+
+static inline struct randr_display_priv *
+new_display (struct randr_conn *conn, Window root, const struct randr_output_state *os,
+	     gboolean is_panel, struct edid_info *edid)
+{
+	struct randr_display_priv *disp = g_new0 (struct randr_display_priv, 1);
+
+	disp->conn = conn;
+	disp->root = root;
+	disp->output = os->output;
+	disp->pub.id = os->index;
+	disp->pub.xrandr_name = g_strdup (os->name);
+	disp->crtc = os->crtc;
+	disp->gamma_size = os->gamma_size;
+	disp->edid_info = edid ? edid_info_ref (edid) : NULL;
+
+	populate_display (disp, is_panel);
 
 	return disp;
 }
 
-static inline void
-iterate_outputs (struct randr_conn *conn, int scr, GPtrArray *retval)
+static void
+process_output (struct randr_conn *conn, Window root, RROutput primary,
+		const struct randr_output_state *os, struct update_result *res)
+{
+	struct randr_display_priv *disp;
+	struct edid_info *edid = NULL;
+	gboolean is_panel = os->is_panel;
+
+	disp = g_hash_table_lookup (conn->outputs, GUINT_TO_POINTER (os->output));
+
+	if (! os->connected) {
+		if (disp)
+			drop_display (conn, disp, res);
+		return;
+	}
+
+	/* the blob hardly ever changes, so it is parsed only once */
+	if (os->edid)
+		edid = edid_cache_lookup (os->edid);
+
+	if (disp && ! same_edid (disp->edid_info, edid)) {
+		/* another monitor behind the same connector */
+		is_panel = disp->pub.is_laptop;
+		drop_display (conn, disp, res);
+		disp = NULL;
+	}
+
+	if (disp) {
+		gboolean is_primary = (os->output == primary);
+		if (disp->crtc != os->crtc) {
+			forget_gamma (disp);
+			disp->crtc = os->crtc;
+			disp->gamma_size = os->gamma_size;
+			mark_changed (res, disp);
+		} else if (! disp->gamma_size) {
+			disp->gamma_size = os->gamma_size;
+		}
+		if (disp->pub.is_primary != is_primary) {
+			disp->pub.is_primary = is_primary;
+			mark_changed (res, disp);
+		}
+		disp->pub.id = os->index;
+	} else {
+		disp = new_display (conn, root, os, is_panel, edid);
+		disp->pub.is_primary = (os->output == primary);
+		add_display (conn, disp, res);
+		latency_begin (disp->pub.name, conn->event_time);
+	}
+
+	if (edid)
+		edid_info_unref (edid);
+}
+
+static inline int
+output_index (const struct randr_screen_state *st, RROutput out)
 {
 	int io;
-	int outn = 0;
-	Window root = RootWindow (conn->dpy, scr);
-	RROutput primary = XRRGetOutputPrimary (conn->dpy, root);
+	for (io = 0; io < st->noutput; ++io) {
+		if (st->outputs[io] == out)
+			return io;
+	}
+	return -1;
+}
+
+static inline void
+iterate_outputs (struct randr_conn *conn, Window root,
+		 const struct randr_screen_state *st, struct update_result *res)
+{
+	guint i;
+
+	for (i = 0; i < st->states->len; ++i)
+		process_output (conn, root, st->primary,
+				&g_array_index (st->states, struct randr_output_state, i), res);
+
+	/* connectors may vanish altogether, e.g. DisplayPort MST ones */
+	for (i = 0; i < conn->displays->len; ) {
+		struct randr_display_priv *disp = g_ptr_array_index (conn->displays, i);
+		if (disp->root == root && output_index (st, disp->output) < 0) {
+			drop_display (conn, disp, res);
+			continue;
+		}
+		++i;
+	}
+}
+
+static struct randr_screen *
+find_screen (struct randr_conn *conn, Window root)
+{
+	guint i;
+	for (i = 0; i < conn->screens->len; ++i) {
+		struct randr_screen *screen = &g_array_index (conn->screens, struct randr_screen, i);
+		if (screen->root == root)
+			return screen;
+	}
+	return NULL;
+}
+
+static XRRScreenResources *
+get_screen_resources (struct randr_conn *conn, struct randr_screen *screen)
+{
+	/* Probing may take a long while and even blank the screen */
 	XRRScreenResources *rsrc =
-		XRRGetScreenResources (conn->dpy, root);
+		XRRGetScreenResourcesCurrent (conn->dpy, screen->root);
+	stats_add (STATS_X_ROUND_TRIPS, 1);
+
+	/* Nobody has probed this screen yet, so the server knows nothing */
+	if (rsrc && rsrc->noutput == 0 && ! screen->probed) {
+		g_debug ("probing outputs of root window 0x%lx", screen->root);
+		XRRFreeScreenResources (rsrc);
+		rsrc = XRRGetScreenResources (conn->dpy, screen->root);
+		stats_add (STATS_X_ROUND_TRIPS, 1);
+	}
+	screen->probed = TRUE;
+
 	if (! rsrc) {
 		g_critical ("XRRGetScreenResources() failed"
-			    " at screen %i", scr);
-		return;
+			    " at root window 0x%lx", screen->root);
+		return NULL;
 	}
 
+	screen->timestamp = rsrc->timestamp;
+	screen->config_timestamp = rsrc->configTimestamp;
+
+	return rsrc;
+}
+
+static void
+output_state_clear (struct randr_output_state *os)
+{
+	g_free (os->name);
+	if (os->edid)
+		g_bytes_unref (os->edid);
+}
+
+static inline void
+screen_state_init (struct randr_screen_state *st)
+{
+	st->primary = None;
+	st->outputs = NULL;
+	st->noutput = 0;
+	st->states = g_array_new (FALSE, TRUE, sizeof (struct randr_output_state));
+	g_array_set_clear_func (st->states, (GDestroyNotify) output_state_clear);
+}
+
+static inline void
+screen_state_clear (struct randr_screen_state *st)
+{
+	g_free (st->outputs);
+	g_array_unref (st->states);
+}
+
+/* One round trip per request, slow on remote displays but works everywhere */
+static gboolean
+xlib_fetch_screen (struct randr_conn *conn, struct randr_screen *screen,
+		   GHashTable *wanted, struct randr_screen_state *st)
+{
+	XRRScreenResources *rsrc;
+	int io;
+
+	st->primary = XRRGetOutputPrimary (conn->dpy, screen->root);
+	stats_add (STATS_X_ROUND_TRIPS, 1);
+	rsrc = get_screen_resources (conn, screen);
+	if (! rsrc)
+		return FALSE;
+
+	st->noutput = rsrc->noutput;
+	st->outputs = g_new (RROutput, rsrc->noutput);
+	memcpy (st->outputs, rsrc->outputs, rsrc->noutput * sizeof (RROutput));
+
 	for (io = 0; io < rsrc->noutput; ++io) {
-		struct randr_display_priv *disp =
-			process_output (conn, rsrc, rsrc->outputs[io], &outn);
-		if (disp) {
-			disp->root = root; /* more convenient to set it here */
-			disp->pub.is_primary = (rsrc->outputs[io] == primary);
-			g_ptr_array_add (retval, disp);
+		RROutput out = rsrc->outputs[io];
+		struct randr_output_state os;
+		XRROutputInfo *inf;
+
+		if (wanted && ! g_hash_table_contains (wanted, GUINT_TO_POINTER (out)))
+			continue;
+
+		inf = XRRGetOutputInfo (conn->dpy, rsrc, out);
+		stats_add (STATS_X_ROUND_TRIPS, 1);
+		if (! inf) {
+			g_critical ("XRRGetOutputInfo() failed");
+			continue;
+		}
+
+		memset (&os, 0, sizeof (os));
+		os.output = out;
+		os.index = io;
+		os.name = g_strdup (inf->name);
+		os.crtc = inf->crtc;
+		os.connected = (inf->connection != RR_Disconnected);
+		if (os.connected) {
+			os.edid = get_output_property (conn, out, conn->edid_atom, XA_INTEGER, 8);
+			/* the connector type never changes, known outputs have it */
+			if (! g_hash_table_contains (conn->outputs, GUINT_TO_POINTER (out)))
+				os.is_panel = is_laptop_conn (conn, out);
 		}
+		g_array_append_val (st->states, os);
+
+		XRRFreeOutputInfo (inf);
 	}
 
 	XRRFreeScreenResources (rsrc);
+
+	return TRUE;
 }
 
-static inline GPtrArray *
-enum_displays (struct randr_conn *conn)
+static gboolean
+fetch_screen (struct randr_conn *conn, struct randr_screen *screen,
+	      GHashTable *wanted, struct randr_screen_state *st)
 {
-	int scr;
-	GPtrArray *retval = g_ptr_array_new_full (4,
-		(GDestroyNotify) randr_display_free);
-	for (scr = 0; scr < ScreenCount (conn->dpy); ++scr) {
-		iterate_outputs (conn, scr, retval);
-	}
-	return retval;
+#ifdef HAVE_XCB
+	if (conn->xcb)
+		return randr_xcb_fetch_screen (conn, screen, wanted, st);
+#endif
+	return xlib_fetch_screen (conn, screen, wanted, st);
 }
 
-static inline gboolean
-same_display (const struct randr_display *a, const struct randr_display *b)
+static inline void
+refresh_screen (struct randr_conn *conn, struct randr_screen *screen,
+		struct update_result *res)
 {
-	return ! strcmp (a->name, b->name);
+	struct randr_screen_state st;
+
+	screen_state_init (&st);
+	if (fetch_screen (conn, screen, NULL, &st))
+		iterate_outputs (conn, screen->root, &st, res);
+	screen_state_clear (&st);
 }
 
-void
-randr_conn_private_update (struct randr_conn *conn)
+static void
+refresh_crtc (struct randr_conn *conn, RRCrtc crtc, const struct crtc_change *chg)
 {
-	guint i, j;
-	GPtrArray *disps;
-	GPtrArray *added_disps = g_ptr_array_new_full (4, NULL);
-	GPtrArray *updated_disps = g_ptr_array_new_full (4, NULL);
+	guint i;
 
-	if (! conn->dpy)
+	if (chg->mode == None) /* switched off, output events tell the rest */
 		return;
 
-	disps = enum_displays (conn);
-	for (i = 0; i < disps->len; ++i) {
-		gboolean found = FALSE;
-		struct randr_display *disp = (struct randr_display *)
-					     g_ptr_array_index (disps, i);
-		for (j = 0; j < conn->displays->len; ++j) {
-			struct randr_display *odisp = (struct randr_display *)
-						      g_ptr_array_index (conn->displays, j);
-			if (same_display (odisp, disp)) {
-				g_ptr_array_remove_index_fast (conn->displays, j);
-				g_ptr_array_add (updated_disps, disp);
-				found = TRUE;
+	for (i = 0; i < conn->displays->len; ++i) {
+		struct randr_display_priv *disp = g_ptr_array_index (conn->displays, i);
+		if (disp->crtc != crtc)
+			continue;
+		if (disp->mode == chg->mode && disp->rotation == chg->rotation)
+			continue; /* just moved around */
+		disp->mode = chg->mode;
+		disp->rotation = chg->rotation;
+		/* same monitor and profile: the ramp we already have will do */
+		if (disp->applied) {
+			g_debug ("mode changed on display %s, re-asserting gamma",
+				 disp->pub.name);
+			upload_gamma (disp, disp->applied);
+		}
+	}
+}
+
+static void
+emit_update (struct randr_conn *conn, struct update_result *res)
+{
+	guint i, j;
+
+	/* A monitor moved to another connector is still the same display */
+	for (i = 0; i < res->added->len; ) {
+		struct randr_display_priv *disp = g_ptr_array_index (res->added, i);
+		gboolean moved = FALSE;
+		for (j = 0; j < res->removed->len; ++j) {
+			struct randr_display_priv *odisp = g_ptr_array_index (res->removed, j);
+			if (same_display (&odisp->pub, &disp->pub)) {
+				g_ptr_array_remove_index_fast (res->removed, j);
+				moved = TRUE;
 				break;
 			}
 		}
-		if (found)
+		if (moved) {
+			g_ptr_array_remove_index_fast (res->added, i);
+			g_ptr_array_add (res->changed, disp);
 			continue;
-		g_ptr_array_add (added_disps, disp);
+		}
+		++i;
 	}
 
-	for (j = 0; j < conn->displays->len; ++j) {
+	/* The display owning _ICC_PROFILE may have changed */
+	for (i = 0; i < conn->displays->len; ++i) {
+		struct randr_display_priv *disp = g_ptr_array_index (conn->displays, i);
+		if (! ptr_array_has (res->main_before, disp) && is_main_icc_profile (disp))
+			mark_changed (res, disp);
+	}
+
+	for (j = 0; j < res->removed->len; ++j) {
 		const struct randr_display *odisp = (const struct randr_display *)
-						    g_ptr_array_index (conn->displays, j);
+						    g_ptr_array_index (res->removed, j);
 		g_signal_emit (conn->object,
 			       randr_signals[SIG_DISPLAY_REMOVED], 0, odisp);
 	}
 
-	g_ptr_array_unref (conn->displays);
-	conn->displays = disps;
-
-	/* emitting added and changed signals after conn->displays is set */
-	for (j = 0; j < added_disps->len; ++j) {
+	for (j = 0; j < res->added->len; ++j) {
 		const struct randr_display *disp = (const struct randr_display *)
-						   g_ptr_array_index (added_disps, j);
+						   g_ptr_array_index (res->added, j);
 		g_signal_emit (conn->object,
 			       randr_signals[SIG_DISPLAY_ADDED], 0, disp);
 	}
 
-	for (j = 0; j < updated_disps->len; ++j) {
+	for (j = 0; j < res->changed->len; ++j) {
 		const struct randr_display *disp = (const struct randr_display *)
-						   g_ptr_array_index (updated_disps, j);
+						   g_ptr_array_index (res->changed, j);
 		g_signal_emit (conn->object,
 			       randr_signals[SIG_DISPLAY_CHANGED], 0, disp);
 	}
+}
+
+void
+randr_conn_private_update (struct randr_conn *conn)
+{
+	guint i;
+	struct update_result res;
+	struct trace_span span;
+
+	if (! conn->dpy)
+		return;
+
+	trace_span_init (&span, "updating all displays", conn->ns, NULL);
+	trace_span_begin (&span);
+
+	update_result_init (&res, conn);
+
+	stats_add (STATS_FULL_UPDATES, 1);
+
+	for (i = 0; i < conn->screens->len; ++i)
+		refresh_screen (conn, &g_array_index (conn->screens, struct randr_screen, i),
+				&res);
+
+	g_hash_table_remove_all (conn->pending_screens);
+	g_hash_table_remove_all (conn->pending_outputs);
+	g_hash_table_remove_all (conn->pending_crtcs);
+
+	emit_update (conn, &res);
+	update_result_clear (&res);
+	stats_observe (STATS_UPDATE_TIME, trace_span_end (&span));
+}
+
+/* Only the outputs which told us about themselves are looked at */
+static void
+refresh_outputs (struct randr_conn *conn, Window root, GHashTable *outs,
+		 struct update_result *res)
+{
+	GHashTableIter it;
+	gpointer key;
+	guint i;
+	struct randr_screen_state st;
+	struct randr_screen *screen = find_screen (conn, root);
+
+	if (! screen)
+		return;
+
+	screen_state_init (&st);
+	if (! fetch_screen (conn, screen, outs, &st))
+		goto out;
+
+	for (i = 0; i < st.states->len; ++i)
+		process_output (conn, root, st.primary,
+				&g_array_index (st.states, struct randr_output_state, i), res);
+
+	/* the ones not in the screen resources any more are gone */
+	g_hash_table_iter_init (&it, outs);
+	while (g_hash_table_iter_next (&it, &key, NULL)) {
+		struct randr_display_priv *disp;
+		if (output_index (&st, (RROutput) GPOINTER_TO_UINT (key)) >= 0)
+			continue;
+		disp = g_hash_table_lookup (conn->outputs, key);
+		if (disp)
+			drop_display (conn, disp, res);
+	}
+
+out:
+	screen_state_clear (&st);
+}
+
+void
+randr_conn_private_update_pending (struct randr_conn *conn)
+{
+	GHashTableIter it;
+	gpointer key, val;
+	GHashTable *notified;
+	GHashTable *wanted;
+	struct update_result res;
+	struct trace_span span;
+
+	if (! conn->dpy)
+		return;
+
+	trace_span_init (&span, "updating displays", conn->ns, NULL);
+	trace_span_begin (&span);
+
+	stats_add (STATS_INCREMENTAL_UPDATES, 1);
+
+	update_result_init (&res, conn);
+
+	/* Screens which told us about particular outputs and CRTCs */
+	notified = g_hash_table_new (g_direct_hash, g_direct_equal);
+	wanted = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+					NULL, (GDestroyNotify) g_hash_table_unref);
+	g_hash_table_iter_init (&it, conn->pending_outputs);
+	while (g_hash_table_iter_next (&it, &key, &val)) {
+		GHashTable *outs = g_hash_table_lookup (wanted, val);
+		if (! outs) {
+			outs = g_hash_table_new (g_direct_hash, g_direct_equal);
+			g_hash_table_insert (wanted, val, outs);
+		}
+		g_hash_table_add (outs, key);
+		g_hash_table_add (notified, val);
+	}
+	g_hash_table_iter_init (&it, conn->pending_crtcs);
+	while (g_hash_table_iter_next (&it, &key, &val))
+		g_hash_table_add (notified, GUINT_TO_POINTER (((struct crtc_change *) val)->root));
+
+	/* A bare screen change does not say what happened: look at everything,
+	 * unless the server configuration is exactly what we have seen last */
+	g_hash_table_iter_init (&it, conn->pending_screens);
+	while (g_hash_table_iter_next (&it, &key, &val)) {
+		const struct screen_change *chg = (const struct screen_change *) val;
+		struct randr_screen *screen;
+
+		if (g_hash_table_contains (notified, key))
+			continue;
 
-	g_ptr_array_unref (added_disps);
-	g_ptr_array_unref (updated_disps);
+		screen = find_screen (conn, (Window) GPOINTER_TO_UINT (key));
+		if (! screen)
+			continue;
+
+		if (chg->timestamp == screen->timestamp
+		    && chg->config_timestamp == screen->config_timestamp) {
+			g_debug ("configuration of root window 0x%lx did not change",
+				 screen->root);
+			continue;
+		}
+
+		refresh_screen (conn, screen, &res);
+	}
+
+	g_hash_table_iter_init (&it, wanted);
+	while (g_hash_table_iter_next (&it, &key, &val))
+		refresh_outputs (conn, (Window) GPOINTER_TO_UINT (key), val, &res);
+
+	/* After the outputs so that the displays are on their new CRTCs */
+	g_hash_table_iter_init (&it, conn->pending_crtcs);
+	while (g_hash_table_iter_next (&it, &key, &val))
+		refresh_crtc (conn, (RRCrtc) GPOINTER_TO_UINT (key),
+			      (const struct crtc_change *) val);
+
+	g_hash_table_unref (wanted);
+	g_hash_table_unref (notified);
+
+	g_hash_table_remove_all (conn->pending_screens);
+	g_hash_table_remove_all (conn->pending_outputs);
+	g_hash_table_remove_all (conn->pending_crtcs);
+
+	emit_update (conn, &res);
+	update_result_clear (&res);
+	stats_observe (STATS_UPDATE_TIME, trace_span_end (&span));
 }
 
 
@@ -299,30 +732,131 @@ randr_source_prepare (GSource *source, gint *timeout)
 {
 	(void) timeout;
 	struct randr_source *src = (struct randr_source *) source;
-	return (XPending (src->conn->dpy) > 0);
+	return src->conn->broken || (XPending (src->conn->dpy) > 0);
+}
+
+#ifdef HAVE_XSETIOERROREXITHANDLER
+/* Instead of exit(), which would take the other displays down too */
+static void
+io_error_exit (Display *dpy, void *user_data)
+{
+	struct randr_conn *conn = (struct randr_conn *) user_data;
+	(void) dpy;
+	/* Xlib fails all later requests, the source drops the connection */
+	conn->broken = TRUE;
+}
+#endif
+
+/* The X server went away and its displays with it */
+static void
+close_broken (struct randr_conn *conn)
+{
+	guint i;
+
+	g_warning ("Lost connection to display %s", DisplayString (conn->dpy));
+	/* whoever handles the signals may drop the last reference */
+	g_object_ref (conn->object);
+	for (i = 0; i < conn->displays->len; ++i)
+		g_signal_emit (conn->object, randr_signals[SIG_DISPLAY_REMOVED], 0,
+			       g_ptr_array_index (conn->displays, i));
+	/* as if it had never been opened, uploads in progress included */
+	randr_conn_private_finalize (conn);
+	g_signal_emit (conn->object, randr_signals[SIG_CLOSED], 0);
+	g_object_unref (conn->object);
+}
+
+static inline void
+queue_screen_change (struct randr_conn *conn, const XRRScreenChangeNotifyEvent *ev)
+{
+	struct screen_change *chg = g_new (struct screen_change, 1);
+	chg->timestamp = ev->timestamp;
+	chg->config_timestamp = ev->config_timestamp;
+	g_hash_table_replace (conn->pending_screens, GUINT_TO_POINTER (ev->root), chg);
+}
+
+static inline void
+queue_crtc_change (struct randr_conn *conn, const XRRCrtcChangeNotifyEvent *ev)
+{
+	struct crtc_change *chg = g_new (struct crtc_change, 1);
+	chg->root = ev->window;
+	chg->mode = ev->mode;
+	chg->rotation = ev->rotation;
+	/* only the latest state of a CRTC is of interest */
+	g_hash_table_replace (conn->pending_crtcs, GUINT_TO_POINTER (ev->crtc), chg);
+}
+
+/* Somebody else may have replaced or removed the profile we published */
+static inline void
+handle_property_notify (struct randr_conn *conn, const XPropertyEvent *ev)
+{
+	struct randr_screen *screen;
+
+	if (ev->atom != conn->icc_atom)
+		return;
+	screen = find_screen (conn, ev->window);
+	if (! screen)
+		return;
+	/*
+	 * Every change of ours is notified once, in order. The serial only
+	 * tells which of our requests the server had seen, so a change made
+	 * by somebody else while we are idle carries the serial of our last
+	 * one: it is ours only if we still wait for a notification.
+	 */
+	if (ev->serial <= screen->icc_serial && screen->icc_pending) {
+		screen->icc_pending--;
+		return;
+	}
+
+	g_debug ("_ICC_PROFILE of root window 0x%lx changed by another client",
+		 screen->root);
+	/* appending the rest to what is there now would be garbage */
+	cancel_icc_upload (screen);
+	screen->icc_known = FALSE;
+	g_free (screen->icc_checksum);
+	screen->icc_checksum = NULL;
 }
 
 static gboolean
 randr_source_dispatch (GSource *source, GSourceFunc callback, gpointer user_data)
 {
-	struct randr_conn *conn = ((struct randr_source *) source)->conn;
-	gboolean happened = FALSE;
+	struct randr_source *src = (struct randr_source *) source;
+	struct randr_conn *conn = src->conn;
+	guint events = 0;
+	gint64 now, deadline;
+	struct trace_span span;
 	(void) callback;
 	(void) user_data;
 
+	trace_span_init (&span, "receiving RandR events", conn->ns, NULL);
+	trace_span_begin (&span);
 	while (XPending (conn->dpy)) {
 		XEvent ev;
 		XNextEvent(conn->dpy, &ev);
+		if (ev.xany.type == PropertyNotify) {
+			handle_property_notify (conn, &ev.xproperty);
+			continue;
+		}
 		switch (ev.xany.type - conn->event_base) {
 		case RRScreenChangeNotify:
-			happened = TRUE;
+			XRRUpdateConfiguration (&ev);
+			queue_screen_change (conn, (const XRRScreenChangeNotifyEvent *) &ev);
+			++events;
 			break;
 		case RRNotify:
 			switch (((const XRRNotifyEvent*)&ev)->subtype) {
 			case RRNotify_CrtcChange:
-			case RRNotify_OutputChange:
-				happened = TRUE;
+				queue_crtc_change (conn, (const XRRCrtcChangeNotifyEvent *) &ev);
+				++events;
+				break;
+			case RRNotify_OutputChange: {
+				const XRROutputChangeNotifyEvent *oev =
+					(const XRROutputChangeNotifyEvent *) &ev;
+				g_hash_table_insert (conn->pending_outputs,
+						     GUINT_TO_POINTER (oev->output),
+						     GUINT_TO_POINTER (oev->window));
+				++events;
 				break;
+			}
 			default:
 				break;
 			}
@@ -331,9 +865,37 @@ randr_source_dispatch (GSource *source, GSourceFunc callback, gpointer user_data
 			break;
 		}
 	}
+	trace_span_end (&span);
+
+	if (conn->broken) {
+		close_broken (conn);
+		return G_SOURCE_REMOVE;
+	}
 
-	if (happened)
-		randr_conn_private_update (conn);
+	now = g_source_get_time (source);
+
+	if (events) {
+		stats_add (STATS_RANDR_EVENTS, events);
+		if (! src->first_event)
+			src->first_event = now;
+		src->last_event = now;
+	}
+
+	if (! src->first_event)
+		return TRUE;
+
+	/* Wait for the storm to calm down, but not forever */
+	deadline = MIN (src->last_event + conn->coalesce_quiet,
+			src->first_event + conn->coalesce_max);
+	if (now < deadline) {
+		g_source_set_ready_time (source, deadline);
+		return TRUE;
+	}
+
+	g_source_set_ready_time (source, -1);
+	conn->event_time = src->first_event;
+	src->first_event = 0;
+	randr_conn_private_update_pending (conn);
 
 	return TRUE;
 }
@@ -376,15 +938,104 @@ setup_events (struct randr_conn *conn)
 				RRScreenChangeNotifyMask |
 				RRCrtcChangeNotifyMask |
 				RROutputChangeNotifyMask);
+		/* to notice other clients publishing a profile */
+		XSelectInput (conn->dpy, w, PropertyChangeMask);
 	}
 	GSource *src = randr_source_new (conn);
 	g_source_attach (src, NULL);
 	g_source_unref (src);
 }
 
+/* Parts of a large _ICC_PROFILE are sent at most this big */
+#define ICC_UPLOAD_CHUNK (256 * 1024)
+
+/* Upload of a profile too large for one request, part by part when idle */
+struct icc_upload {
+	struct randr_conn	*conn;
+	struct randr_screen	*screen;
+	GBytes			*bytes;
+	gsize			offset;
+	gint64			start;
+	guint			source;
+	struct trace_span	span;
+};
+
+static void
+icc_upload_free (struct icc_upload *up)
+{
+	trace_span_end (&up->span);
+	g_bytes_unref (up->bytes);
+	g_free (up);
+}
+
+static gboolean
+icc_upload_step (gpointer user_data)
+{
+	struct icc_upload *up = (struct icc_upload *) user_data;
+	gsize size;
+	const guint8 *data = g_bytes_get_data (up->bytes, &size);
+	gsize len = MIN (up->conn->icc_chunk, size - up->offset);
+
+	up->screen->icc_serial = NextRequest (up->conn->dpy);
+	up->screen->icc_pending++;
+	XChangeProperty (up->conn->dpy, up->screen->root, up->conn->icc_atom,
+			 XA_CARDINAL, 8, up->offset ? PropModeAppend : PropModeReplace,
+			 (const unsigned char *) data + up->offset, len);
+	stats_add (STATS_ICC_PROFILE_BYTES, len);
+	/* the server should be busy with this part while we handle events */
+	XFlush (up->conn->dpy);
+
+	up->offset += len;
+	if (up->offset < size)
+		return G_SOURCE_CONTINUE;
+
+	g_debug ("_ICC_PROFILE of %" G_GSIZE_FORMAT " bytes uploaded to root window"
+		 " 0x%lx in %.1f ms", size, up->screen->root,
+		 (g_get_monotonic_time () - up->start) / 1000.0);
+	stats_observe (STATS_ICC_UPLOAD_TIME, g_get_monotonic_time () - up->start);
+	up->screen->icc_upload = NULL;
+	return G_SOURCE_REMOVE;
+}
+
+static void
+cancel_icc_upload (struct randr_screen *screen)
+{
+	if (! screen->icc_upload)
+		return;
+	g_debug ("upload of _ICC_PROFILE to root window 0x%lx cancelled", screen->root);
+	/* frees it */
+	g_source_remove (screen->icc_upload->source);
+	screen->icc_upload = NULL;
+	/* only a part of it has been published */
+	screen->icc_known = FALSE;
+	g_free (screen->icc_checksum);
+	screen->icc_checksum = NULL;
+}
+
+static void
+start_icc_upload (struct randr_conn *conn, struct randr_screen *screen, GBytes *bytes)
+{
+	struct icc_upload *up = g_new0 (struct icc_upload, 1);
+
+	up->conn = conn;
+	up->screen = screen;
+	/* profiles are read into memory, so rewriting the file changes nothing */
+	up->bytes = g_bytes_ref (bytes);
+	up->start = g_get_monotonic_time ();
+	trace_span_init (&up->span, "uploading _ICC_PROFILE", conn->ns, NULL);
+	trace_span_begin (&up->span);
+	up->source = g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, icc_upload_step, up,
+				      (GDestroyNotify) icc_upload_free);
+	screen->icc_upload = up;
+}
+
 void
 randr_conn_private_start (struct randr_conn *conn)
 {
+	if (! conn->dpy)
+		return;
+	/* monitors connected at startup count from here */
+	conn->event_time = g_get_monotonic_time ();
 	randr_conn_private_update (conn);
 	setup_events (conn);
 }
@@ -393,8 +1044,19 @@ void
 randr_conn_private_init (struct randr_conn *conn, const gchar *disp_name)
 {
 	int major, minor;
+	long max_request;
+	int s;
+
+	conn->coalesce_quiet = RANDR_COALESCE_QUIET_MS * G_TIME_SPAN_MILLISECOND;
+	conn->coalesce_max = RANDR_COALESCE_MAX_MS * G_TIME_SPAN_MILLISECOND;
 
 	conn->displays = g_ptr_array_new ();
+	conn->outputs = g_hash_table_new (g_direct_hash, g_direct_equal);
+	conn->pending_screens = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+						       NULL, g_free);
+	conn->pending_outputs = g_hash_table_new (g_direct_hash, g_direct_equal);
+	conn->pending_crtcs = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+						     NULL, g_free);
 
 	g_debug ("opening display %s", disp_name);
 	conn->dpy = XOpenDisplay (disp_name);
@@ -402,6 +1064,9 @@ randr_conn_private_init (struct randr_conn *conn, const gchar *disp_name)
 		g_critical ("Can't open display: %s", XDisplayName (disp_name));
 		goto out;
 	}
+#ifdef HAVE_XSETIOERROREXITHANDLER
+	XSetIOErrorExitHandler (conn->dpy, io_error_exit, conn);
+#endif
 
 	if (! XRRQueryExtension (conn->dpy,&conn->event_base, &conn->error_base)
 	    || ! XRRQueryVersion (conn->dpy, &major, &minor)) {
@@ -417,9 +1082,30 @@ randr_conn_private_init (struct randr_conn *conn, const gchar *disp_name)
 		goto out;
 	}
 
+	/* in bytes, leaving room for the request header */
+	max_request = XExtendedMaxRequestSize (conn->dpy);
+	if (max_request == 0)
+		max_request = XMaxRequestSize (conn->dpy);
+	conn->icc_chunk = MIN ((gsize) max_request * 4 - 64, ICC_UPLOAD_CHUNK);
+
 	/* RandR 1.2 calls it "EDID_DATA" but we don't support 1.2 */
+	stats_add (STATS_X_ROUND_TRIPS, 4);
 	conn->edid_atom = XInternAtom (conn->dpy, "EDID", False);
 	conn->type_atom = XInternAtom (conn->dpy, "ConnectorType", False);
+	conn->panel_atom = XInternAtom (conn->dpy, "Panel", True);
+	conn->icc_atom = XInternAtom (conn->dpy, "_ICC_PROFILE", False);
+
+#ifdef HAVE_XCB
+	/* Xlib keeps the events, XCB is only used for batches of requests */
+	conn->xcb = XGetXCBConnection (conn->dpy);
+#endif
+
+	conn->screens = g_array_sized_new (FALSE, TRUE, sizeof (struct randr_screen),
+					   ScreenCount (conn->dpy));
+	g_array_set_size (conn->screens, ScreenCount (conn->dpy));
+	for (s = 0; s < ScreenCount (conn->dpy); ++s)
+		g_array_index (conn->screens, struct randr_screen, s).root =
+			RootWindow (conn->dpy, s);
 
 	return;
 
@@ -434,41 +1120,149 @@ randr_conn_private_finalize (struct randr_conn *conn)
 {
 	if (conn->dpy)
 		XCloseDisplay (conn->dpy);
-	if (conn->displays)
+	if (conn->displays) {
+		guint i;
+		for (i = 0; i < conn->displays->len; ++i)
+			randr_display_free (g_ptr_array_index (conn->displays, i));
 		g_ptr_array_unref (conn->displays);
+	}
+	if (conn->screens) {
+		guint i;
+		for (i = 0; i < conn->screens->len; ++i) {
+			struct randr_screen *screen =
+				&g_array_index (conn->screens, struct randr_screen, i);
+			cancel_icc_upload (screen);
+			g_free (screen->icc_checksum);
+		}
+		g_array_unref (conn->screens);
+	}
+	if (conn->outputs)
+		g_hash_table_unref (conn->outputs);
+	if (conn->pending_screens)
+		g_hash_table_unref (conn->pending_screens);
+	if (conn->pending_outputs)
+		g_hash_table_unref (conn->pending_outputs);
+	if (conn->pending_crtcs)
+		g_hash_table_unref (conn->pending_crtcs);
+	g_free (conn->ns);
+	conn->ns = NULL;
+	conn->displays = NULL;
+	conn->screens = NULL;
+	conn->outputs = NULL;
+	conn->pending_screens = NULL;
+	conn->pending_outputs = NULL;
+	conn->pending_crtcs = NULL;
 	conn->dpy = NULL;
+#ifdef HAVE_XCB
+	conn->xcb = NULL;
+#endif
 }
 
 
 
-static inline void
-apply_gamma (struct randr_display_priv *disp, CdIcc *icc)
+static inline gboolean
+same_ramp (const struct gamma_ramp *a, const struct gamma_ramp *b)
+{
+	if (a == b)
+		return TRUE;
+	if (! a || ! b || a->size != b->size)
+		return FALSE;
+	/* channels are laid out back to back */
+	return ! memcmp (a->red, b->red, 3 * a->size * sizeof (guint16));
+}
+
+static void
+upload_gamma (struct randr_display_priv *disp, struct gamma_ramp *ramp)
 {
 	Display *dpy = disp->conn->dpy;
-	XRRCrtcGamma *gamma = NULL;
+	XRRCrtcGamma gamma;
 	XRRCrtcGamma *gamma2 = NULL;
+	struct trace_span span;
+
+	trace_span_init (&span, "setting gamma", disp->pub.name, NULL);
+	trace_span_begin (&span);
+
+	gamma.size = ramp->size;
+	gamma.red = ramp->red;
+	gamma.green = ramp->green;
+	gamma.blue = ramp->blue;
+	XRRSetCrtcGamma (dpy, disp->crtc, &gamma);
+	stats_add (STATS_GAMMA_UPLOADS, 1);
+
+	/* For some reason gamma may not apply without this */
+	gamma2 = XRRGetCrtcGamma (dpy, disp->crtc);
+	stats_add (STATS_X_ROUND_TRIPS, 1);
+	XRRFreeGamma (gamma2);
+
+	trace_span_end (&span);
+}
+
+static gboolean
+query_gamma_size (struct randr_display_priv *disp)
+{
+	int gsize;
 
-	int gsize = XRRGetCrtcGammaSize (dpy, disp->crtc);
+	if (disp->gamma_size > 0)
+		return TRUE;
+
+	gsize = XRRGetCrtcGammaSize (disp->conn->dpy, disp->crtc);
+	stats_add (STATS_X_ROUND_TRIPS, 1);
 	if (gsize <= 0) {
 		g_critical ("Gamma size is %i at output %s", gsize, disp->pub.name);
-		return;
+		return FALSE;
 	}
+	disp->gamma_size = gsize;
+	return TRUE;
+}
 
-	gamma = XRRAllocGamma (gsize);
-	if (! gamma) {
-		g_critical ("XRRAllocGamma() failed at output %s", disp->pub.name);
+static void
+set_ramp (struct randr_display_priv *disp, struct gamma_ramp *ramp)
+{
+	if (same_ramp (ramp, disp->applied)) {
+		g_debug ("gamma of display %s is up to date", disp->pub.name);
+		stats_add (STATS_GAMMA_UPLOADS_SKIPPED, 1);
+		gamma_ramp_unref (ramp);
 		return;
 	}
 
-	icc_to_gamma (gamma, icc);
+	upload_gamma (disp, ramp);
 
-	XRRSetCrtcGamma (dpy, disp->crtc, gamma);
+	if (disp->applied)
+		gamma_ramp_unref (disp->applied);
+	disp->applied = ramp;
+}
 
-	/* For some reason gamma may not apply without this */
-	gamma2 = XRRGetCrtcGamma (dpy, disp->crtc);
-	XRRFreeGamma (gamma2);
+static inline void
+apply_gamma (struct randr_display_priv *disp, struct icc_data *icc,
+	     struct gamma_ramp *made)
+{
+	struct gamma_ramp *ramp;
+	struct trace_span span;
+
+	if (! query_gamma_size (disp))
+		return;
+
+	/*
+	 * Only the ramp of the profile colord chose counts as done: one
+	 * restored from the snapshot was set before any of the other stages.
+	 */
+	if (made && made->size == disp->gamma_size) {
+		/* made beforehand, unless the CRTC changed since */
+		set_ramp (disp, gamma_ramp_ref (made));
+		latency_mark (disp->pub.name, LATENCY_GAMMA_SET);
+		return;
+	}
 
-	XRRFreeGamma (gamma);
+	trace_span_init (&span, "making gamma ramp", disp->pub.name,
+			 icc ? icc->checksum : NULL);
+	trace_span_begin (&span);
+	ramp = icc_make_ramp (icc, disp->gamma_size);
+	trace_span_end (&span);
+
+	if (! ramp)
+		return;
+	set_ramp (disp, ramp);
+	latency_mark (disp->pub.name, LATENCY_GAMMA_SET);
 }
 
 static gboolean
@@ -503,55 +1297,208 @@ is_main_icc_profile (struct randr_display_priv *disp)
 	return (disp->pub.id == main_id);
 }
 
+/* Finds out what somebody, maybe we before a restart, left on the server */
+static void
+read_published_icc (struct randr_conn *conn, struct randr_screen *screen, gsize size_hint)
+{
+	Atom act_type;
+	int act_fmt;
+	unsigned long nitems;
+	unsigned long bytes_after;
+	unsigned char *data = NULL;
+
+	screen->icc_known = TRUE;
+	screen->icc_present = FALSE;
+	g_free (screen->icc_checksum);
+	screen->icc_checksum = NULL;
+
+	/* the size first, the contents are worth fetching only if it matches */
+	XGetWindowProperty (conn->dpy, screen->root, conn->icc_atom, 0, 0, False,
+			    AnyPropertyType, &act_type, &act_fmt, &nitems,
+			    &bytes_after, &data);
+	stats_add (STATS_X_ROUND_TRIPS, 1);
+	if (data)
+		XFree (data);
+	data = NULL;
+	if (act_type == None)
+		return;
+
+	screen->icc_present = TRUE;
+	if (act_type != XA_CARDINAL || act_fmt != 8 || bytes_after != size_hint)
+		return;
+
+	XGetWindowProperty (conn->dpy, screen->root, conn->icc_atom, 0,
+			    (bytes_after + 3) / 4, False, XA_CARDINAL,
+			    &act_type, &act_fmt, &nitems, &bytes_after, &data);
+	stats_add (STATS_X_ROUND_TRIPS, 1);
+	if (data && act_type == XA_CARDINAL && nitems == size_hint)
+		screen->icc_checksum = icc_checksum_for_data (data, nitems);
+	if (data)
+		XFree (data);
+}
+
 static inline void
-apply_icc (struct randr_display_priv *disp, GBytes *icc_bytes)
+apply_icc (struct randr_display_priv *disp, struct icc_data *data)
 {
 	int res;
 	Display *dpy = disp->conn->dpy;
 	const gchar *oper = NULL;
-	Atom at;
+	GBytes *icc_bytes = NULL;
+	GError *err = NULL;
+	Atom at = disp->conn->icc_atom;
+	struct randr_screen *screen;
+	struct trace_span span;
 
 	if (! is_main_icc_profile (disp))
 		return;
 
-	at = XInternAtom (dpy, "_ICC_PROFILE", False);
+	if (data) {
+		icc_bytes = icc_data_get_bytes (data, &err);
+		if (! icc_bytes) {
+			g_warning ("unable to get ICC data: %s", err->message);
+			g_clear_error (&err);
+		}
+	}
+
+	/* Every write makes all color managed clients reload the profile */
+	screen = find_screen (disp->conn, disp->root);
+	if (screen) {
+		gboolean same;
+		if (! screen->icc_known)
+			read_published_icc (disp->conn, screen,
+					    icc_bytes ? g_bytes_get_size (icc_bytes) : 0);
+		if (icc_bytes)
+			same = data->checksum
+			    && ! g_strcmp0 (screen->icc_checksum, data->checksum);
+		else
+			same = ! screen->icc_present;
+		if (same) {
+			g_debug ("_ICC_PROFILE of root window 0x%lx is up to date",
+				 disp->root);
+			stats_add (STATS_ICC_PROFILE_WRITES_SKIPPED, 1);
+			goto out;
+		}
+		/* whatever was being uploaded is outdated now */
+		cancel_icc_upload (screen);
+
+		screen->icc_known = TRUE;
+		screen->icc_present = (icc_bytes != NULL);
+		g_free (screen->icc_checksum);
+		screen->icc_checksum = icc_bytes ? g_strdup (data->checksum) : NULL;
+
+		stats_add (STATS_ICC_PROFILE_WRITES, 1);
+		if (icc_bytes && g_bytes_get_size (icc_bytes) > disp->conn->icc_chunk) {
+			g_debug ("uploading _ICC_PROFILE for display %s in parts",
+				 disp->pub.name);
+			start_icc_upload (disp->conn, screen, icc_bytes);
+			goto out;
+		}
+	}
 
+	trace_span_init (&span, "setting _ICC_PROFILE", disp->pub.name,
+			 data ? data->checksum : NULL);
+	trace_span_begin (&span);
 	if (icc_bytes) {
+		gint64 start = g_get_monotonic_time ();
 		g_debug ("setting _ICC_PROFILE for display %s", disp->pub.name);
+		if (screen) {
+			screen->icc_serial = NextRequest (dpy);
+			screen->icc_pending++;
+		}
 		res = XChangeProperty (dpy, disp->root, at, XA_CARDINAL, 8, PropModeReplace,
 				       (unsigned char *) g_bytes_get_data (icc_bytes, NULL),
 				       g_bytes_get_size (icc_bytes));
+		XFlush (dpy);
 		oper = "XChangeProperty()";
+		g_debug ("_ICC_PROFILE of %" G_GSIZE_FORMAT " bytes uploaded to root window"
+			 " 0x%lx in %.1f ms", g_bytes_get_size (icc_bytes), disp->root,
+			 (g_get_monotonic_time () - start) / 1000.0);
+		stats_add (STATS_ICC_PROFILE_BYTES, g_bytes_get_size (icc_bytes));
+		stats_observe (STATS_ICC_UPLOAD_TIME, g_get_monotonic_time () - start);
 	} else {
+		if (screen) {
+			screen->icc_serial = NextRequest (dpy);
+			screen->icc_pending++;
+		}
 		res = XDeleteProperty (dpy, disp->root, at);
 		oper = "XDeleteProperty()";
 	}
+	trace_span_end (&span);
 	/* Due to a bug in X this may "fail" with BadRequest but still work */
 	if (res != Success && res != BadRequest) {
 		print_x_error (disp->conn, res, oper);
 	}
 
+out:
+	if (icc_bytes)
+		g_bytes_unref (icc_bytes);
 }
 
 void
-randr_display_private_apply_icc (struct randr_display *disp, CdIcc *icc)
+randr_display_private_apply_icc (struct randr_display *disp, struct icc_data *icc,
+				 struct gamma_ramp *ramp)
 {
-	GBytes *icc_bytes = NULL;
-	GError *err = NULL;
 	struct randr_display_priv *pdisp = (struct randr_display_priv *) disp;
 	if (! pdisp->crtc) /* is display currently off? */
 		return;
-	if (icc) {
-		icc_bytes = cd_icc_save_data (icc, CD_ICC_SAVE_FLAGS_NONE, &err);
-		if (! icc_bytes) {
-			g_warning ("unable to get ICC data: %s", err->message);
-			g_clear_error (&err);
-		}
+	/* gamma first: the ramp cache spares us touching the profile at all */
+	apply_gamma (pdisp, icc, ramp);
+	apply_icc (pdisp, icc);
+}
+
+/* 0 if the display is off or the size is unknown */
+int
+randr_display_private_get_gamma_size (struct randr_display *disp)
+{
+	struct randr_display_priv *pdisp = (struct randr_display_priv *) disp;
+	if (! pdisp->crtc || ! query_gamma_size (pdisp))
+		return 0;
+	return pdisp->gamma_size;
+}
+
+/* Gamma only, _ICC_PROFILE is left alone until the profile itself is there */
+void
+randr_display_private_apply_ramp (struct randr_display *disp, struct gamma_ramp *ramp)
+{
+	struct randr_display_priv *pdisp = (struct randr_display_priv *) disp;
+	if (! pdisp->crtc || ramp->size != pdisp->gamma_size)
+		return;
+	set_ramp (pdisp, gamma_ramp_ref (ramp));
+}
+
+struct gamma_ramp *
+randr_display_private_get_ramp (struct randr_display *disp)
+{
+	struct randr_display_priv *pdisp = (struct randr_display_priv *) disp;
+	/* what an output that is off had may not be what it gets */
+	if (! pdisp->crtc || ! pdisp->applied)
+		return NULL;
+	return gamma_ramp_ref (pdisp->applied);
+}
+
+void
+randr_conn_private_reassert_gamma (struct randr_conn *conn)
+{
+	guint i;
+
+	if (! conn->dpy)
+		return;
+
+	/* the next profile applied looks at what is published first */
+	for (i = 0; i < conn->screens->len; ++i) {
+		struct randr_screen *screen =
+			&g_array_index (conn->screens, struct randr_screen, i);
+		if (! screen->icc_upload)
+			screen->icc_known = FALSE;
+	}
+
+	for (i = 0; i < conn->displays->len; ++i) {
+		struct randr_display_priv *disp = g_ptr_array_index (conn->displays, i);
+		if (! disp->crtc || ! disp->applied)
+			continue;
+		g_debug ("re-asserting gamma of display %s", disp->pub.name);
+		upload_gamma (disp, disp->applied);
 	}
-	apply_gamma (pdisp, icc);
-	apply_icc (pdisp, icc_bytes);
-	if (icc_bytes)
-		g_bytes_unref (icc_bytes);
 }
 
 struct randr_display *
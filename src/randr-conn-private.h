@@ -2,22 +2,66 @@
 #define __RANDR_CONN_PRIVATE_H__
 
 #include <colord.h>
+#include "edid-cache.h"
 #include "randr-conn.h"
+#include "ramp-cache.h"
 #include <glib.h>
 #include <glib-object.h>
 #include <X11/extensions/Xrandr.h>
 #include <X11/Xlib.h>
+#ifdef HAVE_XCB
+#include <X11/Xlib-xcb.h>
+#endif
 
 G_BEGIN_DECLS
 
+struct icc_upload;
+
+/* Configuration of a screen as of our last look at it */
+struct randr_screen {
+	Window		root;
+	Time		timestamp;
+	Time		config_timestamp;
+	gboolean	probed;
+
+	/* _ICC_PROFILE of the root window */
+	gboolean	icc_known;	/* FALSE until looked at */
+	gboolean	icc_present;
+	gchar		*icc_checksum;	/* NULL if present but unknown */
+	struct icc_upload *icc_upload;	/* NULL unless one is in progress */
+	unsigned long	icc_serial;	/* of our last request changing it */
+	guint		icc_pending;	/* our changes not notified yet */
+};
+
 typedef struct randr_conn {
 	GObject		*object;
 	Display		*dpy;
+#ifdef HAVE_XCB
+	xcb_connection_t *xcb;		/* same connection, NULL to use Xlib */
+#endif
+	gchar		*ns;		/* prefix of display names, may be NULL */
 	int		event_base;
 	int		error_base;
 	Atom		edid_atom;
 	Atom		type_atom;
+	Atom		panel_atom;	/* None if no connector is a panel */
+	Atom		icc_atom;
+	gsize		icc_chunk;	/* larger profiles are uploaded in parts */
 	GPtrArray	*displays;
+	GHashTable	*outputs;		/* RROutput -> display */
+	GArray		*screens;		/* of struct randr_screen */
+
+	/* RandR changes seen but not processed yet */
+	GHashTable	*pending_screens;	/* root Window -> struct screen_change */
+	GHashTable	*pending_outputs;	/* RROutput -> root Window */
+	GHashTable	*pending_crtcs;		/* RRCrtc -> struct crtc_change */
+
+	/* event coalescing, in microseconds */
+	gint64		coalesce_quiet;
+	gint64		coalesce_max;
+
+	gint64		event_time;	/* of the oldest event being handled */
+	gboolean	broken;		/* the X server went away */
 } RandrConnPrivate;
 
 struct randr_display_priv {
@@ -25,19 +69,60 @@ struct randr_display_priv {
 
 	struct randr_conn	*conn;
 	Window			root;
+	RROutput		output;
+	RRCrtc			crtc;
+	RRMode			mode;		/* None if not known */
+	Rotation		rotation;
+	struct edid_info	*edid_info;	/* NULL if there is no EDID */
+
+	int			gamma_size;	/* of crtc, 0 if not queried yet */
+	struct gamma_ramp	*applied;	/* last ramp uploaded to crtc */
+};
+
+/* What the server told us about an output */
+struct randr_output_state {
+	RROutput		output;
+	int			index;		/* in the screen resources */
+	gchar			*name;
 	RRCrtc			crtc;
+	gboolean		connected;
+	gboolean		is_panel;	/* only looked at for new outputs */
+	int			gamma_size;	/* of crtc, 0 if not queried */
+	GBytes			*edid;		/* NULL if there is none */
+};
+
+/* Outputs of a screen, fetched in one go */
+struct randr_screen_state {
+	RROutput		primary;
+	RROutput		*outputs;	/* all the outputs of the screen */
+	int			noutput;
+	GArray			*states;	/* of struct randr_output_state */
+};
+
+struct screen_change {
+	Time			timestamp;
+	Time			config_timestamp;
+};
+
+struct crtc_change {
+	Window			root;
+	RRMode			mode;
+	Rotation		rotation;
 };
 
 struct randr_source {
 	GSource			parent;
 	struct randr_conn	*conn;
 	GPollFD			poll_fd;
+	gint64			first_event;	/* of unprocessed ones, 0 if none */
+	gint64			last_event;
 };
 
 enum {
 	SIG_DISPLAY_ADDED,
 	SIG_DISPLAY_REMOVED,
 	SIG_DISPLAY_CHANGED,
+	SIG_CLOSED,
 	N_SIG
 };
 
@@ -49,10 +134,16 @@ void randr_conn_private_init (struct randr_conn *conn, const gchar *disp_name);
 void randr_conn_private_finalize (struct randr_conn *conn);
 void randr_conn_private_start (struct randr_conn *conn);
 void randr_conn_private_update (struct randr_conn *conn);
+void randr_conn_private_update_pending (struct randr_conn *conn);
 struct randr_display *randr_conn_private_find_display (struct randr_conn *conn,
 						       const gchar *key,
 						       get_find_key_fn get_find_key);
-void randr_display_private_apply_icc (struct randr_display *disp, CdIcc *icc);
+void randr_display_private_apply_icc (struct randr_display *disp, struct icc_data *icc,
+				      struct gamma_ramp *ramp);
+int randr_display_private_get_gamma_size (struct randr_display *disp);
+void randr_display_private_apply_ramp (struct randr_display *disp, struct gamma_ramp *ramp);
+struct gamma_ramp *randr_display_private_get_ramp (struct randr_display *disp);
+void randr_conn_private_reassert_gamma (struct randr_conn *conn);
 
 G_END_DECLS
 
@@ -88,6 +88,12 @@ randr_conn_class_init (RandrConnClass *klass)
 		0, NULL, NULL, NULL,
 		G_TYPE_NONE, 1, G_TYPE_POINTER);
 
+	/* the connection broke, after display_removed for all its displays */
+	randr_signals[SIG_CLOSED] = g_signal_new ("closed",
+		G_TYPE_FROM_CLASS (obj_class), G_SIGNAL_RUN_LAST,
+		0, NULL, NULL, NULL,
+		G_TYPE_NONE, 0);
+
 	g_object_class_install_property (obj_class, PROP_DISPLAY,
 		g_param_spec_string ("display", NULL, "X Display", NULL,
 				     G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY)
@@ -109,6 +115,30 @@ randr_conn_start (RandrConn *conn)
 	randr_conn_private_start (priv);
 }
 
+/* FALSE if the display could not be opened or lacks RandR 1.3 */
+gboolean
+randr_conn_is_open (RandrConn *conn)
+{
+	struct randr_conn *priv = randr_conn_get_instance_private (conn);
+	return priv->dpy != NULL;
+}
+
+void
+randr_conn_set_namespace (RandrConn *conn, const gchar *ns)
+{
+	struct randr_conn *priv = randr_conn_get_instance_private (conn);
+	g_free (priv->ns);
+	priv->ns = g_strdup (ns);
+}
+
+void
+randr_conn_set_coalescing (RandrConn *conn, guint quiet_ms, guint max_ms)
+{
+	struct randr_conn *priv = randr_conn_get_instance_private (conn);
+	priv->coalesce_quiet = (gint64) quiet_ms * G_TIME_SPAN_MILLISECOND;
+	priv->coalesce_max = (gint64) MAX (quiet_ms, max_ms) * G_TIME_SPAN_MILLISECOND;
+}
+
 static const gchar *
 get_name_key (struct randr_display *dpy)
 {
@@ -134,10 +164,37 @@ struct randr_display *randr_conn_find_display_by_edid (RandrConn *conn, const gc
 	return randr_conn_private_find_display (priv, edid_cksum, get_edid_key);
 }
 
+/* ramp may have been made of icc beforehand, NULL to make it here */
+void
+randr_display_apply_icc (struct randr_display *disp, struct icc_data *icc,
+			 struct gamma_ramp *ramp)
+{
+	randr_display_private_apply_icc (disp, icc, ramp);
+}
+
+int
+randr_display_get_gamma_size (struct randr_display *disp)
+{
+	return randr_display_private_get_gamma_size (disp);
+}
+
 void
-randr_display_apply_icc (struct randr_display *disp, CdIcc *icc)
+randr_display_apply_ramp (struct randr_display *disp, struct gamma_ramp *ramp)
 {
-	randr_display_private_apply_icc (disp, icc);
+	randr_display_private_apply_ramp (disp, ramp);
+}
+
+struct gamma_ramp *
+randr_display_get_ramp (struct randr_display *disp)
+{
+	return randr_display_private_get_ramp (disp);
+}
+
+void
+randr_conn_reassert_gamma (RandrConn *conn)
+{
+	struct randr_conn *priv = randr_conn_get_instance_private (conn);
+	randr_conn_private_reassert_gamma (priv);
 }
 
 /* vim: set ts=8 sw=8 tw=0 : */
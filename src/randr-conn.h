@@ -7,6 +7,9 @@
 
 G_BEGIN_DECLS
 
+struct icc_data;
+struct gamma_ramp;
+
 #define RANDR_TYPE_CONN \
 	(randr_conn_get_type ())
 G_DECLARE_FINAL_TYPE (RandrConn, randr_conn, RANDR, CONN, GObject)
@@ -22,12 +25,25 @@ struct randr_display {
 	CdEdid		*edid;
 };
 
+/* RandR events arriving within this time are handled together */
+#define RANDR_COALESCE_QUIET_MS	100
+/* but no event waits longer than this */
+#define RANDR_COALESCE_MAX_MS	500
+
 GType randr_conn_get_type (void);
 RandrConn *randr_conn_new (const gchar *display);
 void randr_conn_start (RandrConn *conn);
+gboolean randr_conn_is_open (RandrConn *conn);
+void randr_conn_set_namespace (RandrConn *conn, const gchar *ns);
+void randr_conn_set_coalescing (RandrConn *conn, guint quiet_ms, guint max_ms);
 struct randr_display *randr_conn_find_display_by_name (RandrConn *conn, const gchar *name);
 struct randr_display *randr_conn_find_display_by_edid (RandrConn *conn, const gchar *edid_cksum);
-void randr_display_apply_icc (struct randr_display *disp, CdIcc *icc);
+void randr_display_apply_icc (struct randr_display *disp, struct icc_data *icc,
+			      struct gamma_ramp *ramp);
+int randr_display_get_gamma_size (struct randr_display *disp);
+void randr_display_apply_ramp (struct randr_display *disp, struct gamma_ramp *ramp);
+struct gamma_ramp *randr_display_get_ramp (struct randr_display *disp);
+void randr_conn_reassert_gamma (RandrConn *conn);
 
 G_END_DECLS
 
@@ -0,0 +1,314 @@
+#include "randr-conn-private.h"
+#include "randr-xcb.h"
+#include "stats.h"
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/randr.h>
+
+/*
+ * Everything the server is asked about a screen goes out at once and the
+ * replies are collected afterwards, so that enumeration takes two round
+ * trips however many outputs there are: one for the screen resources and
+ * one for the outputs, their properties and the gamma sizes of the CRTCs.
+ */
+
+struct output_cookies {
+	RROutput				output;
+	int					index;
+	gboolean				has_type;
+	xcb_randr_get_output_info_cookie_t	info;
+	xcb_randr_get_output_property_cookie_t	edid;
+	xcb_randr_get_output_property_cookie_t	type;
+};
+
+struct crtc_cookies {
+	RRCrtc					crtc;
+	xcb_randr_get_crtc_gamma_size_cookie_t	gamma_size;
+};
+
+static inline gboolean
+check_reply (void *reply, xcb_generic_error_t *err, const gchar *what)
+{
+	if (err) {
+		g_critical ("X error %i in %s", err->error_code, what);
+		free (err);
+	}
+	return (reply != NULL);
+}
+
+static void
+free_reply (void *reply)
+{
+	free (reply);
+}
+
+static GBytes *
+property_bytes (xcb_randr_get_output_property_reply_t *reply, xcb_atom_t type, int fmt)
+{
+	if (! reply)
+		return NULL;
+
+	if (reply->type != type || reply->format != fmt || reply->num_items == 0) {
+		free (reply);
+		return NULL;
+	}
+
+	/* the data is inside the reply, which goes away with the bytes */
+	return g_bytes_new_with_free_func (xcb_randr_get_output_property_data (reply),
+					   xcb_randr_get_output_property_data_length (reply),
+					   free_reply, reply);
+}
+
+static GBytes *
+get_output_property (xcb_connection_t *c, xcb_randr_get_output_property_cookie_t cookie,
+		     xcb_atom_t type, int fmt)
+{
+	xcb_generic_error_t *err = NULL;
+	xcb_randr_get_output_property_reply_t *reply =
+		xcb_randr_get_output_property_reply (c, cookie, &err);
+
+	if (! check_reply (reply, err, "RRGetOutputProperty"))
+		return NULL;
+	return property_bytes (reply, type, fmt);
+}
+
+static gboolean
+get_output_property_atom (xcb_connection_t *c, xcb_randr_get_output_property_cookie_t cookie,
+			  xcb_atom_t value_eq)
+{
+	gboolean retval = FALSE;
+	GBytes *raw = get_output_property (c, cookie, XCB_ATOM_ATOM, 32);
+	if (! raw)
+		return retval;
+	if (g_bytes_get_size (raw) == 4)
+		retval = (*((const guint32 *) g_bytes_get_data (raw, NULL)) == value_eq);
+	g_bytes_unref (raw);
+	return retval;
+}
+
+static gboolean
+get_resources (struct randr_conn *conn, struct randr_screen *screen,
+	       struct randr_screen_state *st, GArray *crtcs)
+{
+	xcb_connection_t *c = conn->xcb;
+	xcb_generic_error_t *err = NULL;
+	xcb_randr_get_screen_resources_current_cookie_t rc;
+	xcb_randr_get_output_primary_cookie_t pc;
+	xcb_randr_get_screen_resources_current_reply_t *rsrc;
+	xcb_randr_get_output_primary_reply_t *primary;
+	const xcb_randr_output_t *outputs;
+	const xcb_randr_crtc_t *crtc_ids;
+	int noutput, ncrtc;
+	Time timestamp, config_timestamp;
+	int i;
+
+	/* Probing may take a long while and even blank the screen */
+	rc = xcb_randr_get_screen_resources_current (c, screen->root);
+	pc = xcb_randr_get_output_primary (c, screen->root);
+
+	stats_add (STATS_X_ROUND_TRIPS, 1);
+	rsrc = xcb_randr_get_screen_resources_current_reply (c, rc, &err);
+	check_reply (rsrc, err, "RRGetScreenResourcesCurrent");
+	err = NULL;
+	primary = xcb_randr_get_output_primary_reply (c, pc, &err);
+	if (check_reply (primary, err, "RRGetOutputPrimary")) {
+		st->primary = primary->output;
+		free (primary);
+	}
+
+	if (! rsrc) {
+		g_critical ("RRGetScreenResourcesCurrent failed"
+			    " at root window 0x%lx", screen->root);
+		return FALSE;
+	}
+
+	timestamp = rsrc->timestamp;
+	config_timestamp = rsrc->config_timestamp;
+	noutput = rsrc->num_outputs;
+	ncrtc = rsrc->num_crtcs;
+	outputs = xcb_randr_get_screen_resources_current_outputs (rsrc);
+	crtc_ids = xcb_randr_get_screen_resources_current_crtcs (rsrc);
+
+	/* Nobody has probed this screen yet, so the server knows nothing */
+	if (noutput == 0 && ! screen->probed) {
+		xcb_randr_get_screen_resources_reply_t *prsrc;
+
+		g_debug ("probing outputs of root window 0x%lx", screen->root);
+		free (rsrc);
+		err = NULL;
+		stats_add (STATS_X_ROUND_TRIPS, 1);
+		prsrc = xcb_randr_get_screen_resources_reply (c,
+				xcb_randr_get_screen_resources (c, screen->root), &err);
+		screen->probed = TRUE;
+		if (! check_reply (prsrc, err, "RRGetScreenResources")) {
+			g_critical ("RRGetScreenResources failed"
+				    " at root window 0x%lx", screen->root);
+			return FALSE;
+		}
+		/* both replies have the same layout */
+		rsrc = (xcb_randr_get_screen_resources_current_reply_t *) prsrc;
+		timestamp = prsrc->timestamp;
+		config_timestamp = prsrc->config_timestamp;
+		noutput = prsrc->num_outputs;
+		ncrtc = prsrc->num_crtcs;
+		outputs = xcb_randr_get_screen_resources_outputs (prsrc);
+		crtc_ids = xcb_randr_get_screen_resources_crtcs (prsrc);
+	}
+	screen->probed = TRUE;
+
+	screen->timestamp = timestamp;
+	screen->config_timestamp = config_timestamp;
+
+	st->noutput = noutput;
+	st->outputs = g_new (RROutput, noutput);
+	for (i = 0; i < noutput; ++i)
+		st->outputs[i] = outputs[i];
+
+	for (i = 0; i < ncrtc; ++i) {
+		struct crtc_cookies cc;
+		cc.crtc = crtc_ids[i];
+		g_array_append_val (crtcs, cc);
+	}
+
+	free (rsrc);
+
+	return TRUE;
+}
+
+static inline int
+crtc_gamma_size (GArray *crtcs, const int *sizes, RRCrtc crtc)
+{
+	guint i;
+	for (i = 0; i < crtcs->len; ++i) {
+		if (g_array_index (crtcs, struct crtc_cookies, i).crtc == crtc)
+			return sizes[i];
+	}
+	return 0;
+}
+
+gboolean
+randr_xcb_fetch_screen (struct randr_conn *conn, struct randr_screen *screen,
+			GHashTable *wanted, struct randr_screen_state *st)
+{
+	xcb_connection_t *c = conn->xcb;
+	GArray *cookies;
+	GArray *crtcs;
+	int *gamma_sizes = NULL;
+	guint i;
+	int io;
+
+	crtcs = g_array_new (FALSE, FALSE, sizeof (struct crtc_cookies));
+
+	if (! get_resources (conn, screen, st, crtcs)) {
+		g_array_unref (crtcs);
+		return FALSE;
+	}
+
+	cookies = g_array_sized_new (FALSE, FALSE, sizeof (struct output_cookies),
+				     st->noutput);
+
+	/* Send everything... */
+	for (io = 0; io < st->noutput; ++io) {
+		struct output_cookies oc;
+		RROutput out = st->outputs[io];
+
+		if (wanted && ! g_hash_table_contains (wanted, GUINT_TO_POINTER (out)))
+			continue;
+
+		oc.output = out;
+		oc.index = io;
+		oc.info = xcb_randr_get_output_info (c, out, screen->config_timestamp);
+		/* asked for even if the output turns out to be disconnected */
+		oc.edid = xcb_randr_get_output_property (c, out, conn->edid_atom,
+							 XCB_GET_PROPERTY_TYPE_ANY,
+							 0, 100, 0, 0);
+		/* the connector type never changes, known outputs have it */
+		oc.has_type = (conn->panel_atom != None
+			       && ! g_hash_table_contains (conn->outputs,
+							   GUINT_TO_POINTER (out)));
+		if (oc.has_type)
+			oc.type = xcb_randr_get_output_property (c, out, conn->type_atom,
+								 XCB_ATOM_ATOM,
+								 0, 1, 0, 0);
+		g_array_append_val (cookies, oc);
+	}
+
+	for (i = 0; i < crtcs->len; ++i) {
+		struct crtc_cookies *cc = &g_array_index (crtcs, struct crtc_cookies, i);
+		cc->gamma_size = xcb_randr_get_crtc_gamma_size (c, cc->crtc);
+	}
+
+	/* ...then wait for the replies, in the same order */
+	if (cookies->len || crtcs->len)
+		stats_add (STATS_X_ROUND_TRIPS, 1);
+	for (i = 0; i < cookies->len; ++i) {
+		struct output_cookies *oc = &g_array_index (cookies, struct output_cookies, i);
+		struct randr_output_state os;
+		xcb_generic_error_t *err = NULL;
+		xcb_randr_get_output_info_reply_t *inf;
+
+		memset (&os, 0, sizeof (os));
+		os.output = oc->output;
+		os.index = oc->index;
+
+		inf = xcb_randr_get_output_info_reply (c, oc->info, &err);
+		if (check_reply (inf, err, "RRGetOutputInfo")) {
+			os.name = g_strndup ((const gchar *) xcb_randr_get_output_info_name (inf),
+					     xcb_randr_get_output_info_name_length (inf));
+			os.crtc = inf->crtc;
+			os.connected = (inf->connection != XCB_RANDR_CONNECTION_DISCONNECTED);
+			free (inf);
+		}
+
+		/* replies must be collected even when they are of no use */
+		os.edid = get_output_property (c, oc->edid, XCB_ATOM_INTEGER, 8);
+		if (oc->has_type)
+			os.is_panel = get_output_property_atom (c, oc->type,
+								conn->panel_atom);
+
+		if (! os.name) {
+			g_critical ("RRGetOutputInfo failed for output 0x%lx",
+				    (unsigned long) oc->output);
+			if (os.edid)
+				g_bytes_unref (os.edid);
+			continue;
+		}
+
+		if (! os.connected && os.edid) {
+			g_bytes_unref (os.edid);
+			os.edid = NULL;
+		}
+
+		g_array_append_val (st->states, os);
+	}
+
+	if (crtcs->len)
+		gamma_sizes = g_new0 (int, crtcs->len);
+	for (i = 0; i < crtcs->len; ++i) {
+		struct crtc_cookies *cc = &g_array_index (crtcs, struct crtc_cookies, i);
+		xcb_generic_error_t *err = NULL;
+		xcb_randr_get_crtc_gamma_size_reply_t *reply =
+			xcb_randr_get_crtc_gamma_size_reply (c, cc->gamma_size, &err);
+		if (check_reply (reply, err, "RRGetCrtcGammaSize")) {
+			gamma_sizes[i] = reply->size;
+			free (reply);
+		}
+	}
+
+	for (i = 0; i < st->states->len; ++i) {
+		struct randr_output_state *os =
+			&g_array_index (st->states, struct randr_output_state, i);
+		if (os->crtc)
+			os->gamma_size = crtc_gamma_size (crtcs, gamma_sizes, os->crtc);
+	}
+
+	g_free (gamma_sizes);
+	g_array_unref (cookies);
+	g_array_unref (crtcs);
+
+	return TRUE;
+}
+
+/* vim: set ts=8 sw=8 tw=0 : */
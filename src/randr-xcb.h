@@ -0,0 +1,16 @@
+#ifndef __RANDR_XCB_H__
+#define __RANDR_XCB_H__
+
+#include "randr-conn-private.h"
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gboolean randr_xcb_fetch_screen (struct randr_conn *conn, struct randr_screen *screen,
+				 GHashTable *wanted, struct randr_screen_state *st);
+
+G_END_DECLS
+
+#endif /* __RANDR_XCB_H__ */
+
+/* vim: set ts=8 sw=8 tw=0 : */
@@ -0,0 +1,325 @@
+#include "snapshot.h"
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+/* Written a while after the last change rather than on every one */
+#define SNAPSHOT_SAVE_DELAY_S	2
+/* Monitors not seen for the longest make room for new ones */
+#define SNAPSHOT_MAX_ENTRIES	32
+/* Anything larger is a broken file, not a CRTC */
+#define SNAPSHOT_MAX_GAMMA	65536
+
+#define SNAPSHOT_MAGIC		"xiccdsn1"
+#define SNAPSHOT_CKSUM_LEN	40
+
+/*
+ * The file is this header followed by records, each one followed by its
+ * planar red, green and blue ramps and padded to 8 bytes. Host byte order:
+ * a snapshot from elsewhere is simply ignored.
+ */
+struct snapshot_header {
+	gchar		magic[8];
+	guint32		count;
+	guint32		reserved;
+};
+
+struct snapshot_record {
+	gchar		edid[SNAPSHOT_CKSUM_LEN];	/* NUL-padded */
+	gchar		profile[SNAPSHOT_CKSUM_LEN];	/* NUL-padded */
+	gint64		used;				/* real time, in seconds */
+	guint32		size;				/* of each ramp */
+	guint32		reserved;
+};
+
+struct snapshot_entry {
+	gchar			*edid;
+	gchar			*profile;
+	gint64			used;
+	struct gamma_ramp	*ramp;
+};
+
+static struct {
+	GHashTable	*entries;	/* "edid:size" -> struct snapshot_entry */
+	gchar		*path;
+	guint		save_source;
+	gboolean	dirty;
+} snap;
+
+static void
+snapshot_entry_free (struct snapshot_entry *entry)
+{
+	gamma_ramp_unref (entry->ramp);
+	g_free (entry->edid);
+	g_free (entry->profile);
+	g_free (entry);
+}
+
+static void
+ensure_entries (void)
+{
+	if (snap.entries)
+		return;
+	snap.entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+					      (GDestroyNotify) snapshot_entry_free);
+	snap.path = g_build_filename (g_get_user_cache_dir (), "xiccd", "snapshot", NULL);
+}
+
+static inline gsize
+record_bytes (guint32 size)
+{
+	return sizeof (struct snapshot_record) + ((3 * size * sizeof (guint16) + 7) & ~7);
+}
+
+static void
+insert_entry (const gchar *edid, const gchar *profile, gint64 used,
+	      struct gamma_ramp *ramp)
+{
+	struct snapshot_entry *entry = g_new (struct snapshot_entry, 1);
+
+	entry->edid = g_strdup (edid);
+	entry->profile = g_strdup (profile);
+	entry->used = used;
+	entry->ramp = gamma_ramp_ref (ramp);
+	g_hash_table_replace (snap.entries,
+			      g_strdup_printf ("%s:%i", edid, ramp->size), entry);
+}
+
+void
+snapshot_load (void)
+{
+	GMappedFile *map;
+	GError *err = NULL;
+	const guint8 *p;
+	const guint8 *end;
+	const struct snapshot_header *hdr;
+	guint32 i;
+
+	ensure_entries ();
+
+	map = g_mapped_file_new (snap.path, FALSE, &err);
+	if (! map) {
+		/* nothing saved yet is fine */
+		if (! g_error_matches (err, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			g_warning ("unable to read snapshot: %s", err->message);
+		g_error_free (err);
+		return;
+	}
+
+	p = (const guint8 *) g_mapped_file_get_contents (map);
+	end = p + g_mapped_file_get_length (map);
+	hdr = (const struct snapshot_header *) p;
+	if ((gsize) (end - p) < sizeof (*hdr) || memcmp (hdr->magic, SNAPSHOT_MAGIC, 8)) {
+		g_warning ("ignoring snapshot %s: unknown format", snap.path);
+		goto out;
+	}
+
+	p += sizeof (*hdr);
+	for (i = 0; i < hdr->count; ++i) {
+		const struct snapshot_record *rec = (const struct snapshot_record *) p;
+		struct gamma_ramp *ramp;
+
+		if ((gsize) (end - p) < sizeof (*rec) || ! rec->size
+		    || rec->size > SNAPSHOT_MAX_GAMMA
+		    || (gsize) (end - p) < record_bytes (rec->size)
+		    || ! memchr (rec->edid, 0, SNAPSHOT_CKSUM_LEN)
+		    || ! memchr (rec->profile, 0, SNAPSHOT_CKSUM_LEN)) {
+			g_warning ("snapshot %s is truncated", snap.path);
+			break;
+		}
+
+		/* the file has the same layout as the ramp */
+		ramp = gamma_ramp_new (rec->size);
+		memcpy (ramp->red, rec + 1, 3 * rec->size * sizeof (guint16));
+		insert_entry (rec->edid, rec->profile, rec->used, ramp);
+		gamma_ramp_unref (ramp);
+
+		p += record_bytes (rec->size);
+	}
+	g_debug ("%u gamma ramps in snapshot", g_hash_table_size (snap.entries));
+
+out:
+	g_mapped_file_unref (map);
+}
+
+/* Returns the profile checksum, *ramp gets a new reference */
+const gchar *
+snapshot_lookup (const gchar *edid, int size, struct gamma_ramp **ramp)
+{
+	gchar key[128];
+	struct snapshot_entry *entry;
+
+	if (! snap.entries || ! edid)
+		return NULL;
+
+	g_snprintf (key, sizeof (key), "%s:%i", edid, size);
+	entry = g_hash_table_lookup (snap.entries, key);
+	if (! entry)
+		return NULL;
+
+	*ramp = gamma_ramp_ref (entry->ramp);
+	return entry->profile;
+}
+
+static gboolean
+save_timeout (gpointer user_data)
+{
+	(void) user_data;
+	snap.save_source = 0;
+	snapshot_save ();
+	return G_SOURCE_REMOVE;
+}
+
+static void
+mark_dirty (void)
+{
+	snap.dirty = TRUE;
+	if (! snap.save_source)
+		snap.save_source = g_timeout_add_seconds (SNAPSHOT_SAVE_DELAY_S,
+							  save_timeout, NULL);
+}
+
+static void
+evict_oldest (void)
+{
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	gpointer oldest = NULL;
+	gint64 used = G_MAXINT64;
+
+	g_hash_table_iter_init (&iter, snap.entries);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		struct snapshot_entry *entry = (struct snapshot_entry *) value;
+		if (entry->used < used) {
+			used = entry->used;
+			oldest = key;
+		}
+	}
+	if (oldest)
+		g_hash_table_remove (snap.entries, oldest);
+}
+
+void
+snapshot_record (const gchar *edid, const gchar *profile, struct gamma_ramp *ramp)
+{
+	gchar key[128];
+	struct snapshot_entry *entry;
+	gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+
+	if (strlen (edid) >= SNAPSHOT_CKSUM_LEN || strlen (profile) >= SNAPSHOT_CKSUM_LEN)
+		return;
+
+	ensure_entries ();
+
+	g_snprintf (key, sizeof (key), "%s:%i", edid, ramp->size);
+	entry = g_hash_table_lookup (snap.entries, key);
+	if (entry && ! strcmp (entry->profile, profile)) {
+		/* not worth a write by itself, but saved with the next one */
+		entry->used = now;
+		snap.dirty = TRUE;
+		return;
+	}
+	if (entry)
+		g_debug ("profile for EDID %s changed since the snapshot", edid);
+
+	insert_entry (edid, profile, now, ramp);
+	while (g_hash_table_size (snap.entries) > SNAPSHOT_MAX_ENTRIES)
+		evict_oldest ();
+	mark_dirty ();
+}
+
+void
+snapshot_forget (const gchar *edid)
+{
+	GHashTableIter iter;
+	gpointer value;
+	gboolean removed = FALSE;
+
+	if (! snap.entries || ! edid)
+		return;
+
+	/* every gamma size there was */
+	g_hash_table_iter_init (&iter, snap.entries);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		struct snapshot_entry *entry = (struct snapshot_entry *) value;
+		if (! strcmp (entry->edid, edid)) {
+			g_hash_table_iter_remove (&iter);
+			removed = TRUE;
+		}
+	}
+	if (removed)
+		mark_dirty ();
+}
+
+static void
+append_record (GByteArray *buf, const struct snapshot_entry *entry)
+{
+	static const guint8 zeros[8];
+	struct snapshot_record rec;
+	gsize ramp_size = 3 * entry->ramp->size * sizeof (guint16);
+
+	memset (&rec, 0, sizeof (rec));
+	strcpy (rec.edid, entry->edid);
+	strcpy (rec.profile, entry->profile);
+	rec.used = entry->used;
+	rec.size = entry->ramp->size;
+
+	g_byte_array_append (buf, (const guint8 *) &rec, sizeof (rec));
+	g_byte_array_append (buf, (const guint8 *) entry->ramp->red, ramp_size);
+	g_byte_array_append (buf, zeros, record_bytes (rec.size) - sizeof (rec) - ramp_size);
+}
+
+void
+snapshot_save (void)
+{
+	GByteArray *buf;
+	struct snapshot_header hdr;
+	GHashTableIter iter;
+	gpointer value;
+	GError *err = NULL;
+	gchar *dir;
+
+	if (! snap.dirty)
+		return;
+	snap.dirty = FALSE;
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, SNAPSHOT_MAGIC, sizeof (hdr.magic));
+	hdr.count = g_hash_table_size (snap.entries);
+
+	buf = g_byte_array_new ();
+	g_byte_array_append (buf, (const guint8 *) &hdr, sizeof (hdr));
+	g_hash_table_iter_init (&iter, snap.entries);
+	while (g_hash_table_iter_next (&iter, NULL, &value))
+		append_record (buf, (const struct snapshot_entry *) value);
+
+	dir = g_path_get_dirname (snap.path);
+	g_mkdir_with_parents (dir, 0700);
+	g_free (dir);
+
+	/* atomically, a crash must not leave half of it for the next start */
+	if (! g_file_set_contents (snap.path, (const gchar *) buf->data, buf->len, &err)) {
+		g_warning ("unable to write snapshot: %s", err->message);
+		g_error_free (err);
+	}
+	g_byte_array_unref (buf);
+}
+
+void
+snapshot_clear (void)
+{
+	if (snap.save_source) {
+		g_source_remove (snap.save_source);
+		snap.save_source = 0;
+	}
+	if (snap.entries) {
+		g_hash_table_unref (snap.entries);
+		snap.entries = NULL;
+	}
+	g_free (snap.path);
+	snap.path = NULL;
+	snap.dirty = FALSE;
+}
+
+/* vim: set ts=8 sw=8 tw=0 : */
@@ -0,0 +1,25 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include "ramp-cache.h"
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * What each monitor had last time: the checksum of its default profile and
+ * the ramp made of it, by EDID checksum and gamma size. Kept in the user's
+ * cache directory, so that gamma is restored before colord has answered.
+ */
+void snapshot_load (void);
+const gchar *snapshot_lookup (const gchar *edid, int size, struct gamma_ramp **ramp);
+void snapshot_record (const gchar *edid, const gchar *profile, struct gamma_ramp *ramp);
+void snapshot_forget (const gchar *edid);
+void snapshot_save (void);
+void snapshot_clear (void);
+
+G_END_DECLS
+
+#endif /* __SNAPSHOT_H__ */
+
+/* vim: set ts=8 sw=8 tw=0 : */
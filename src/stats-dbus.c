@@ -0,0 +1,97 @@
+#include "stats.h"
+#include "stats-dbus.h"
+#include <gio/gio.h>
+#include <glib.h>
+
+static const gchar introspection_xml[] =
+	"<node>"
+	"  <interface name='" STATS_DBUS_INTERFACE "'>"
+	"    <method name='GetCounters'>"
+	"      <arg type='a{sa{st}}' name='counters' direction='out'/>"
+	"    </method>"
+	"    <method name='GetText'>"
+	"      <arg type='s' name='text' direction='out'/>"
+	"    </method>"
+	"  </interface>"
+	"</node>";
+
+static GDBusNodeInfo *introspection;
+
+static void
+method_call (GDBusConnection *conn, const gchar *sender, const gchar *path,
+	     const gchar *iface, const gchar *method, GVariant *params,
+	     GDBusMethodInvocation *inv, gpointer user_data)
+{
+	(void) conn;
+	(void) sender;
+	(void) path;
+	(void) iface;
+	(void) params;
+	(void) user_data;
+
+	if (! g_strcmp0 (method, "GetCounters")) {
+		g_dbus_method_invocation_return_value (inv,
+			g_variant_new ("(@a{sa{st}})", stats_get_counters ()));
+	} else if (! g_strcmp0 (method, "GetText")) {
+		gchar *text = stats_format ();
+		g_dbus_method_invocation_return_value (inv, g_variant_new ("(s)", text));
+		g_free (text);
+	} else {
+		g_dbus_method_invocation_return_error (inv, G_DBUS_ERROR,
+						       G_DBUS_ERROR_UNKNOWN_METHOD,
+						       "No method %s", method);
+	}
+}
+
+static const GDBusInterfaceVTable vtable = {
+	method_call, NULL, NULL, { NULL }
+};
+
+static void
+bus_acquired (GDBusConnection *conn, const gchar *name, gpointer user_data)
+{
+	GError *err = NULL;
+	guint registration;
+	(void) name;
+	(void) user_data;
+
+	registration = g_dbus_connection_register_object (conn, STATS_DBUS_PATH,
+				introspection->interfaces[0], &vtable, NULL, NULL, &err);
+	if (! registration) {
+		g_critical ("unable to export statistics: %s", err->message);
+		g_error_free (err);
+	}
+}
+
+static void
+name_lost (GDBusConnection *conn, const gchar *name, gpointer user_data)
+{
+	(void) conn;
+	(void) user_data;
+	/* e.g. another xiccd in the same session */
+	g_debug ("statistics are not on D-Bus: %s is owned by somebody else", name);
+}
+
+/* Statistics can be read on the session bus while this is owned */
+guint
+stats_dbus_own (void)
+{
+	if (! introspection)
+		introspection = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
+
+	return g_bus_own_name (G_BUS_TYPE_SESSION, STATS_DBUS_NAME,
+			       G_BUS_NAME_OWNER_FLAGS_NONE, bus_acquired, NULL,
+			       name_lost, NULL, NULL);
+}
+
+void
+stats_dbus_unown (guint owner_id)
+{
+	g_bus_unown_name (owner_id);
+	if (introspection) {
+		g_dbus_node_info_unref (introspection);
+		introspection = NULL;
+	}
+}
+
+/* vim: set ts=8 sw=8 tw=0 : */
@@ -0,0 +1,19 @@
+#ifndef __STATS_DBUS_H__
+#define __STATS_DBUS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define STATS_DBUS_NAME		"io.github.agalakhov.xiccd"
+#define STATS_DBUS_PATH		"/io/github/agalakhov/xiccd"
+#define STATS_DBUS_INTERFACE	"io.github.agalakhov.xiccd.Stats"
+
+guint stats_dbus_own (void);
+void stats_dbus_unown (guint owner_id);
+
+G_END_DECLS
+
+#endif /* __STATS_DBUS_H__ */
+
+/* vim: set ts=8 sw=8 tw=0 : */
@@ -0,0 +1,307 @@
+#include "stats.h"
+#include "edid-cache.h"
+#include "ramp-cache.h"
+#include <glib.h>
+#include <string.h>
+
+/* Upper bounds of the histogram buckets, in milliseconds */
+static const guint buckets_ms[] = {
+	1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000
+};
+#define N_BUCKETS G_N_ELEMENTS (buckets_ms)
+
+struct stats_info {
+	const gchar	*name;		/* without the xiccd_ prefix */
+	const gchar	*help;
+};
+
+static const struct stats_info counter_info[STATS_N_COUNTERS] = {
+	{ "randr_events_total", "RandR events received" },
+	{ "randr_full_updates_total", "Updates looking at all outputs" },
+	{ "randr_incremental_updates_total", "Updates looking at changed outputs only" },
+	{ "x_round_trips_total", "Requests to the X server waited for" },
+	{ "icc_loads_total", "ICC profiles read and parsed" },
+	{ "icc_loads_cached_total", "ICC profiles found unchanged in the cache" },
+	{ "gamma_uploads_total", "Gamma ramps set on a CRTC" },
+	{ "gamma_uploads_skipped_total", "Gamma ramps not set because they already were" },
+	{ "icc_profile_writes_total", "Changes of _ICC_PROFILE" },
+	{ "icc_profile_writes_skipped_total", "Changes of _ICC_PROFILE which changed nothing" },
+	{ "icc_profile_bytes_total", "Bytes written to _ICC_PROFILE" },
+	{ "snapshot_restores_total", "Gamma ramps restored from the last session" },
+	{ "icc_store_validated_total", "Profile store files found unchanged in the index" },
+	{ "icc_store_hashed_total", "Profile store files read to get their checksum" },
+};
+
+static const struct stats_info histogram_info[STATS_N_HISTOGRAMS] = {
+	{ "update_duration_seconds", "Time to handle RandR events" },
+	{ "hotplug_duration_seconds", "Time from a monitor showing up until its gamma is set" },
+	{ "icc_upload_duration_seconds", "Time to upload _ICC_PROFILE" },
+};
+
+struct stats_cache {
+	guint64		hits;
+	guint64		misses;
+};
+
+struct stats_hist {
+	guint64		buckets[N_BUCKETS + 1];	/* the last one for the rest */
+	guint64		count;
+	gint64		sum;			/* microseconds */
+};
+
+static struct {
+	guint64			counters[STATS_N_COUNTERS];
+	struct stats_hist	hist[STATS_N_HISTOGRAMS];
+	GHashTable		*dbus_calls;	/* method -> count */
+	GHashTable		*proxy_caches;	/* name -> struct stats_cache */
+} stats;
+/* profiles are loaded by worker threads too, guards all of the above */
+G_LOCK_DEFINE_STATIC (stats);
+
+void
+stats_add (enum stats_counter counter, guint64 n)
+{
+	G_LOCK (stats);
+	stats.counters[counter] += n;
+	G_UNLOCK (stats);
+}
+
+void
+stats_dbus_call (const gchar *method)
+{
+	gpointer val;
+
+	G_LOCK (stats);
+	if (! stats.dbus_calls)
+		stats.dbus_calls = g_hash_table_new (g_str_hash, g_str_equal);
+
+	/* method names are string literals */
+	val = g_hash_table_lookup (stats.dbus_calls, method);
+	g_hash_table_insert (stats.dbus_calls, (gpointer) method,
+			     GUINT_TO_POINTER (GPOINTER_TO_UINT (val) + 1));
+	G_UNLOCK (stats);
+}
+
+void
+stats_proxy_cache (const gchar *cache, gboolean hit)
+{
+	struct stats_cache *c;
+
+	G_LOCK (stats);
+	if (! stats.proxy_caches)
+		stats.proxy_caches = g_hash_table_new_full (g_str_hash, g_str_equal,
+							    NULL, g_free);
+
+	/* cache names are string literals too */
+	c = g_hash_table_lookup (stats.proxy_caches, cache);
+	if (! c) {
+		c = g_new0 (struct stats_cache, 1);
+		g_hash_table_insert (stats.proxy_caches, (gpointer) cache, c);
+	}
+	if (hit)
+		++c->hits;
+	else
+		++c->misses;
+	G_UNLOCK (stats);
+}
+
+void
+stats_observe (enum stats_histogram hist, gint64 usec)
+{
+	struct stats_hist *h = &stats.hist[hist];
+	guint i;
+
+	for (i = 0; i < N_BUCKETS; ++i) {
+		if (usec <= (gint64) buckets_ms[i] * G_TIME_SPAN_MILLISECOND)
+			break;
+	}
+	G_LOCK (stats);
+	++h->buckets[i];
+	++h->count;
+	h->sum += usec;
+	G_UNLOCK (stats);
+}
+
+/* A metric without labels, under the empty label value */
+static void
+add_counter (GVariantBuilder *b, const gchar *name, guint64 val)
+{
+	g_variant_builder_open (b, G_VARIANT_TYPE ("{sa{st}}"));
+	g_variant_builder_add (b, "s", name);
+	g_variant_builder_open (b, G_VARIANT_TYPE ("a{st}"));
+	g_variant_builder_add (b, "{st}", "", val);
+	g_variant_builder_close (b);
+	g_variant_builder_close (b);
+}
+
+static void
+add_proxy_caches (GVariantBuilder *b, gboolean hits)
+{
+	GHashTableIter it;
+	gpointer key, val;
+
+	g_variant_builder_open (b, G_VARIANT_TYPE ("{sa{st}}"));
+	g_variant_builder_add (b, "s", hits ? "proxy_cache_hits_total"
+					    : "proxy_cache_misses_total");
+	g_variant_builder_open (b, G_VARIANT_TYPE ("a{st}"));
+	if (stats.proxy_caches) {
+		g_hash_table_iter_init (&it, stats.proxy_caches);
+		while (g_hash_table_iter_next (&it, &key, &val)) {
+			const struct stats_cache *c = (const struct stats_cache *) val;
+			g_variant_builder_add (b, "{st}", (const gchar *) key,
+					       hits ? c->hits : c->misses);
+		}
+	}
+	g_variant_builder_close (b);
+	g_variant_builder_close (b);
+}
+
+/* Metric name -> label value -> count, "" for metrics without a label */
+GVariant *
+stats_get_counters (void)
+{
+	GVariantBuilder b;
+	guint ramp_hits, ramp_misses, edid_hits, edid_misses;
+	int c;
+
+	ramp_cache_get_stats (&ramp_hits, &ramp_misses);
+	edid_cache_get_stats (&edid_hits, &edid_misses);
+
+	g_variant_builder_init (&b, G_VARIANT_TYPE ("a{sa{st}}"));
+	G_LOCK (stats);
+	for (c = 0; c < STATS_N_COUNTERS; ++c)
+		add_counter (&b, counter_info[c].name, stats.counters[c]);
+
+	add_counter (&b, "ramp_cache_hits_total", ramp_hits);
+	add_counter (&b, "ramp_cache_misses_total", ramp_misses);
+	add_counter (&b, "edid_cache_hits_total", edid_hits);
+	add_counter (&b, "edid_cache_misses_total", edid_misses);
+
+	/* by method */
+	g_variant_builder_open (&b, G_VARIANT_TYPE ("{sa{st}}"));
+	g_variant_builder_add (&b, "s", "dbus_calls_total");
+	g_variant_builder_open (&b, G_VARIANT_TYPE ("a{st}"));
+	if (stats.dbus_calls) {
+		GHashTableIter it;
+		gpointer key, val;
+		g_hash_table_iter_init (&it, stats.dbus_calls);
+		while (g_hash_table_iter_next (&it, &key, &val))
+			g_variant_builder_add (&b, "{st}", (const gchar *) key,
+					       (guint64) GPOINTER_TO_UINT (val));
+	}
+	g_variant_builder_close (&b);
+	g_variant_builder_close (&b);
+
+	/* by cache */
+	add_proxy_caches (&b, TRUE);
+	add_proxy_caches (&b, FALSE);
+	G_UNLOCK (stats);
+
+	return g_variant_builder_end (&b);
+}
+
+static void
+format_counter (GString *out, const gchar *name, const gchar *help, guint64 val)
+{
+	g_string_append_printf (out, "# HELP xiccd_%s %s\n# TYPE xiccd_%s counter\n"
+				"xiccd_%s %" G_GUINT64_FORMAT "\n", name, help, name, name, val);
+}
+
+static void
+format_histogram (GString *out, const struct stats_info *info, const struct stats_hist *h)
+{
+	guint64 cumulative = 0;
+	guint i;
+
+	g_string_append_printf (out, "# HELP xiccd_%s %s\n# TYPE xiccd_%s histogram\n",
+				info->name, info->help, info->name);
+	for (i = 0; i < N_BUCKETS; ++i) {
+		cumulative += h->buckets[i];
+		g_string_append_printf (out, "xiccd_%s_bucket{le=\"%g\"} %" G_GUINT64_FORMAT "\n",
+					info->name, buckets_ms[i] / 1000.0, cumulative);
+	}
+	g_string_append_printf (out, "xiccd_%s_bucket{le=\"+Inf\"} %" G_GUINT64_FORMAT "\n"
+				"xiccd_%s_sum %g\nxiccd_%s_count %" G_GUINT64_FORMAT "\n",
+				info->name, h->count, info->name, h->sum / 1e6,
+				info->name, h->count);
+}
+
+static void
+format_proxy_caches (GString *out, gboolean hits)
+{
+	const gchar *what = hits ? "hits" : "misses";
+	const gchar *help = hits ? "colord proxies found connected"
+				 : "colord proxies looked up again";
+	GHashTableIter it;
+	gpointer key, val;
+
+	g_string_append_printf (out, "# HELP xiccd_proxy_cache_%s_total %s\n"
+				"# TYPE xiccd_proxy_cache_%s_total counter\n",
+				what, help, what);
+	if (! stats.proxy_caches)
+		return;
+	g_hash_table_iter_init (&it, stats.proxy_caches);
+	while (g_hash_table_iter_next (&it, &key, &val)) {
+		const struct stats_cache *c = (const struct stats_cache *) val;
+		g_string_append_printf (out, "xiccd_proxy_cache_%s_total{cache=\"%s\"} %"
+					G_GUINT64_FORMAT "\n", what, (const gchar *) key,
+					hits ? c->hits : c->misses);
+	}
+}
+
+/* In the Prometheus text format, e.g. for the node exporter */
+gchar *
+stats_format (void)
+{
+	GString *out = g_string_new (NULL);
+	guint ramp_hits, ramp_misses, edid_hits, edid_misses;
+	int c;
+
+	ramp_cache_get_stats (&ramp_hits, &ramp_misses);
+	edid_cache_get_stats (&edid_hits, &edid_misses);
+
+	G_LOCK (stats);
+	for (c = 0; c < STATS_N_COUNTERS; ++c)
+		format_counter (out, counter_info[c].name, counter_info[c].help,
+				stats.counters[c]);
+
+	format_counter (out, "ramp_cache_hits_total", "Gamma ramps found in the cache",
+			ramp_hits);
+	format_counter (out, "ramp_cache_misses_total", "Gamma ramps computed", ramp_misses);
+	format_counter (out, "edid_cache_hits_total", "EDIDs found in the cache", edid_hits);
+	format_counter (out, "edid_cache_misses_total", "EDIDs parsed", edid_misses);
+
+	g_string_append (out, "# HELP xiccd_dbus_calls_total colord methods called\n"
+			      "# TYPE xiccd_dbus_calls_total counter\n");
+	if (stats.dbus_calls) {
+		GHashTableIter it;
+		gpointer key, val;
+		g_hash_table_iter_init (&it, stats.dbus_calls);
+		while (g_hash_table_iter_next (&it, &key, &val))
+			g_string_append_printf (out, "xiccd_dbus_calls_total{method=\"%s\"} %u\n",
+						(const gchar *) key, GPOINTER_TO_UINT (val));
+	}
+
+	format_proxy_caches (out, TRUE);
+	format_proxy_caches (out, FALSE);
+
+	for (c = 0; c < STATS_N_HISTOGRAMS; ++c)
+		format_histogram (out, &histogram_info[c], &stats.hist[c]);
+	G_UNLOCK (stats);
+
+	return g_string_free (out, FALSE);
+}
+
+void
+stats_clear (void)
+{
+	G_LOCK (stats);
+	if (stats.dbus_calls)
+		g_hash_table_unref (stats.dbus_calls);
+	if (stats.proxy_caches)
+		g_hash_table_unref (stats.proxy_caches);
+	memset (&stats, 0, sizeof (stats));
+	G_UNLOCK (stats);
+}
+
+/* vim: set ts=8 sw=8 tw=0 : */
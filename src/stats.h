@@ -0,0 +1,47 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* How much work the daemon has done since it started */
+enum stats_counter {
+	STATS_RANDR_EVENTS,
+	STATS_FULL_UPDATES,
+	STATS_INCREMENTAL_UPDATES,
+	STATS_X_ROUND_TRIPS,
+	STATS_ICC_LOADS,		/* files read and parsed */
+	STATS_ICC_LOADS_CACHED,
+	STATS_GAMMA_UPLOADS,
+	STATS_GAMMA_UPLOADS_SKIPPED,	/* the ramp was there already */
+	STATS_ICC_PROFILE_WRITES,
+	STATS_ICC_PROFILE_WRITES_SKIPPED,
+	STATS_ICC_PROFILE_BYTES,
+	STATS_SNAPSHOT_RESTORES,	/* ramps set before colord answered */
+	STATS_ICC_STORE_VALIDATED,	/* files known unchanged by the index */
+	STATS_ICC_STORE_HASHED,		/* files read to get the checksum */
+	STATS_N_COUNTERS
+};
+
+/* Durations, in fixed buckets from 1 ms to 10 s */
+enum stats_histogram {
+	STATS_UPDATE_TIME,		/* of displays after RandR events */
+	STATS_HOTPLUG_TIME,		/* from the event until gamma is set */
+	STATS_ICC_UPLOAD_TIME,
+	STATS_N_HISTOGRAMS
+};
+
+void stats_add (enum stats_counter counter, guint64 n);
+void stats_dbus_call (const gchar *method);
+void stats_proxy_cache (const gchar *cache, gboolean hit);
+void stats_observe (enum stats_histogram hist, gint64 usec);
+GVariant *stats_get_counters (void);
+gchar *stats_format (void);
+void stats_clear (void);
+
+G_END_DECLS
+
+#endif /* __STATS_H__ */
+
+/* vim: set ts=8 sw=8 tw=0 : */
@@ -0,0 +1,61 @@
+#include "trace.h"
+#include <glib.h>
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
+/* Spans taking longer are logged even if nobody is tracing */
+#define TRACE_SLOW_MS 100
+
+static inline const gchar *
+or_empty (const gchar *str)
+{
+	return str ? str : "";
+}
+
+void
+trace_span_init (struct trace_span *span, const gchar *name,
+		 const gchar *display, const gchar *profile)
+{
+	span->name = name;
+	span->display = display;
+	span->profile = profile;
+	span->start = 0;
+}
+
+void
+trace_span_begin (struct trace_span *span)
+{
+	span->start = g_get_monotonic_time ();
+#ifdef HAVE_SYS_SDT_H
+	DTRACE_PROBE3 (xiccd, span_begin, span->name, or_empty (span->display),
+		       or_empty (span->profile));
+#endif
+}
+
+/* Returns how long it took, in microseconds */
+gint64
+trace_span_end (struct trace_span *span)
+{
+	gint64 usec;
+
+	if (! span->start)
+		return 0;
+
+	usec = g_get_monotonic_time () - span->start;
+	span->start = 0;
+#ifdef HAVE_SYS_SDT_H
+	DTRACE_PROBE4 (xiccd, span_end, span->name, or_empty (span->display),
+		       or_empty (span->profile), usec);
+#endif
+
+	if (usec >= TRACE_SLOW_MS * G_TIME_SPAN_MILLISECOND)
+		g_debug ("%s%s%s%s%s took %.1f ms", span->name,
+			 span->display ? " for display " : "", or_empty (span->display),
+			 span->profile ? " with profile " : "", or_empty (span->profile),
+			 usec / 1000.0);
+
+	return usec;
+}
+
+/* vim: set ts=8 sw=8 tw=0 : */
@@ -0,0 +1,29 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * A stage worth timing. Tracers see it as a pair of xiccd:span_begin and
+ * xiccd:span_end USDT probes with the name, display and profile as
+ * arguments, the latter also getting the duration in microseconds.
+ */
+struct trace_span {
+	const gchar	*name;
+	const gchar	*display;	/* NULL if not about one */
+	const gchar	*profile;	/* ID or checksum, NULL if not about one */
+	gint64		start;		/* 0 unless begun */
+};
+
+void trace_span_init (struct trace_span *span, const gchar *name,
+		      const gchar *display, const gchar *profile);
+void trace_span_begin (struct trace_span *span);
+gint64 trace_span_end (struct trace_span *span);
+
+G_END_DECLS
+
+#endif /* __TRACE_H__ */
+
+/* vim: set ts=8 sw=8 tw=0 : */
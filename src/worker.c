@@ -0,0 +1,58 @@
+#include "worker.h"
+#include <gio/gio.h>
+#include <glib.h>
+
+/* Enough to keep a slow file from blocking the others, no more */
+#define WORKER_MAX_THREADS 4
+
+struct worker_job {
+	GTask		*task;
+	GTaskThreadFunc	func;
+};
+
+static GThreadPool *pool;
+
+static void
+worker_thread (gpointer data, gpointer user_data)
+{
+	struct worker_job *job = (struct worker_job *) data;
+	GTask *task = job->task;
+
+	(void) user_data;
+
+	if (! g_task_return_error_if_cancelled (task))
+		job->func (task, g_task_get_source_object (task),
+			   g_task_get_task_data (task), g_task_get_cancellable (task));
+
+	g_object_unref (task);
+	g_free (job);
+}
+
+void
+worker_run (GTask *task, GTaskThreadFunc func)
+{
+	struct worker_job *job;
+
+	if (! pool) {
+		guint n = CLAMP (g_get_num_processors (), 1, WORKER_MAX_THREADS);
+		/* never fails when not exclusive */
+		pool = g_thread_pool_new (worker_thread, NULL, n, FALSE, NULL);
+	}
+
+	job = g_new (struct worker_job, 1);
+	job->task = g_object_ref (task);
+	job->func = func;
+	g_thread_pool_push (pool, job, NULL);
+}
+
+/* Waits for what is running, what is queued is returned cancelled or run */
+void
+worker_shutdown (void)
+{
+	if (! pool)
+		return;
+	g_thread_pool_free (pool, FALSE, TRUE);
+	pool = NULL;
+}
+
+/* vim: set ts=8 sw=8 tw=0 : */
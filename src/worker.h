@@ -0,0 +1,22 @@
+#ifndef __WORKER_H__
+#define __WORKER_H__
+
+#include <gio/gio.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * A few threads for reading and parsing profiles, so that a slow file
+ * system never stalls the X connection. A task returns to the main context
+ * it was created in, or is returned cancelled without being run if its
+ * cancellable was triggered while it waited.
+ */
+void worker_run (GTask *task, GTaskThreadFunc func);
+void worker_shutdown (void);
+
+G_END_DECLS
+
+#endif /* __WORKER_H__ */
+
+/* vim: set ts=8 sw=8 tw=0 : */
@@ -1,5 +1,16 @@
 #include "icc.h"
+#include "icc-store.h"
+#include "latency.h"
+#include "op-queue.h"
+#include "profile-index.h"
+#include "proxy-cache.h"
+#include "ramp-cache.h"
 #include "randr-conn.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "stats-dbus.h"
+#include "trace.h"
+#include "worker.h"
 #include <colord.h>
 #include <glib.h>
 #include <glib-unix.h>
@@ -7,14 +18,28 @@
 
 typedef struct _Daemon {
 	GMainLoop	*loop;
-	RandrConn	*rcon;
+	GPtrArray	*rcons;		/* one RandrConn per X display */
 	CdClient	*cli;
-	CdIccStore	*stor;
+	struct icc_store store;		/* the user's profiles */
+	struct op_queue	ops;		/* on colord objects, by ID */
+	struct proxy_cache devices;	/* connected CdDevice */
+	struct proxy_cache profiles;	/* connected CdProfile */
+	struct profile_index edid_profiles;
+	guint		stats_owner;	/* of the D-Bus name */
+	gint64		started;	/* monotonic, for the startup phases */
+	gboolean	store_ready;	/* the first scan is over */
+	GPtrArray	*pending_edids;	/* display names waiting for the scan */
+	GHashTable	*cancels;	/* display name -> GCancellable */
+	GHashTable	*edid_made;	/* EDID checksum -> struct edid_profile */
+	GCancellable	*edid_cancel;	/* of writing those */
 } Daemon;
 
 static struct {
-	const gchar	*display;
+	      gchar	**displays;
 	      gboolean	edid;
+	      gint	coalesce;
+	      gint	coalesce_max;
+	      gchar	*stats_file;
 } config;
 
 static void
@@ -28,21 +53,47 @@ static GOptionEntry config_entries[] = {
 	{ "version", 'V', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
 		(void*)(intptr_t) show_version,
 		"Show version", NULL },
-	{ "display", 'd', 0, G_OPTION_ARG_STRING, &config.display,
-		"Uses a specific display", NULL },
+	{ "display", 'd', 0, G_OPTION_ARG_STRING_ARRAY, &config.displays,
+		"Uses a specific display, may be repeated or comma-separated", NULL },
 	{ "edid", 'e', 0, G_OPTION_ARG_NONE, &config.edid,
 		"Generates a default color profile based on the display model", NULL },
+	{ "coalesce", 'c', 0, G_OPTION_ARG_INT, &config.coalesce,
+		"Waits for RandR events to calm down for MS milliseconds", "MS" },
+	{ "coalesce-max", 0, 0, G_OPTION_ARG_INT, &config.coalesce_max,
+		"Delays handling of RandR events by MS milliseconds at most", "MS" },
+	{ "stats-file", 0, 0, G_OPTION_ARG_FILENAME, &config.stats_file,
+		"Writes statistics to FILE instead of standard output on SIGUSR1", "FILE" },
 	{ NULL }
 };
 
 static void
 config_free (void)
 {
-	if (config.display)
-		g_free ((gpointer) config.display);
+	if (config.displays)
+		g_strfreev (config.displays);
 }
 
 
+static guint
+config_num_displays (void)
+{
+	guint num = 0;
+	gchar **d, **n;
+
+	if (! config.displays)
+		return 0;
+
+	for (d = config.displays; *d; ++d) {
+		gchar **names = g_strsplit (*d, ",", -1);
+		for (n = names; *n; ++n) {
+			if (**n)
+				++num;
+		}
+		g_strfreev (names);
+	}
+	return num;
+}
+
 static inline gboolean
 signal_term (gpointer loop)
 {
@@ -50,10 +101,53 @@ signal_term (gpointer loop)
 	return FALSE;
 }
 
+static gboolean
+signal_hup (gpointer user_data)
+{
+	Daemon *daemon = (Daemon *) user_data;
+	guint i;
+	/* someone may have clobbered the gamma behind our back */
+	for (i = 0; i < daemon->rcons->len; ++i)
+		randr_conn_reassert_gamma (g_ptr_array_index (daemon->rcons, i));
+	return TRUE;
+}
+
+static gboolean
+signal_usr1 (gpointer user_data)
+{
+	GError *err = NULL;
+	gchar *text = stats_format ();
+	(void) user_data;
+
+	latency_report ();
+	if (! config.stats_file) {
+		g_print ("%s", text);
+	} else if (! g_file_set_contents (config.stats_file, text, -1, &err)) {
+		/* atomically, so that a scraper never reads half of it */
+		g_critical ("unable to write statistics: %s", err->message);
+		g_error_free (err);
+	}
+	g_free (text);
+	return TRUE;
+}
+
+static struct randr_display *
+find_display_by_name (Daemon *daemon, const gchar *name)
+{
+	guint i;
+	for (i = 0; i < daemon->rcons->len; ++i) {
+		struct randr_display *disp =
+			randr_conn_find_display_by_name (g_ptr_array_index (daemon->rcons, i), name);
+		if (disp)
+			return disp;
+	}
+	return NULL;
+}
+
 static gchar *
-profile_id (CdIcc *icc)
+profile_id (const gchar *checksum)
 {
-	return g_strdup_printf ("icc-%s", cd_icc_get_checksum (icc));
+	return g_strdup_printf ("icc-%s", checksum);
 }
 
 static gchar *
@@ -63,86 +157,662 @@ profile_filename (CdEdid *edid)
 	return g_strdup_printf ("edid-%s.icc", cksum);
 }
 
+/*
+ * Everything done to a colord device or profile goes through a queue of
+ * operations for its ID, so that e.g. a device is never removed before it
+ * has been created, without waiting for colord on the main loop.
+ */
+struct cd_op {
+	struct op	op;
+	Daemon		*daemon;
+	gchar		*id;
+	GHashTable	*props;		/* of the device or profile to create */
+	CdDevice	*device;
+	CdProfile	*profile;
+	void		(*with_device) (struct cd_op *cop);
+};
+
+static void
+cd_op_free (struct op *op)
+{
+	struct cd_op *cop = (struct cd_op *) op;
+
+	g_free (cop->id);
+	if (cop->props)
+		g_hash_table_unref (cop->props);
+	if (cop->device)
+		g_object_unref (cop->device);
+	if (cop->profile)
+		g_object_unref (cop->profile);
+	g_free (cop);
+}
+
+static struct cd_op *
+cd_op_new (const struct op_class *klass, Daemon *daemon, const gchar *id)
+{
+	struct cd_op *cop = g_new0 (struct cd_op, 1);
+
+	op_init (&cop->op, klass);
+	cop->daemon = daemon;
+	cop->id = g_strdup (id);
+
+	return cop;
+}
+
+/* For a device, whose ID is the display name */
+static struct cd_op *
+cd_device_op_new (const struct op_class *klass, Daemon *daemon, const gchar *id)
+{
+	struct cd_op *cop = cd_op_new (klass, daemon, id);
+	cop->op.span.display = cop->id;
+	return cop;
+}
+
+static struct cd_op *
+cd_profile_op_new (const struct op_class *klass, Daemon *daemon, const gchar *id)
+{
+	struct cd_op *cop = cd_op_new (klass, daemon, id);
+	cop->op.span.profile = cop->id;
+	return cop;
+}
+
+/* Proxies are set up with a GetAll call, unless they have been already */
+static inline void
+count_connect (gboolean connected)
+{
+	if (! connected)
+		stats_dbus_call ("GetAll");
+}
+
+static inline void
+cd_op_push (struct cd_op *cop)
+{
+	op_queue_push (&cop->daemon->ops, cop->id, &cop->op);
+}
+
+static inline void
+cd_op_done (struct cd_op *cop)
+{
+	op_done (&cop->op);
+}
+
+static void
+cd_op_device_connected_cb (GObject *src, GAsyncResult *res, gpointer user_data)
+{
+	struct cd_op *cop = (struct cd_op *) user_data;
+	GError *err = NULL;
+
+	if (! cd_device_connect_finish (CD_DEVICE (src), res, &err)) {
+		g_critical ("unable to connect to device %s: %s", cop->id, err->message);
+		g_error_free (err);
+		cd_op_done (cop);
+		return;
+	}
+
+	proxy_cache_add (&cop->daemon->devices, cop->id,
+			 cd_device_get_object_path (cop->device), cop->device);
+	cop->with_device (cop);
+}
+
+static void
+cd_op_device_found_cb (GObject *src, GAsyncResult *res, gpointer user_data)
+{
+	struct cd_op *cop = (struct cd_op *) user_data;
+	GError *err = NULL;
+
+	cop->device = cd_client_find_device_finish (CD_CLIENT (src), res, &err);
+	if (! cop->device) {
+		g_debug ("device %s not found: %s", cop->id, err->message);
+		g_error_free (err);
+		cd_op_done (cop);
+		return;
+	}
+
+	count_connect (cd_device_get_connected (cop->device));
+	cd_device_connect (cop->device, cop->op.cancel, cd_op_device_connected_cb, cop);
+}
+
+/* Calls fn with the device found and connected, or finishes the operation */
+static void
+cd_op_with_device (struct cd_op *cop, void (*fn) (struct cd_op *cop))
+{
+	cop->with_device = fn;
+	if (! cop->device) {
+		CdDevice *device = proxy_cache_lookup (&cop->daemon->devices, cop->id);
+		if (device)
+			cop->device = g_object_ref (device);
+	}
+	/* completes without D-Bus traffic if connected already */
+	if (cop->device) {
+		count_connect (cd_device_get_connected (cop->device));
+		cd_device_connect (cop->device, cop->op.cancel,
+				   cd_op_device_connected_cb, cop);
+	} else {
+		stats_dbus_call ("FindDeviceById");
+		cd_client_find_device (cop->daemon->cli, cop->id, cop->op.cancel,
+				       cd_op_device_found_cb, cop);
+	}
+}
+
+static gboolean
+cd_op_always_equal (const struct op *a, const struct op *b)
+{
+	(void) a;
+	(void) b;
+	return TRUE;
+}
+
+static void
+create_device_cb (GObject *src, GAsyncResult *res, gpointer user_data)
+{
+	struct cd_op *cop = (struct cd_op *) user_data;
+	GError *err = NULL;
+	CdDevice *dev;
+
+	dev = cd_client_create_device_finish (CD_CLIENT (src), res, &err);
+	if (! dev) {
+		if (! g_error_matches (err, CD_CLIENT_ERROR, CD_CLIENT_ERROR_ALREADY_EXISTS))
+			g_critical ("failed to create colord device: %s", err->message);
+		g_error_free (err);
+	} else {
+		proxy_cache_add (&cop->daemon->devices, cop->id,
+				 cd_device_get_object_path (dev), dev);
+		g_object_unref (dev);
+		latency_mark (cop->id, LATENCY_DEVICE_CREATED);
+	}
+
+	cd_op_done (cop);
+}
+
+static void
+create_device_run (struct op *op)
+{
+	struct cd_op *cop = (struct cd_op *) op;
+	stats_dbus_call ("CreateDevice");
+	cd_client_create_device (cop->daemon->cli, cop->id, CD_OBJECT_SCOPE_TEMP,
+				 cop->props, op->cancel, create_device_cb, cop);
+}
+
+static const struct op_class create_device_op = {
+	"creating device", create_device_run, cd_op_free, NULL, FALSE
+};
+
+static void
+remove_device_cb (GObject *src, GAsyncResult *res, gpointer user_data)
+{
+	struct cd_op *cop = (struct cd_op *) user_data;
+	GError *err = NULL;
+
+	if (! cd_client_delete_device_finish (CD_CLIENT (src), res, &err)) {
+		g_critical ("device not removed: %s", err->message);
+		g_error_free (err);
+	}
+	proxy_cache_remove (&cop->daemon->devices, cop->id);
+
+	cd_op_done (cop);
+}
+
+static void
+remove_device_found_cb (GObject *src, GAsyncResult *res, gpointer user_data)
+{
+	struct cd_op *cop = (struct cd_op *) user_data;
+	GError *err = NULL;
+
+	cop->device = cd_client_find_device_finish (CD_CLIENT (src), res, &err);
+	if (! cop->device) {
+		g_debug ("device %s not found so not removed: %s", cop->id, err->message);
+		g_error_free (err);
+		cd_op_done (cop);
+		return;
+	}
+
+	stats_dbus_call ("DeleteDevice");
+	cd_client_delete_device (cop->daemon->cli, cop->device, cop->op.cancel,
+				 remove_device_cb, cop);
+}
+
+static void
+remove_device_run (struct op *op)
+{
+	struct cd_op *cop = (struct cd_op *) op;
+	CdDevice *device = proxy_cache_lookup (&cop->daemon->devices, cop->id);
+
+	if (device) {
+		cop->device = g_object_ref (device);
+		stats_dbus_call ("DeleteDevice");
+		cd_client_delete_device (cop->daemon->cli, cop->device, op->cancel,
+					 remove_device_cb, cop);
+		return;
+	}
+
+	stats_dbus_call ("FindDeviceById");
+	cd_client_find_device (cop->daemon->cli, cop->id, op->cancel,
+			       remove_device_found_cb, cop);
+}
+
+/* whatever was still to be done to the device does not matter any more */
+static const struct op_class remove_device_op = {
+	"removing device", remove_device_run, cd_op_free, NULL, TRUE
+};
+
+/* for the next start, see restore_ramp() */
+static void
+remember_ramp (struct randr_display *disp, const gchar *profile)
+{
+	struct gamma_ramp *ramp = randr_display_get_ramp (disp);
+	const gchar *edid = cd_edid_get_checksum (disp->edid);
+
+	if (! ramp)
+		return;
+	if (edid && profile)
+		snapshot_record (edid, profile, ramp);
+	gamma_ramp_unref (ramp);
+}
+
+/* What the monitor had last time, until colord says otherwise */
+static void
+restore_ramp (struct randr_display *disp)
+{
+	const gchar *edid = cd_edid_get_checksum (disp->edid);
+	const gchar *profile;
+	struct gamma_ramp *ramp = NULL;
+	int size;
+
+	if (! edid)
+		return;
+	size = randr_display_get_gamma_size (disp);
+	if (size <= 0)
+		return;
+	profile = snapshot_lookup (edid, size, &ramp);
+	if (! profile)
+		return;
+
+	g_debug ("restoring gamma of display %s for profile %s", disp->name, profile);
+	randr_display_apply_ramp (disp, ramp);
+	stats_add (STATS_SNAPSHOT_RESTORES, 1);
+	gamma_ramp_unref (ramp);
+}
+
+/* Cancelled when the display goes, for what worker threads do for it */
+static GCancellable *
+display_cancellable (Daemon *daemon, const gchar *name)
+{
+	GCancellable *cancel = g_hash_table_lookup (daemon->cancels, name);
+
+	if (! cancel) {
+		cancel = g_cancellable_new ();
+		g_hash_table_insert (daemon->cancels, g_strdup (name), cancel);
+	}
+	return cancel;
+}
+
+static void
+cancel_display_work (Daemon *daemon, const gchar *name)
+{
+	GCancellable *cancel = g_hash_table_lookup (daemon->cancels, name);
+
+	if (cancel) {
+		g_cancellable_cancel (cancel);
+		g_hash_table_remove (daemon->cancels, name);
+	}
+}
+
+static void
+cancel_all (gpointer key, GCancellable *cancel, gpointer user_data)
+{
+	(void) key;
+	(void) user_data;
+	g_cancellable_cancel (cancel);
+}
+
+/* A profile loaded for a display by a worker thread */
+struct profile_job {
+	gchar			*filename;
+	gchar			*profile;	/* ID */
+	gchar			*display;
+	int			gamma_size;	/* 0 if the ramp is left to apply */
+	struct icc_data		*icc;		/* NULL until loaded */
+	struct gamma_ramp	*ramp;		/* NULL until made */
+};
+
+static void
+profile_job_free (gpointer user_data)
+{
+	struct profile_job *job = (struct profile_job *) user_data;
+
+	if (job->ramp)
+		gamma_ramp_unref (job->ramp);
+	if (job->icc)
+		icc_data_unref (job->icc);
+	g_free (job->filename);
+	g_free (job->profile);
+	g_free (job->display);
+	g_free (job);
+}
+
+static void
+load_profile_thread (GTask *task, gpointer src, gpointer task_data, GCancellable *cancel)
+{
+	struct profile_job *job = (struct profile_job *) task_data;
+	struct trace_span span;
+	GError *err = NULL;
+
+	(void) src;
+
+	/* read once, only the parts needed for gamma are ever parsed */
+	trace_span_init (&span, "loading profile", job->display, job->profile);
+	trace_span_begin (&span);
+	job->icc = icc_data_load (job->filename, &err);
+	trace_span_end (&span);
+	if (! job->icc) {
+		g_task_return_error (task, err);
+		return;
+	}
+
+	/* only uploading it is left to the main loop */
+	if (job->gamma_size > 0 && ! g_cancellable_is_cancelled (cancel))
+		job->ramp = icc_make_ramp (job->icc, job->gamma_size);
+
+	g_task_return_boolean (task, TRUE);
+}
+
+static void
+load_profile_done (GObject *src, GAsyncResult *res, gpointer user_data)
+{
+	struct cd_op *cop = (struct cd_op *) user_data;
+	struct profile_job *job = g_task_get_task_data (G_TASK (res));
+	struct randr_display *disp;
+	GError *err = NULL;
+
+	(void) src;
+
+	if (! g_task_propagate_boolean (G_TASK (res), &err)
+	    && g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_error_free (err);
+		g_debug ("display %s is gone", cop->id);
+		goto out;
+	}
+
+	disp = find_display_by_name (cop->daemon, cop->id);
+	if (! disp) {
+		g_clear_error (&err);
+		g_debug ("display %s is gone", cop->id);
+		goto out;
+	}
+
+	if (err) {
+		g_critical ("can't get profile for display %s: %s", disp->name,
+								    err->message);
+		g_clear_error (&err);
+	} else {
+		latency_mark (disp->name, LATENCY_PROFILE_LOADED);
+	}
+	g_debug ("loading profile '%s' for display %s",
+		 job->icc ? job->filename : "(none)", disp->name);
+	randr_display_apply_icc (disp, job->icc, job->ramp);
+	if (job->icc)
+		remember_ramp (disp, job->icc->checksum);
+	else
+		snapshot_forget (cd_edid_get_checksum (disp->edid));
+
+out:
+	cd_op_done (cop);
+}
+
+static void
+load_profile (struct cd_op *cop, struct randr_display *disp, const gchar *filename)
+{
+	struct profile_job *job = g_new0 (struct profile_job, 1);
+	GTask *task = g_task_new (NULL, display_cancellable (cop->daemon, disp->name),
+				  load_profile_done, cop);
+
+	job->filename = g_strdup (filename);
+	job->profile = g_strdup (cd_profile_get_id (cop->profile));
+	job->display = g_strdup (disp->name);
+	/* the X connection is not for worker threads */
+	job->gamma_size = randr_display_get_gamma_size (disp);
+
+	g_task_set_task_data (task, job, profile_job_free);
+	worker_run (task, load_profile_thread);
+	g_object_unref (task);
+}
+
+static void
+apply_profile_cb (GObject *src, GAsyncResult *res, gpointer user_data)
+{
+	struct cd_op *cop = (struct cd_op *) user_data;
+	struct randr_display *disp;
+	GError *err = NULL;
+	const gchar *filename;
+
+	if (! cd_profile_connect_finish (CD_PROFILE (src), res, &err)) {
+		g_critical ("unable to connect to profile: %s", err->message);
+		g_error_free (err);
+		goto out;
+	}
+	proxy_cache_add (&cop->daemon->profiles, cd_profile_get_id (cop->profile),
+			 cd_profile_get_object_path (cop->profile), cop->profile);
+	/* unknown until connected */
+	cop->op.span.profile = cd_profile_get_id (cop->profile);
+
+	/* the display may have gone while we were waiting for colord */
+	disp = find_display_by_name (cop->daemon, cop->id);
+	if (! disp) {
+		g_debug ("display %s is gone", cop->id);
+		goto out;
+	}
+
+	filename = cd_profile_get_filename (cop->profile);
+	if (filename) {
+		/* finished by load_profile_done () */
+		load_profile (cop, disp, filename);
+		return;
+	}
+
+	g_critical ("profile %s of display %s has no file",
+		    cd_profile_get_id (cop->profile), disp->name);
+	g_debug ("loading profile '(none)' for display %s", disp->name);
+	randr_display_apply_icc (disp, NULL, NULL);
+	snapshot_forget (cd_edid_get_checksum (disp->edid));
+
+out:
+	cd_op_done (cop);
+}
+
+static void
+update_device_with_device (struct cd_op *cop)
+{
+	struct randr_display *disp;
+
+	if (cd_device_get_kind (cop->device) != CD_DEVICE_KIND_DISPLAY) {
+		g_debug ("ignoring device %s: not a display", cop->id);
+		cd_op_done (cop);
+		return;
+	}
+
+	disp = find_display_by_name (cop->daemon, cop->id);
+	if (! disp) {
+		g_debug ("device '%s' is not one of our displays", cop->id);
+		cd_op_done (cop);
+		return;
+	}
+
+	cop->profile = cd_device_get_default_profile (cop->device);
+	if (! cop->profile) {
+		g_debug ("unloading profile for display %s", disp->name);
+		randr_display_apply_icc (disp, NULL, NULL);
+		snapshot_forget (cd_edid_get_checksum (disp->edid));
+		cd_op_done (cop);
+		return;
+	} else {
+		/* a fresh proxy each time, maybe we have a connected one */
+		CdProfile *cached = proxy_cache_lookup_path (&cop->daemon->profiles,
+					cd_profile_get_object_path (cop->profile));
+		if (cached) {
+			g_object_unref (cop->profile);
+			cop->profile = g_object_ref (cached);
+		}
+	}
+
+	count_connect (cd_profile_get_connected (cop->profile));
+	cd_profile_connect (cop->profile, cop->op.cancel, apply_profile_cb, cop);
+}
+
+static void
+update_device_run (struct op *op)
+{
+	cd_op_with_device ((struct cd_op *) op, update_device_with_device);
+}
+
+/* a queued update will look at the device as it is by then anyway */
+static const struct op_class update_device_op = {
+	"updating device", update_device_run, cd_op_free, cd_op_always_equal, FALSE
+};
+
+static void
+add_profile_cb (GObject *src, GAsyncResult *res, gpointer user_data)
+{
+	struct cd_op *cop = (struct cd_op *) user_data;
+	GError *err = NULL;
+
+	if (! cd_device_add_profile_finish (CD_DEVICE (src), res, &err)) {
+		if (! g_error_matches (err, CD_DEVICE_ERROR, CD_DEVICE_ERROR_PROFILE_ALREADY_ADDED))
+			g_critical ("unable to add device profile: %s", err->message);
+		g_error_free (err);
+	}
+
+	cd_op_done (cop);
+}
+
+static void
+add_profile_with_device (struct cd_op *cop)
+{
+	stats_dbus_call ("AddProfile");
+	cd_device_add_profile (cop->device, CD_DEVICE_RELATION_SOFT, cop->profile,
+			       cop->op.cancel, add_profile_cb, cop);
+}
+
+static void
+add_profile_run (struct op *op)
+{
+	cd_op_with_device ((struct cd_op *) op, add_profile_with_device);
+}
+
+static gboolean
+add_profile_equal (const struct op *a, const struct op *b)
+{
+	return ! g_strcmp0 (cd_profile_get_object_path (((const struct cd_op *) a)->profile),
+			    cd_profile_get_object_path (((const struct cd_op *) b)->profile));
+}
+
+static const struct op_class add_profile_op = {
+	"adding profile to device", add_profile_run, cd_op_free, add_profile_equal, FALSE
+};
+
+static void
+create_profile_cb (GObject *src, GAsyncResult *res, gpointer user_data)
+{
+	struct cd_op *cop = (struct cd_op *) user_data;
+	GError *err = NULL;
+	CdProfile *profile;
+
+	profile = cd_client_create_profile_finish (CD_CLIENT (src), res, &err);
+	if (! profile) {
+		if (! g_error_matches (err, CD_CLIENT_ERROR, CD_CLIENT_ERROR_ALREADY_EXISTS))
+			g_critical ("unable to create profile: %s", err->message);
+		g_error_free (err);
+	} else {
+		proxy_cache_add (&cop->daemon->profiles, cop->id,
+				 cd_profile_get_object_path (profile), profile);
+		g_object_unref (profile);
+	}
+
+	cd_op_done (cop);
+}
+
+static void
+create_profile_run (struct op *op)
+{
+	struct cd_op *cop = (struct cd_op *) op;
+	stats_dbus_call ("CreateProfile");
+	cd_client_create_profile (cop->daemon->cli, cop->id, CD_OBJECT_SCOPE_TEMP,
+				  cop->props, op->cancel, create_profile_cb, cop);
+}
+
+static const struct op_class create_profile_op = {
+	"creating profile", create_profile_run, cd_op_free, NULL, FALSE
+};
+
 static void
-update_device_cb (GObject *src, GAsyncResult *res, gpointer user_data)
+remove_profile_cb (GObject *src, GAsyncResult *res, gpointer user_data)
 {
-	CdDevice *device = CD_DEVICE (src);
-	Daemon *daemon = (Daemon *) user_data;
+	struct cd_op *cop = (struct cd_op *) user_data;
 	GError *err = NULL;
-	const gchar *xrandr_id;
-	struct randr_display *disp;
-	CdProfile *profile = NULL;
-	gboolean ret;
 
-	ret = cd_device_connect_finish (device, res, &err);
-	if (! ret) {
-		g_critical ("unable to connect to device: %s", err->message);
+	if (! cd_client_delete_profile_finish (CD_CLIENT (src), res, &err)) {
+		g_critical ("unable to remove profile: %s", err->message);
 		g_error_free (err);
-		goto out;
 	}
+	proxy_cache_remove (&cop->daemon->profiles, cop->id);
+	profile_index_remove (&cop->daemon->edid_profiles,
+			      cd_profile_get_object_path (cop->profile));
 
-	if (cd_device_get_kind (device) != CD_DEVICE_KIND_DISPLAY) {
-		g_debug ("ignoring device %s: not a display\n", cd_device_get_id (device));
-		goto out;
-        }
+	cd_op_done (cop);
+}
 
-	xrandr_id = cd_device_get_id (device);
-	disp = randr_conn_find_display_by_name (daemon->rcon, xrandr_id);
-	if (! disp) {
-		g_critical ("device '%s' does not exist", xrandr_id);
-		goto out;
+static void
+remove_profile_found_cb (GObject *src, GAsyncResult *res, gpointer user_data)
+{
+	struct cd_op *cop = (struct cd_op *) user_data;
+	GError *err = NULL;
+
+	cop->profile = cd_client_find_profile_finish (CD_CLIENT (src), res, &err);
+	if (! cop->profile) {
+		g_debug ("profile not found so not removed: %s: %s", cop->id, err->message);
+		g_error_free (err);
+		cd_op_done (cop);
+		return;
 	}
 
-	profile = cd_device_get_default_profile (device);
+	stats_dbus_call ("DeleteProfile");
+	cd_client_delete_profile (cop->daemon->cli, cop->profile, cop->op.cancel,
+				  remove_profile_cb, cop);
+}
+
+static void
+remove_profile_run (struct op *op)
+{
+	struct cd_op *cop = (struct cd_op *) op;
+	CdProfile *profile = proxy_cache_lookup (&cop->daemon->profiles, cop->id);
 
 	if (profile) {
-		/* Use sync mode. We do not want race conditions here. */
-		ret = cd_profile_connect_sync (profile, NULL, &err);
-		if (! ret) {
-			g_critical ("unable to connect to profile: %s", err->message);
-			g_error_free (err);
-		} else {
-			CdIcc *icc = cd_profile_load_icc (profile, CD_ICC_LOAD_FLAGS_ALL,
-							  NULL, &err);
-			if (! icc) {
-				g_critical ("can't get profile for display %s: %s", disp->name,
-										    err->message);
-				g_clear_error (&err);
-			}
-			g_debug ("loading profile '%s' for display %s",
-				 icc ? cd_icc_get_filename (icc) : "(none)", disp->name);
-			randr_display_apply_icc (disp, icc);
-			if (icc)
-				g_object_unref (icc);
-		}
-	} else {
-		g_debug ("unloading profile for display %s", disp->name);
-		randr_display_apply_icc (disp, NULL);
+		cop->profile = g_object_ref (profile);
+		stats_dbus_call ("DeleteProfile");
+		cd_client_delete_profile (cop->daemon->cli, cop->profile, op->cancel,
+					  remove_profile_cb, cop);
+		return;
 	}
 
-out:
-
-	if (profile)
-		g_object_unref (profile);
+	stats_dbus_call ("FindProfileById");
+	cd_client_find_profile (cop->daemon->cli, cop->id, op->cancel,
+				remove_profile_found_cb, cop);
 }
 
+static const struct op_class remove_profile_op = {
+	"removing profile", remove_profile_run, cd_op_free, NULL, TRUE
+};
+
 static void
-cd_device_add_profile_cb (GObject *src, GAsyncResult *res, gpointer user_data)
+add_profile_to_display (Daemon *daemon, CdProfile *profile, struct randr_display *disp)
 {
-	CdDevice *device = CD_DEVICE (src);
-	GError *err = NULL;
-	gboolean ret;
-	(void) user_data;
+	struct cd_op *cop;
 
-	ret = cd_device_add_profile_finish (device, res, &err);
-	if (! ret) {
-		if (! g_error_matches (err, CD_DEVICE_ERROR, CD_DEVICE_ERROR_PROFILE_ALREADY_ADDED))
-			g_critical ("unable to add device profile: %s", err->message);
-		g_error_free (err);
-		return;
-	}
+	g_debug ("profile %s matches display %s", cd_profile_get_id (profile), disp->name);
 
-	g_object_unref (device);
+	cop = cd_device_op_new (&add_profile_op, daemon, disp->name);
+	cop->profile = g_object_ref (profile);
+	cop->op.span.profile = cd_profile_get_id (cop->profile);
+	cd_op_push (cop);
 }
 
 static void
@@ -152,61 +822,86 @@ update_profile_cb (GObject *src, GAsyncResult *res, gpointer user_data)
 	Daemon *daemon = (Daemon *) user_data;
 	GError *err = NULL;
 	const gchar *edid_md5;
-	struct randr_display *disp;
-	CdDevice *device = NULL;
 	gboolean ret;
+	guint i;
 
 	ret = cd_profile_connect_finish (profile, res, &err);
 	if (! ret) {
 		g_critical ("unable to connect to profile: %s", err->message);
 		g_error_free (err);
-		goto out;
+		return;
 	}
+	proxy_cache_add (&daemon->profiles, cd_profile_get_id (profile),
+			 cd_profile_get_object_path (profile), profile);
 
 	edid_md5 = cd_profile_get_metadata_item (profile, CD_PROFILE_METADATA_EDID_MD5);
 	if (! edid_md5)
-		goto out;
-
-	disp = randr_conn_find_display_by_edid (daemon->rcon, edid_md5);
-	if (! disp)
-		goto out;
+		return;
 
-	g_debug ("profile %s matches display %s", cd_profile_get_id (profile), disp->name);
+	/* for displays still to come */
+	profile_index_add (&daemon->edid_profiles, edid_md5, profile);
 
-	/* Use sync mode. We do not want race conditions here. */
-	device = cd_client_find_device_sync (daemon->cli, disp->name, NULL, &err);
-	if (! device) {
-		g_critical ("unable to find device %s: %s", disp->name, err->message);
-		g_error_free (err);
-		goto out;
+	/* the same monitor model may be attached to several X displays */
+	for (i = 0; i < daemon->rcons->len; ++i) {
+		struct randr_display *disp =
+			randr_conn_find_display_by_edid (g_ptr_array_index (daemon->rcons, i),
+							 edid_md5);
+		if (disp)
+			add_profile_to_display (daemon, profile, disp);
 	}
+}
 
-	ret = cd_device_connect_sync (device, NULL, &err);
-	if (! ret) {
+static void
+queue_device_update (Daemon *daemon, CdDevice *device)
+{
+	struct cd_op *cop = cd_device_op_new (&update_device_op, daemon, cd_device_get_id (device));
+	cop->device = g_object_ref (device);
+	cd_op_push (cop);
+}
+
+static void
+update_device_cb (GObject *src, GAsyncResult *res, gpointer user_data)
+{
+	CdDevice *device = CD_DEVICE (src);
+	Daemon *daemon = (Daemon *) user_data;
+	GError *err = NULL;
+
+	if (! cd_device_connect_finish (device, res, &err)) {
 		g_critical ("unable to connect to device: %s", err->message);
 		g_error_free (err);
-		goto out;
+		return;
 	}
 
-	g_object_ref (device);
-	cd_device_add_profile (device, CD_DEVICE_RELATION_SOFT, profile, NULL,
-			       cd_device_add_profile_cb, daemon);
-
-out:
+	if (cd_device_get_kind (device) != CD_DEVICE_KIND_DISPLAY) {
+		g_debug ("ignoring device %s: not a display", cd_device_get_id (device));
+		return;
+	}
+	proxy_cache_add (&daemon->devices, cd_device_get_id (device),
+			 cd_device_get_object_path (device), device);
 
-	if (device)
-		g_object_unref (device);
+	queue_device_update (daemon, device);
 }
 
 static void
 update_device (CdDevice *device, Daemon *daemon)
 {
+	/* our connected proxy follows the changes of the device by itself */
+	CdDevice *cached = proxy_cache_lookup_path (&daemon->devices,
+						    cd_device_get_object_path (device));
+	if (cached) {
+		queue_device_update (daemon, cached);
+		return;
+	}
+
+	/* the ID is only known once connected */
+	count_connect (cd_device_get_connected (device));
 	cd_device_connect (device, NULL, update_device_cb, daemon);
 }
 
 static void
 update_profile (CdProfile *profile, Daemon *daemon)
 {
+	count_connect (cd_profile_get_connected (profile));
 	cd_profile_connect (profile, NULL, update_profile_cb, daemon);
 }
 
@@ -232,177 +927,268 @@ cd_device_changed_sig (CdClient *client, CdDevice *device, Daemon *daemon)
 }
 
 static void
-cd_create_device_cb (GObject *src, GAsyncResult *res, gpointer user_data)
+cd_device_removed_sig (CdClient *client, CdDevice *device, Daemon *daemon)
 {
-	Daemon *daemon = (Daemon *) user_data;
+	g_assert (client == daemon->cli);
+	proxy_cache_remove_path (&daemon->devices, cd_device_get_object_path (device));
+}
+
+static void
+cd_profile_removed_sig (CdClient *client, CdProfile *profile, Daemon *daemon)
+{
+	g_assert (client == daemon->cli);
+	proxy_cache_remove_path (&daemon->profiles, cd_profile_get_object_path (profile));
+	profile_index_remove (&daemon->edid_profiles, cd_profile_get_object_path (profile));
+}
+
+/* A default profile written for a monitor by a worker thread */
+struct edid_job {
+	Daemon		*daemon;
+	CdEdid		*edid;
+	gchar		*filepath;
+};
+
+/* What became of the default profile of an EDID */
+enum edid_profile_state {
+	EDID_PROFILE_WRITING,
+	EDID_PROFILE_EXISTS,
+	EDID_PROFILE_FAILED,		/* the EDID is of no use, never retried */
+};
+
+struct edid_profile {
+	enum edid_profile_state	state;
+	gchar			*filepath;
+};
+
+static void
+edid_profile_free (gpointer user_data)
+{
+	struct edid_profile *ep = (struct edid_profile *) user_data;
+	g_free (ep->filepath);
+	g_free (ep);
+}
+
+static void
+edid_job_free (gpointer user_data)
+{
+	struct edid_job *job = (struct edid_job *) user_data;
+	g_object_unref (job->edid);
+	g_free (job->filepath);
+	g_free (job);
+}
+
+static void
+create_profile_thread (GTask *task, gpointer src, gpointer task_data, GCancellable *cancel)
+{
+	struct edid_job *job = (struct edid_job *) task_data;
+	const gchar *cksum = cd_edid_get_checksum (job->edid);
+	CdIcc *icc;
 	GError *err = NULL;
-	CdDevice *dev;
+	gboolean ret;
 
-	g_assert (CD_CLIENT (src) == daemon->cli);
+	(void) src;
+	(void) cancel;
 
-	dev = cd_client_create_device_finish (daemon->cli, res, &err);
-	if (! dev) {
-		if (err->domain != CD_CLIENT_ERROR || err->code != CD_CLIENT_ERROR_ALREADY_EXISTS)
-			g_critical ("failed to create colord device: %s", err->message);
-		g_error_free (err);
+	icc = icc_from_edid (job->edid);
+	if (! icc) {
+		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+					 "profile for EDID %s was not created", cksum);
 		return;
 	}
 
-	g_object_unref (dev);
+	g_debug ("WRITING profile for EDID %s", cksum);
+
+	/* the store notices the new file by itself */
+	ret = icc_save_atomically (icc, job->filepath, &err);
+	g_object_unref (icc);
+	if (! ret) {
+		g_task_return_error (task, err);
+		return;
+	}
+
+	g_task_return_boolean (task, TRUE);
 }
 
 static void
-create_profile_from_edid(CdIccStore *store, CdEdid *edid)
+create_profile_done (GObject *src, GAsyncResult *res, gpointer user_data)
 {
-	gchar *filename;
-	gchar *filepath;
-	GFile *file;
-	CdIcc *icc = NULL;
+	struct edid_job *job = g_task_get_task_data (G_TASK (res));
+	const gchar *cksum = cd_edid_get_checksum (job->edid);
+	struct edid_profile *ep;
 	GError *err = NULL;
-	gboolean ret;
-	const gchar *cksum = cd_edid_get_checksum (edid);
 
-	filename = profile_filename (edid);
-	filepath = g_build_filename (g_get_user_data_dir (), "icc", filename, NULL);
-	g_free (filename);
-	file = g_file_new_for_path (filepath);
-	g_free (filepath);
+	(void) src;
+	(void) user_data;
 
-	icc = cd_icc_store_find_by_filename (store, g_file_get_path (file));
-	if (icc) {
-		g_debug ("profile for edid %s already exists", cksum);
-		goto out;
+	ep = g_hash_table_lookup (job->daemon->edid_made, cksum);
+	g_assert (ep && ep->state == EDID_PROFILE_WRITING);
+
+	if (g_task_propagate_boolean (G_TASK (res), &err)) {
+		ep->state = EDID_PROFILE_EXISTS;
+		return;
 	}
 
-	icc = icc_from_edid (edid);
-	if (! icc) {
-		g_critical ("profile for EDID %s was not created", cksum);
-		goto out;
+	if (g_error_matches (err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA)) {
+		ep->state = EDID_PROFILE_FAILED;
+	} else {
+		/* maybe the disk was full, the next hotplug tries again */
+		g_hash_table_remove (job->daemon->edid_made, cksum);
 	}
+	if (! g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+		g_critical ("%s", err->message);
+	g_error_free (err);
+}
 
-	g_debug ("WRITING profile for EDID %s", cksum);
+/* Once per EDID at a time, and never again once there is one */
+static void
+create_profile_from_edid (Daemon *daemon, struct randr_display *disp)
+{
+	const gchar *cksum = cd_edid_get_checksum (disp->edid);
+	struct edid_profile *ep;
+	struct edid_job *job;
+	gchar *filename;
+	GTask *task;
 
-	ret = cd_icc_save_file (icc, file, CD_ICC_SAVE_FLAGS_NONE, NULL, &err);
-	if (! ret) {
-		g_critical ("unable to write file %s: %s", g_file_get_path (file), err->message);
-		g_error_free (err);
-		goto out;
+	if (! cksum || g_hash_table_contains (daemon->edid_made, cksum))
+		return;
+
+	ep = g_new (struct edid_profile, 1);
+	filename = profile_filename (disp->edid);
+	ep->filepath = g_build_filename (g_get_user_data_dir (), "icc", filename, NULL);
+	g_free (filename);
+	g_hash_table_insert (daemon->edid_made, g_strdup (cksum), ep);
+
+	if (icc_store_has_file (&daemon->store, ep->filepath)) {
+		g_debug ("profile for edid %s already exists", cksum);
+		ep->state = EDID_PROFILE_EXISTS;
+		return;
 	}
+	ep->state = EDID_PROFILE_WRITING;
+
+	job = g_new (struct edid_job, 1);
+	job->daemon = daemon;
+	job->edid = g_object_ref (disp->edid);
+	job->filepath = g_strdup (ep->filepath);
+
+	/* shared by all displays showing the monitor, so not theirs to cancel */
+	task = g_task_new (NULL, daemon->edid_cancel, create_profile_done, NULL);
+	g_task_set_task_data (task, job, edid_job_free);
+	worker_run (task, create_profile_thread);
+	g_object_unref (task);
+}
 
-out:
-	if (icc)
-		g_object_unref (icc);
-	g_object_unref (file);
+/* Made again on the next hotplug if the user deletes it */
+static void
+forget_edid_profile (Daemon *daemon, const gchar *filename)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	g_hash_table_iter_init (&iter, daemon->edid_made);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		struct edid_profile *ep = (struct edid_profile *) value;
+		if (ep->state == EDID_PROFILE_EXISTS && ! strcmp (ep->filepath, filename))
+			g_hash_table_iter_remove (&iter);
+	}
+}
+
+static inline void
+insert_prop (GHashTable *props, const gchar *key, const gchar *value)
+{
+	g_hash_table_insert (props, (gchar *) key, g_strdup (value));
 }
 
 static void
 randr_display_added_sig (RandrConn *conn, struct randr_display *disp, Daemon *daemon)
 {
 	const gchar *cksum;
-	GHashTable *props = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL);
+	struct cd_op *cop;
+	/* the display may be gone by the time the device is created */
+	GHashTable *props = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
 
-	g_assert (conn == daemon->rcon);
+	(void) conn;
 
 	g_debug ("added display: '%s'", disp->name);
+	latency_mark (disp->name, LATENCY_DISPLAY_ADDED);
+	restore_ramp (disp);
 
-	if (config.edid) {
-		create_profile_from_edid (daemon->stor, disp->edid);
-	}
+	insert_prop (props, CD_DEVICE_PROPERTY_KIND,
+		     cd_device_kind_to_string (CD_DEVICE_KIND_DISPLAY));
+	insert_prop (props, CD_DEVICE_PROPERTY_MODE,
+		     cd_device_mode_to_string (CD_DEVICE_MODE_PHYSICAL));
+	insert_prop (props, CD_DEVICE_PROPERTY_COLORSPACE,
+		     cd_colorspace_to_string (CD_COLORSPACE_RGB));
 
-	g_hash_table_insert (props, CD_DEVICE_PROPERTY_KIND,
-			     (gchar *) cd_device_kind_to_string (CD_DEVICE_KIND_DISPLAY));
-	g_hash_table_insert (props, CD_DEVICE_PROPERTY_MODE,
-			     (gchar *) cd_device_mode_to_string (CD_DEVICE_MODE_PHYSICAL));
-	g_hash_table_insert (props, CD_DEVICE_PROPERTY_COLORSPACE,
-			     (gchar *) cd_colorspace_to_string (CD_COLORSPACE_RGB));
+	insert_prop (props, CD_DEVICE_PROPERTY_VENDOR, cd_edid_get_vendor_name (disp->edid));
+	insert_prop (props, CD_DEVICE_PROPERTY_MODEL, cd_edid_get_monitor_name (disp->edid));
+	insert_prop (props, CD_DEVICE_PROPERTY_SERIAL, cd_edid_get_serial_number (disp->edid));
 
-	g_hash_table_insert (props, CD_DEVICE_PROPERTY_VENDOR, (gchar *) cd_edid_get_vendor_name (disp->edid));
-	g_hash_table_insert (props, CD_DEVICE_PROPERTY_MODEL, (gchar *) cd_edid_get_monitor_name (disp->edid));
-	g_hash_table_insert (props, CD_DEVICE_PROPERTY_SERIAL, (gchar *) cd_edid_get_serial_number (disp->edid));
+	insert_prop (props, CD_DEVICE_METADATA_XRANDR_NAME, disp->xrandr_name);
 
-	g_hash_table_insert (props, CD_DEVICE_METADATA_XRANDR_NAME, (gchar *) disp->xrandr_name);
-
-	g_hash_table_insert (props, CD_DEVICE_METADATA_OUTPUT_PRIORITY,
-			     disp->is_primary ? CD_DEVICE_METADATA_OUTPUT_PRIORITY_PRIMARY
-					      : CD_DEVICE_METADATA_OUTPUT_PRIORITY_SECONDARY);
+	insert_prop (props, CD_DEVICE_METADATA_OUTPUT_PRIORITY,
+		     disp->is_primary ? CD_DEVICE_METADATA_OUTPUT_PRIORITY_PRIMARY
+				      : CD_DEVICE_METADATA_OUTPUT_PRIORITY_SECONDARY);
 
 	cksum = cd_edid_get_checksum (disp->edid);
 	if (cksum)
-		g_hash_table_insert (props, CD_DEVICE_METADATA_OUTPUT_EDID_MD5, (gchar *) cksum);
+		insert_prop (props, CD_DEVICE_METADATA_OUTPUT_EDID_MD5, cksum);
 
 	if (disp->is_laptop)
 		g_hash_table_insert (props, CD_DEVICE_PROPERTY_EMBEDDED, NULL);
 
-	cd_client_create_device (daemon->cli, disp->name, CD_OBJECT_SCOPE_TEMP,
-				 props, NULL, cd_create_device_cb, daemon);
-
-	g_hash_table_unref (props);
-}
-
-static void
-cd_device_remove_cb (GObject *src, GAsyncResult *res, gpointer user_data)
-{
-	Daemon *daemon = (Daemon *) user_data;
-	GError *err = NULL;
-	gboolean ret;
+	cop = cd_device_op_new (&create_device_op, daemon, disp->name);
+	cop->props = props;
+	cd_op_push (cop);
 
-	g_assert (CD_CLIENT (src) == daemon->cli);
+	/* in the background, the device need not wait for it */
+	if (config.edid) {
+		/* the store can't be asked while it is being scanned */
+		if (daemon->store_ready)
+			create_profile_from_edid (daemon, disp);
+		else
+			g_ptr_array_add (daemon->pending_edids, g_strdup (disp->name));
+	}
 
-	ret = cd_client_delete_device_finish (daemon->cli, res, &err);
-	if (! ret) {
-		g_critical ("device not removed: %s", err->message);
-		g_error_free (err);
-		return;
+	/* profiles already known for this monitor, queued after creation */
+	if (cksum) {
+		GPtrArray *profiles = profile_index_lookup (&daemon->edid_profiles, cksum);
+		guint i;
+		for (i = 0; profiles && i < profiles->len; ++i)
+			add_profile_to_display (daemon, g_ptr_array_index (profiles, i), disp);
 	}
 }
 
 static void
 randr_display_removed_sig (RandrConn *conn, struct randr_display *disp, Daemon *daemon)
 {
-	CdDevice *device = NULL;
-	GError *err = NULL;
-
-	g_assert (conn == daemon->rcon);
+	(void) conn;
 
 	g_debug ("removed display: '%s'", disp->name);
+	latency_forget (disp->name);
+	cancel_display_work (daemon, disp->name);
 
-	/* We do not want race conditions here */
-	device = cd_client_find_device_sync (daemon->cli, disp->name,
-					    NULL, &err);
-	if (! device) {
-		g_debug ("device %s not found so not removed: %s", disp->name, err->message);
-		g_error_free (err);
-		return;
-	}
-
-	cd_client_delete_device (daemon->cli, device, NULL,
-				 cd_device_remove_cb, daemon);
+	cd_op_push (cd_device_op_new (&remove_device_op, daemon, disp->name));
+}
 
-	g_object_unref (device);
+static void
+randr_closed_sig (RandrConn *conn, Daemon *daemon)
+{
+	/* its displays have been removed already */
+	g_ptr_array_remove (daemon->rcons, conn);
+	if (daemon->rcons->len == 0) {
+		g_critical ("No X display is left");
+		g_main_loop_quit (daemon->loop);
+	}
 }
 
 static void
 randr_display_changed_sig (RandrConn *conn, struct randr_display *disp, Daemon *daemon)
 {
-	CdDevice *device = NULL;
-	GError *err = NULL;
-
-	g_assert (conn == daemon->rcon);
+	(void) conn;
 	g_assert (daemon->cli != NULL);
 	g_debug ("changed display: '%s'", disp->name);
 
-	/* We do not want race conditions here */
-	device = cd_client_find_device_sync (daemon->cli, disp->name,
-					     NULL, &err);
-	if (! device) {
-		g_debug ("device %s not found so not changed: %s", disp->name, err->message);
-		g_error_free (err);
-		return;
-	}
-
-	update_device (device, daemon);
-
-	g_object_unref (device);
+	cd_op_push (cd_device_op_new (&update_device_op, daemon, disp->name));
 }
 
 static void
@@ -446,84 +1232,82 @@ cd_existing_profiles_cb (GObject *src, GAsyncResult *res, gpointer user_data)
 }
 
 static void
-cd_client_create_profile_cb (GObject *src, GAsyncResult *res, gpointer user_data)
+store_profile_added (const gchar *filename, const gchar *checksum, gpointer user_data)
 {
 	Daemon *daemon = (Daemon *) user_data;
-	GError *err = NULL;
-	CdProfile *profile;
+	struct cd_op *cop;
+	gchar *id;
 
-	g_assert (CD_CLIENT (src) == daemon->cli);
+	id = profile_id (checksum);
+	cop = cd_profile_op_new (&create_profile_op, daemon, id);
+	g_free (id);
 
-	profile = cd_client_create_profile_finish (daemon->cli, res, &err);
-	if (! profile) {
-		if (! g_error_matches (err, CD_CLIENT_ERROR, CD_CLIENT_ERROR_ALREADY_EXISTS))
-			g_critical ("unable to create profile: %s", err->message);
-		g_error_free (err);
-		return;
-	}
-	g_object_unref (profile);
+	cop->props = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+	insert_prop (cop->props, CD_PROFILE_PROPERTY_FILENAME, filename);
+	insert_prop (cop->props, CD_PROFILE_METADATA_FILE_CHECKSUM, checksum);
+
+	cd_op_push (cop);
 }
 
 static void
-cd_client_delete_profile_cb (GObject *src, GAsyncResult *res, gpointer user_data)
+store_profile_removed (const gchar *filename, const gchar *checksum, gpointer user_data)
 {
 	Daemon *daemon = (Daemon *) user_data;
-	GError *err = NULL;
-	gboolean ret;
+	struct cd_op *cop;
+	gchar *id;
 
-	g_assert (CD_CLIENT (src) == daemon->cli);
+	forget_edid_profile (daemon, filename);
 
-	ret = cd_client_delete_profile_finish (daemon->cli, res, &err);
-	if (! ret) {
-		g_critical ("unable to remove profile: %s", err->message);
-		g_error_free (err);
-	}
+	id = profile_id (checksum);
+	cop = cd_profile_op_new (&remove_profile_op, daemon, id);
+	g_free (id);
+	cd_op_push (cop);
 }
 
 static void
-cd_icc_store_file_added_sig (CdIccStore *stor, CdIcc *icc, Daemon *daemon)
+store_ready (gpointer user_data)
 {
-	GHashTable *props;
-	gchar *id;
-
-	g_assert (stor == daemon->stor);
-
-	props = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL);
-	id = profile_id (icc);
-
-	g_hash_table_insert (props, CD_PROFILE_PROPERTY_FILENAME,
-			     (gchar *) cd_icc_get_filename (icc));
-	g_hash_table_insert (props, CD_PROFILE_METADATA_FILE_CHECKSUM,
-			     (gchar *) cd_icc_get_checksum (icc));
-
-	cd_client_create_profile (daemon->cli, id, CD_OBJECT_SCOPE_TEMP, props,
-			       NULL, cd_client_create_profile_cb, daemon);
-
-	g_free (id);
-	g_hash_table_unref (props);
+	Daemon *daemon = (Daemon *) user_data;
+	guint i;
+
+	g_debug ("profile store scanned %.1f ms after startup",
+		 (g_get_monotonic_time () - daemon->started) / 1000.0);
+
+	daemon->store_ready = TRUE;
+	for (i = 0; i < daemon->pending_edids->len; ++i) {
+		struct randr_display *disp = find_display_by_name (daemon,
+					g_ptr_array_index (daemon->pending_edids, i));
+		/* it may have come and gone */
+		if (disp)
+			create_profile_from_edid (daemon, disp);
+	}
+	g_ptr_array_set_size (daemon->pending_edids, 0);
 }
 
 static void
-cd_icc_store_file_removed_sig (CdIccStore *stor, CdIcc *icc, Daemon *daemon)
+randr_start (Daemon *daemon)
 {
-	CdProfile *prof = NULL;
-	GError *err = NULL;
-	gchar *id;
+	guint i;
 
-	g_assert (stor == daemon->stor);
+	for (i = 0; i < daemon->rcons->len; ++i) {
+		RandrConn *rcon = g_ptr_array_index (daemon->rcons, i);
 
-	id = profile_id (icc);
+		g_signal_connect (rcon, "display-added",
+				  G_CALLBACK (randr_display_added_sig), daemon);
 
-	prof = cd_client_find_profile_sync (daemon->cli, id, NULL, &err);
-	if (! prof) {
-		g_debug ("profile not found so not removed: %s: %s", id, err->message);
-		g_error_free (err);
-		goto out;
-	}
+		g_signal_connect (rcon, "display-removed",
+				  G_CALLBACK (randr_display_removed_sig), daemon);
 
-	cd_client_delete_profile (daemon->cli, prof, NULL, cd_client_delete_profile_cb, daemon);
-out:
-	g_free (id);
+		g_signal_connect (rcon, "display-changed",
+				  G_CALLBACK (randr_display_changed_sig), daemon);
+
+		g_signal_connect (rcon, "closed",
+				  G_CALLBACK (randr_closed_sig), daemon);
+
+		randr_conn_start (rcon);
+	}
+	g_debug ("X displays enumerated %.1f ms after startup",
+		 (g_get_monotonic_time () - daemon->started) / 1000.0);
 }
 
 static void
@@ -539,6 +1323,8 @@ cd_connect_cb (GObject *src, GAsyncResult *res, gpointer user_data)
 	if (! ret) {
 		g_critical ("Failed to connect to colord: %s", err->message);
 		g_error_free (err);
+		/* held since startup, and nothing will ever run them */
+		op_queue_close (&daemon->ops);
 		return;
 	}
 
@@ -551,42 +1337,60 @@ cd_connect_cb (GObject *src, GAsyncResult *res, gpointer user_data)
 	g_signal_connect (daemon->cli, "device-changed",
 			  G_CALLBACK (cd_device_changed_sig), daemon);
 
-	g_signal_connect (daemon->rcon, "display-added",
-			  G_CALLBACK (randr_display_added_sig), daemon);
+	g_signal_connect (daemon->cli, "device-removed",
+			  G_CALLBACK (cd_device_removed_sig), daemon);
 
-	g_signal_connect (daemon->rcon, "display-removed",
-			  G_CALLBACK (randr_display_removed_sig), daemon);
+	g_signal_connect (daemon->cli, "profile-removed",
+			  G_CALLBACK (cd_profile_removed_sig), daemon);
 
-	g_signal_connect (daemon->rcon, "display-changed",
-			  G_CALLBACK (randr_display_changed_sig), daemon);
+	g_debug ("connected to colord %.1f ms after startup",
+		 (g_get_monotonic_time () - daemon->started) / 1000.0);
 
-	g_signal_connect (daemon->stor, "added",
-			  G_CALLBACK (cd_icc_store_file_added_sig), daemon);
-
-	g_signal_connect (daemon->stor, "removed",
-			  G_CALLBACK (cd_icc_store_file_removed_sig), daemon);
-
-	cd_icc_store_set_load_flags (daemon->stor, CD_ICC_LOAD_FLAGS_FALLBACK_MD5);
-
-	ret = cd_icc_store_search_kind (daemon->stor, CD_ICC_STORE_SEARCH_KIND_USER,
-				  CD_ICC_STORE_SEARCH_FLAGS_CREATE_LOCATION, NULL, &err);
-	if (! ret) {
-		g_critical ("unable to watch profile store: %s", err->message);
-		g_clear_error (&err);
-	}
+	/* whatever the displays and the store have asked for so far */
+	op_queue_release (&daemon->ops);
 
+	stats_dbus_call ("GetDevicesByKind");
 	cd_client_get_devices_by_kind (daemon->cli,
 				       CD_DEVICE_KIND_DISPLAY,
 				       NULL,
 				       cd_existing_devices_cb,
 				       daemon);
 
+	stats_dbus_call ("GetProfiles");
 	cd_client_get_profiles (daemon->cli,
 				NULL,
 				cd_existing_profiles_cb,
 				daemon);
+}
+
+static void
+add_display (Daemon *daemon, const gchar *name, gboolean prefix)
+{
+	RandrConn *rcon = randr_conn_new (name);
+
+	/* the others are still worth managing */
+	if (! randr_conn_is_open (rcon)) {
+		g_warning ("Skipping display %s", name ? name : "(default)");
+		g_object_unref (rcon);
+		return;
+	}
+	randr_conn_set_coalescing (rcon, config.coalesce, config.coalesce_max);
+	/* the same monitor may show up on several displays */
+	if (prefix)
+		randr_conn_set_namespace (rcon, name);
+	g_ptr_array_add (daemon->rcons, rcon);
+}
 
-	randr_conn_start (daemon->rcon);
+static void
+add_displays (Daemon *daemon, const gchar *list, gboolean prefix)
+{
+	gchar **names = g_strsplit (list, ",", -1);
+	gchar **n;
+	for (n = names; *n; ++n) {
+		if (**n)
+			add_display (daemon, *n, prefix);
+	}
+	g_strfreev (names);
 }
 
 int
@@ -602,6 +1406,8 @@ main (int argc, char *argv[])
 	g_set_prgname (PACKAGE);
 
 	memset (&config, 0, sizeof (config));
+	config.coalesce = RANDR_COALESCE_QUIET_MS;
+	config.coalesce_max = RANDR_COALESCE_MAX_MS;
 	opt = g_option_context_new (NULL);
 	g_option_context_set_summary (opt, "X color management daemon");
 	g_option_context_add_main_entries (opt, config_entries, 0);
@@ -613,29 +1419,103 @@ main (int argc, char *argv[])
 		g_error_free (err);
 		return retval;
 	}
+	if (config.coalesce < 0 || config.coalesce_max < 0) {
+		config_free ();
+		g_print ("Coalescing times must not be negative\n");
+		return retval;
+	}
 
 	daemon.loop = g_main_loop_new (NULL, FALSE);
-	daemon.rcon = randr_conn_new (config.display);
+	daemon.rcons = g_ptr_array_new_with_free_func (g_object_unref);
+	if (config.displays) {
+		gboolean prefix = (config_num_displays () > 1);
+		gchar **d;
+		for (d = config.displays; *d; ++d)
+			add_displays (&daemon, *d, prefix);
+	}
+	if (config_num_displays () == 0)
+		add_display (&daemon, NULL, FALSE);
+	if (daemon.rcons->len == 0) {
+		g_critical ("No X display could be opened");
+		config_free ();
+		g_free (config.stats_file);
+		g_ptr_array_unref (daemon.rcons);
+		g_main_loop_unref (daemon.loop);
+		return retval;
+	}
 	daemon.cli = cd_client_new ();
-	daemon.stor = cd_icc_store_new ();
+	icc_store_init (&daemon.store, store_profile_added, store_profile_removed,
+			store_ready, &daemon);
+	op_queue_init (&daemon.ops);
+	proxy_cache_init (&daemon.devices, "device");
+	proxy_cache_init (&daemon.profiles, "profile");
+	profile_index_init (&daemon.edid_profiles);
+	daemon.store_ready = FALSE;
+	daemon.pending_edids = g_ptr_array_new_with_free_func (g_free);
+	daemon.cancels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+						g_object_unref);
+	daemon.edid_made = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+						  edid_profile_free);
+	daemon.edid_cancel = g_cancellable_new ();
 
 	config_free ();
 
 	g_unix_signal_add (SIGTERM, signal_term, daemon.loop);
 	g_unix_signal_add (SIGINT, signal_term, daemon.loop);
-
+	g_unix_signal_add (SIGHUP, signal_hup, &daemon);
+	g_unix_signal_add (SIGUSR1, signal_usr1, NULL);
+
+	daemon.stats_owner = stats_dbus_own ();
+
+	/*
+	 * Nothing waits for colord but the colord calls themselves: they are
+	 * held back until it answers, while the profile store is scanned in
+	 * another thread and the X displays are enumerated right away, getting
+	 * the ramps of the last session until colord tells otherwise.
+	 */
+	daemon.started = g_get_monotonic_time ();
+	latency_startup (daemon.started);
+	op_queue_hold (&daemon.ops);
+	icc_store_scan (&daemon.store);
+	snapshot_load ();
+
+	count_connect (FALSE);
 	cd_client_connect (daemon.cli, NULL, cd_connect_cb, &daemon);
 
+	randr_start (&daemon);
+
 	g_main_loop_run (daemon.loop);
 
 	g_warning ("Exiting");
-
-	retval = 0;
-
-	g_object_unref (daemon.stor);
+	latency_report ();
+	snapshot_save ();
+
+	/* a supervisor should restart us once the X servers are back */
+	retval = daemon.rcons->len ? 0 : 1;
+
+	/* what is still queued for worker threads is not worth waiting for */
+	g_hash_table_foreach (daemon.cancels, (GHFunc) cancel_all, NULL);
+	g_cancellable_cancel (daemon.edid_cancel);
+	g_cancellable_cancel (daemon.store.cancel);
+	worker_shutdown ();
+	g_hash_table_unref (daemon.cancels);
+	g_hash_table_unref (daemon.edid_made);
+	g_object_unref (daemon.edid_cancel);
+
+	stats_dbus_unown (daemon.stats_owner);
+	op_queue_finalize (&daemon.ops);
+	profile_index_finalize (&daemon.edid_profiles);
+	g_ptr_array_unref (daemon.pending_edids);
+	proxy_cache_finalize (&daemon.profiles);
+	proxy_cache_finalize (&daemon.devices);
+	icc_store_finalize (&daemon.store);
 	g_object_unref (daemon.cli);
-	g_object_unref (daemon.rcon);
+	g_ptr_array_unref (daemon.rcons);
 	g_main_loop_unref (daemon.loop);
+	latency_clear ();
+	snapshot_clear ();
+	stats_clear ();
+	g_free (config.stats_file);
 
 	return retval;
 }
@@ -0,0 +1,403 @@
+#!/usr/bin/env python3
+"""A stand-in for colord, for tests/hotplug-latency.sh.
+
+Just enough of org.freedesktop.ColorManager for xiccd, on whatever bus
+DBUS_SYSTEM_BUS_ADDRESS points at. Devices and profiles are kept in
+memory. Every display device gets one of the profiles written to
+--profile-dir as its default, as if the user had assigned a calibration;
+SIGUSR1 switches all of them to the other profile.
+"""
+
+import argparse
+import os
+import re
+import signal
+import struct
+import sys
+import time
+
+from gi.repository import Gio, GLib
+
+BUS_NAME = 'org.freedesktop.ColorManager'
+ROOT = '/org/freedesktop/ColorManager'
+MANAGER = 'org.freedesktop.ColorManager'
+DEVICE = 'org.freedesktop.ColorManager.Device'
+PROFILE = 'org.freedesktop.ColorManager.Profile'
+
+XML = '''
+<node>
+  <interface name="org.freedesktop.ColorManager">
+    <method name="GetDevices"><arg type="ao" direction="out"/></method>
+    <method name="GetDevicesByKind">
+      <arg type="s" direction="in"/><arg type="ao" direction="out"/>
+    </method>
+    <method name="GetProfiles"><arg type="ao" direction="out"/></method>
+    <method name="FindDeviceById">
+      <arg type="s" direction="in"/><arg type="o" direction="out"/>
+    </method>
+    <method name="FindProfileById">
+      <arg type="s" direction="in"/><arg type="o" direction="out"/>
+    </method>
+    <method name="FindProfileByFilename">
+      <arg type="s" direction="in"/><arg type="o" direction="out"/>
+    </method>
+    <method name="CreateDevice">
+      <arg type="s" direction="in"/><arg type="s" direction="in"/>
+      <arg type="a{ss}" direction="in"/><arg type="o" direction="out"/>
+    </method>
+    <method name="DeleteDevice"><arg type="o" direction="in"/></method>
+    <method name="CreateProfile">
+      <arg type="s" direction="in"/><arg type="s" direction="in"/>
+      <arg type="a{ss}" direction="in"/><arg type="o" direction="out"/>
+    </method>
+    <method name="CreateProfileWithFd">
+      <arg type="s" direction="in"/><arg type="s" direction="in"/>
+      <arg type="h" direction="in"/><arg type="a{ss}" direction="in"/>
+      <arg type="o" direction="out"/>
+    </method>
+    <method name="DeleteProfile"><arg type="o" direction="in"/></method>
+    <signal name="Changed"/>
+    <signal name="DeviceAdded"><arg type="o"/></signal>
+    <signal name="DeviceRemoved"><arg type="o"/></signal>
+    <signal name="DeviceChanged"><arg type="o"/></signal>
+    <signal name="ProfileAdded"><arg type="o"/></signal>
+    <signal name="ProfileRemoved"><arg type="o"/></signal>
+    <signal name="ProfileChanged"><arg type="o"/></signal>
+    <property name="DaemonVersion" type="s" access="read"/>
+    <property name="SystemVendor" type="s" access="read"/>
+    <property name="SystemModel" type="s" access="read"/>
+  </interface>
+  <interface name="org.freedesktop.ColorManager.Device">
+    <method name="AddProfile">
+      <arg type="s" direction="in"/><arg type="o" direction="in"/>
+    </method>
+    <method name="RemoveProfile"><arg type="o" direction="in"/></method>
+    <method name="MakeProfileDefault"><arg type="o" direction="in"/></method>
+    <method name="SetProperty">
+      <arg type="s" direction="in"/><arg type="s" direction="in"/>
+    </method>
+    <signal name="Changed"/>
+    <property name="DeviceId" type="s" access="read"/>
+    <property name="Kind" type="s" access="read"/>
+    <property name="Model" type="s" access="read"/>
+    <property name="Vendor" type="s" access="read"/>
+    <property name="Serial" type="s" access="read"/>
+    <property name="Seat" type="s" access="read"/>
+    <property name="Format" type="s" access="read"/>
+    <property name="Colorspace" type="s" access="read"/>
+    <property name="Mode" type="s" access="read"/>
+    <property name="Scope" type="s" access="read"/>
+    <property name="Owner" type="u" access="read"/>
+    <property name="Created" type="t" access="read"/>
+    <property name="Modified" type="t" access="read"/>
+    <property name="Embedded" type="b" access="read"/>
+    <property name="Enabled" type="b" access="read"/>
+    <property name="Profiles" type="ao" access="read"/>
+    <property name="ProfilingInhibitors" type="as" access="read"/>
+    <property name="Metadata" type="a{ss}" access="read"/>
+  </interface>
+  <interface name="org.freedesktop.ColorManager.Profile">
+    <signal name="Changed"/>
+    <property name="ProfileId" type="s" access="read"/>
+    <property name="Filename" type="s" access="read"/>
+    <property name="Qualifier" type="s" access="read"/>
+    <property name="Format" type="s" access="read"/>
+    <property name="Title" type="s" access="read"/>
+    <property name="Kind" type="s" access="read"/>
+    <property name="Colorspace" type="s" access="read"/>
+    <property name="Scope" type="s" access="read"/>
+    <property name="Owner" type="u" access="read"/>
+    <property name="Created" type="x" access="read"/>
+    <property name="HasVcgt" type="b" access="read"/>
+    <property name="IsSystemWide" type="b" access="read"/>
+    <property name="Metadata" type="a{ss}" access="read"/>
+    <property name="Warnings" type="as" access="read"/>
+  </interface>
+</node>
+'''
+
+NODE = Gio.DBusNodeInfo.new_for_xml(XML)
+
+DEVICE_TYPES = {
+    'DeviceId': 's', 'Kind': 's', 'Model': 's', 'Vendor': 's', 'Serial': 's',
+    'Seat': 's', 'Format': 's', 'Colorspace': 's', 'Mode': 's', 'Scope': 's',
+    'Owner': 'u', 'Created': 't', 'Modified': 't', 'Embedded': 'b',
+    'Enabled': 'b', 'Profiles': 'ao', 'ProfilingInhibitors': 'as',
+    'Metadata': 'a{ss}',
+}
+
+PROFILE_TYPES = {
+    'ProfileId': 's', 'Filename': 's', 'Qualifier': 's', 'Format': 's',
+    'Title': 's', 'Kind': 's', 'Colorspace': 's', 'Scope': 's', 'Owner': 'u',
+    'Created': 'x', 'HasVcgt': 'b', 'IsSystemWide': 'b', 'Metadata': 'a{ss}',
+    'Warnings': 'as',
+}
+
+# Keys of CreateDevice and CreateProfile that are properties, the rest is
+# metadata
+DEVICE_PROPS = ('Kind', 'Model', 'Vendor', 'Serial', 'Seat', 'Format',
+                'Colorspace', 'Mode')
+PROFILE_PROPS = ('Filename', 'Qualifier', 'Format', 'Title', 'Kind',
+                 'Colorspace')
+
+ICC_HEADER_SIZE = 128
+
+
+def write_profile(path, formula):
+    """Smallest display profile xiccd reads, with a VCGT formula tag"""
+    tag = b'vcgt' + bytes(4) + struct.pack('>I', 1)
+    for gamma, lo, hi in formula:
+        tag += struct.pack('>iii', *(round(v * 65536) for v in (gamma, lo, hi)))
+    size = ICC_HEADER_SIZE + 16 + len(tag)
+    header = bytearray(ICC_HEADER_SIZE)
+    header[0:4] = struct.pack('>I', size)
+    header[8:12] = struct.pack('>I', 0x02100000)
+    header[12:24] = b'mntrRGB XYZ '
+    header[36:40] = b'acsp'
+    tags = struct.pack('>I4sII', 1, b'vcgt', ICC_HEADER_SIZE + 16, len(tag))
+    with open(path, 'wb') as f:
+        f.write(bytes(header) + tags + tag)
+
+
+def object_path(kind, ident):
+    return '%s/%s/%s' % (ROOT, kind, re.sub('[^A-Za-z0-9]', '_', ident))
+
+
+def error(invocation, name, msg):
+    invocation.return_dbus_error('org.freedesktop.ColorManager.' + name, msg)
+
+
+class Object:
+    def __init__(self, daemon, path, iface, types, props):
+        self.daemon = daemon
+        self.path = path
+        self.iface = iface
+        self.types = types
+        self.props = props
+        self.reg = daemon.conn.register_object(
+            path, NODE.lookup_interface(iface), self.method_call,
+            self.get_property, None)
+
+    def get_property(self, conn, sender, path, iface, name):
+        return GLib.Variant(self.types[name], self.props[name])
+
+    def method_call(self, conn, sender, path, iface, method, params, invocation):
+        error(invocation, 'NotSupported', method + ' is not supported')
+
+    def changed(self, *names):
+        changed = {n: GLib.Variant(self.types[n], self.props[n]) for n in names}
+        self.daemon.conn.emit_signal(
+            None, self.path, 'org.freedesktop.DBus.Properties',
+            'PropertiesChanged', GLib.Variant('(sa{sv}as)', (self.iface, changed, [])))
+        self.daemon.conn.emit_signal(None, self.path, self.iface, 'Changed', None)
+
+    def unregister(self):
+        self.daemon.conn.unregister_object(self.reg)
+
+
+class Device(Object):
+    def method_call(self, conn, sender, path, iface, method, params, invocation):
+        args = params.unpack()
+        profiles = self.props['Profiles']
+        if method == 'AddProfile':
+            if args[1] in profiles:
+                error(invocation, 'Device.ProfileAlreadyAdded', args[1])
+                return
+            profiles.append(args[1])
+        elif method == 'RemoveProfile':
+            if args[0] in profiles:
+                profiles.remove(args[0])
+        elif method == 'MakeProfileDefault':
+            if args[0] in profiles:
+                profiles.remove(args[0])
+            profiles.insert(0, args[0])
+        elif method == 'SetProperty':
+            if args[0] in self.props:
+                self.props[args[0]] = args[1]
+        else:
+            Object.method_call(self, conn, sender, path, iface, method, params,
+                               invocation)
+            return
+        invocation.return_value(None)
+        self.props['Modified'] = int(time.time())
+        self.changed('Profiles', 'Modified')
+        self.daemon.emit('DeviceChanged', self.path)
+
+
+class Profile(Object):
+    pass
+
+
+class Daemon:
+    def __init__(self, conn, profiles):
+        self.conn = conn
+        self.devices = {}   # path -> Device
+        self.profiles = {}  # path -> Profile
+        self.assigned = []  # paths of the profiles handed out
+        self.current = 0
+        for filename in profiles:
+            ident = 'standin-' + os.path.basename(filename)
+            self.assigned.append(self.add_profile(ident, 'temp',
+                                                  {'Filename': filename}))
+        conn.register_object(ROOT, NODE.lookup_interface(MANAGER),
+                             self.method_call, self.get_property, None)
+
+    def emit(self, signal_name, path):
+        self.conn.emit_signal(None, ROOT, MANAGER, signal_name,
+                              GLib.Variant('(o)', (path,)))
+        self.conn.emit_signal(None, ROOT, MANAGER, 'Changed', None)
+
+    def add_profile(self, ident, scope, props):
+        path = object_path('profiles', ident)
+        if path in self.profiles:
+            self.profiles.pop(path).unregister()
+        values = {
+            'ProfileId': ident, 'Filename': '', 'Qualifier': '', 'Format': '',
+            'Title': ident, 'Kind': 'display-device', 'Colorspace': 'rgb',
+            'Scope': scope, 'Owner': os.getuid(), 'Created': int(time.time()),
+            'HasVcgt': True, 'IsSystemWide': False, 'Metadata': {},
+            'Warnings': [],
+        }
+        for key, value in props.items():
+            if key in PROFILE_PROPS:
+                values[key] = value
+            else:
+                values['Metadata'][key] = value
+        self.profiles[path] = Profile(self, path, PROFILE, PROFILE_TYPES, values)
+        self.emit('ProfileAdded', path)
+        return path
+
+    def add_device(self, ident, scope, props):
+        path = object_path('devices', ident)
+        now = int(time.time())
+        values = {
+            'DeviceId': ident, 'Kind': '', 'Model': '', 'Vendor': '',
+            'Serial': '', 'Seat': '', 'Format': '', 'Colorspace': '',
+            'Mode': '', 'Scope': scope, 'Owner': os.getuid(), 'Created': now,
+            'Modified': now, 'Embedded': False, 'Enabled': True,
+            'Profiles': [], 'ProfilingInhibitors': [], 'Metadata': {},
+        }
+        for key, value in props.items():
+            if key == 'Embedded':
+                values['Embedded'] = True
+            elif key in DEVICE_PROPS:
+                values[key] = value
+            else:
+                values['Metadata'][key] = value
+        if values['Kind'] == 'display' and self.assigned:
+            values['Profiles'].append(self.assigned[self.current])
+        self.devices[path] = Device(self, path, DEVICE, DEVICE_TYPES, values)
+        self.emit('DeviceAdded', path)
+        return path
+
+    def find(self, table, key, value):
+        for path, obj in table.items():
+            if obj.props[key] == value:
+                return path
+        return None
+
+    def method_call(self, conn, sender, path, iface, method, params, invocation):
+        args = params.unpack()
+        ret = None
+        if method == 'GetDevices':
+            ret = GLib.Variant('(ao)', (list(self.devices),))
+        elif method == 'GetDevicesByKind':
+            ret = GLib.Variant('(ao)', ([p for p, d in self.devices.items()
+                                         if d.props['Kind'] == args[0]],))
+        elif method == 'GetProfiles':
+            ret = GLib.Variant('(ao)', (list(self.profiles),))
+        elif method in ('FindDeviceById', 'FindProfileById',
+                        'FindProfileByFilename'):
+            if method == 'FindDeviceById':
+                found = self.find(self.devices, 'DeviceId', args[0])
+            elif method == 'FindProfileById':
+                found = self.find(self.profiles, 'ProfileId', args[0])
+            else:
+                found = self.find(self.profiles, 'Filename', args[0])
+            if not found:
+                error(invocation, 'NotFound', args[0] + ' does not exist')
+                return
+            ret = GLib.Variant('(o)', (found,))
+        elif method == 'CreateDevice':
+            if self.find(self.devices, 'DeviceId', args[0]):
+                error(invocation, 'AlreadyExists', args[0] + ' already exists')
+                return
+            ret = GLib.Variant('(o)', (self.add_device(*args),))
+        elif method == 'CreateProfile':
+            ret = GLib.Variant('(o)', (self.add_profile(*args),))
+        elif method == 'CreateProfileWithFd':
+            # the file is read from its name, the descriptor is not needed
+            ret = GLib.Variant('(o)', (self.add_profile(args[0], args[1], args[3]),))
+        elif method in ('DeleteDevice', 'DeleteProfile'):
+            table = self.devices if method == 'DeleteDevice' else self.profiles
+            if args[0] not in table:
+                error(invocation, 'NotFound', args[0] + ' does not exist')
+                return
+            table.pop(args[0]).unregister()
+            self.emit('DeviceRemoved' if method == 'DeleteDevice'
+                      else 'ProfileRemoved', args[0])
+        else:
+            error(invocation, 'NotSupported', method + ' is not supported')
+            return
+        invocation.return_value(ret)
+
+    def get_property(self, conn, sender, path, iface, name):
+        if name == 'DaemonVersion':
+            return GLib.Variant('s', '1.4.6')
+        return GLib.Variant('s', 'xiccd')
+
+    def switch_profiles(self):
+        """What a user assigning another calibration looks like to xiccd"""
+        if not self.assigned:
+            return GLib.SOURCE_CONTINUE
+        self.current = (self.current + 1) % len(self.assigned)
+        profile = self.assigned[self.current]
+        for device in self.devices.values():
+            if device.props['Kind'] != 'display':
+                continue
+            profiles = device.props['Profiles']
+            if profile in profiles:
+                profiles.remove(profile)
+            profiles.insert(0, profile)
+            device.changed('Profiles')
+            self.emit('DeviceChanged', device.path)
+        return GLib.SOURCE_CONTINUE
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--profile-dir', required=True,
+                        help='where the profiles handed out are written')
+    parser.add_argument('--ready', help='file created once the name is owned')
+    args = parser.parse_args()
+
+    os.makedirs(args.profile_dir, exist_ok=True)
+    profiles = []
+    # visibly different ramps, so that a switch uploads gamma
+    for i, top in enumerate((0.95, 0.85)):
+        path = os.path.join(args.profile_dir, 'standin%d.icc' % i)
+        write_profile(path, [(1.0, 0.0, top), (1.1, 0.0, top), (0.9, 0.0, top)])
+        profiles.append(path)
+
+    loop = GLib.MainLoop()
+    conn = Gio.bus_get_sync(Gio.BusType.SYSTEM, None)
+    daemon = Daemon(conn, profiles)
+
+    def acquired(conn, name):
+        if args.ready:
+            open(args.ready, 'w').close()
+
+    def lost(conn, name):
+        print('unable to own ' + BUS_NAME, file=sys.stderr)
+        loop.quit()
+
+    Gio.bus_own_name_on_connection(conn, BUS_NAME, Gio.BusNameOwnerFlags.NONE,
+                                   acquired, lost)
+    GLib.unix_signal_add(GLib.PRIORITY_DEFAULT, signal.SIGUSR1,
+                         daemon.switch_profiles)
+    GLib.unix_signal_add(GLib.PRIORITY_DEFAULT, signal.SIGTERM, loop.quit)
+    loop.run()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,135 @@
+#!/bin/sh
+#
+# Hotplug to gamma latency of xiccd, with no GPU and no network: a headless
+# Xorg with the dummy driver, a private D-Bus with tests/colord-standin.py
+# in place of colord, and xrandr turning outputs off and on.
+#
+#   tests/hotplug-latency.sh [ROUNDS]
+#
+# Needs Xorg with xserver-xorg-video-dummy 0.4 or later (for its RandR
+# outputs), xrandr, dbus-daemon and python3-gi. Xorg only takes a -config
+# outside of /etc from root, or where Xorg.wrap lets users start it.
+# XICCD names the binary, ./xiccd by default.
+
+set -eu
+
+ROUNDS=${1:-20}
+XICCD=${XICCD:-./xiccd}
+XDISPLAY=${XDISPLAY:-:97}
+SRCDIR=$(cd "$(dirname "$0")" && pwd)
+
+work=$(mktemp -d)
+pids=
+
+cleanup () {
+	for pid in $pids; do
+		kill "$pid" 2>/dev/null || true
+	done
+	wait 2>/dev/null || true
+	rm -rf "$work"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# Waits up to five seconds for a command to succeed
+wait_for () {
+	i=0
+	until "$@" >/dev/null 2>&1; do
+		i=$((i + 1))
+		if [ "$i" -gt 50 ]; then
+			echo "timed out waiting for: $*" >&2
+			return 1
+		fi
+		sleep 0.1
+	done
+}
+
+cat > "$work/xorg.conf" <<EOF
+Section "Device"
+	Identifier	"dummy"
+	Driver		"dummy"
+	VideoRam	256000
+EndSection
+
+Section "Screen"
+	Identifier	"screen"
+	Device		"dummy"
+	DefaultDepth	24
+	SubSection "Display"
+		Depth	24
+		Virtual	8192 4096
+	EndSubSection
+EndSection
+EOF
+
+Xorg "$XDISPLAY" -config "$work/xorg.conf" -logfile "$work/xorg.log" \
+	-noreset -nolisten tcp >/dev/null 2>&1 &
+pids="$pids $!"
+wait_for xrandr -d "$XDISPLAY" -q
+
+# the first output keeps the screen alive, the others are plugged in turn
+outputs=$(xrandr -d "$XDISPLAY" -q | awk '/^[A-Z]+[0-9]+ / { print $1 }' | tail -n +2)
+if [ -z "$outputs" ]; then
+	echo "the X server has a single output, is the dummy driver too old?" >&2
+	exit 1
+fi
+for out in $outputs; do
+	xrandr -d "$XDISPLAY" --output "$out" --off
+done
+
+# colord lives on the system bus, it is the same private bus here
+dbus-daemon --session --nofork --print-address=3 3>"$work/bus" &
+pids="$pids $!"
+wait_for test -s "$work/bus"
+DBUS_SYSTEM_BUS_ADDRESS=$(head -n 1 "$work/bus")
+DBUS_SESSION_BUS_ADDRESS=$DBUS_SYSTEM_BUS_ADDRESS
+export DBUS_SYSTEM_BUS_ADDRESS DBUS_SESSION_BUS_ADDRESS
+
+# nothing of the user's is read or written
+HOME=$work/home
+XDG_DATA_HOME=$HOME/.local/share
+XDG_CACHE_HOME=$HOME/.cache
+XDG_CONFIG_HOME=$HOME/.config
+export HOME XDG_DATA_HOME XDG_CACHE_HOME XDG_CONFIG_HOME
+mkdir -p "$HOME"
+
+python3 "$SRCDIR/colord-standin.py" --profile-dir "$work/profiles" \
+	--ready "$work/colord-ready" &
+standin=$!
+pids="$pids $standin"
+wait_for test -e "$work/colord-ready"
+
+"$XICCD" --display "$XDISPLAY" > "$work/xiccd.log" 2>&1 &
+xiccd=$!
+pids="$pids $xiccd"
+sleep 1
+
+round=0
+while [ "$round" -lt "$ROUNDS" ]; do
+	for out in $outputs; do
+		xrandr -d "$XDISPLAY" --output "$out" --auto
+		sleep 0.5
+		# a new calibration for what is plugged in now and then
+		if [ $((round % 5)) -eq 4 ]; then
+			kill -USR1 "$standin"
+			sleep 0.2
+		fi
+		xrandr -d "$XDISPLAY" --output "$out" --off
+		sleep 0.2
+	done
+	round=$((round + 1))
+done
+
+# the distributions are logged on exit
+kill -TERM "$xiccd"
+wait "$xiccd" || true
+
+if grep -q "CRITICAL" "$work/xiccd.log"; then
+	grep "CRITICAL" "$work/xiccd.log" >&2
+	exit 1
+fi
+if ! grep "hotplug to" "$work/xiccd.log"; then
+	echo "no hotplug got its gamma set, log follows" >&2
+	cat "$work/xiccd.log" >&2
+	exit 1
+fi
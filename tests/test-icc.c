@@ -0,0 +1,358 @@
+#include "icc.h"
+#include <colord.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/extensions/Xrandr.h>
+
+#define ICC_HEADER_SIZE 128
+
+/*
+ * lcms rounds the position to 16 bits before it interpolates and the value
+ * to 16 bits after, each worth up to half a step
+ */
+#define MAX_DIFF 2
+
+/* Ramp sizes of real CRTCs, and some that come in partial blocks */
+static const int ramp_sizes[] = { 2, 17, 256, 1000, 1024, 4096 };
+
+static gchar *tmpdir;
+static GPtrArray *files;
+
+static inline void
+write_be16 (guint8 *p, guint16 v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xFF;
+}
+
+static inline void
+write_be32 (guint8 *p, guint32 v)
+{
+	p[0] = v >> 24;
+	p[1] = (v >> 16) & 0xFF;
+	p[2] = (v >> 8) & 0xFF;
+	p[3] = v & 0xFF;
+}
+
+/* Smallest display profile both icc_data_load() and lcms accept */
+static GBytes *
+make_profile (const guint8 *vcgt, gsize vcgt_size)
+{
+	gsize size = ICC_HEADER_SIZE + 16 + vcgt_size;
+	guint8 *buf = g_malloc0 (size);
+
+	write_be32 (buf, size);
+	write_be32 (buf + 8, 0x02100000);
+	memcpy (buf + 12, "mntr", 4);
+	memcpy (buf + 16, "RGB ", 4);
+	memcpy (buf + 20, "XYZ ", 4);
+	memcpy (buf + 36, "acsp", 4);
+	write_be32 (buf + ICC_HEADER_SIZE, 1);
+	memcpy (buf + ICC_HEADER_SIZE + 4, "vcgt", 4);
+	write_be32 (buf + ICC_HEADER_SIZE + 8, ICC_HEADER_SIZE + 16);
+	write_be32 (buf + ICC_HEADER_SIZE + 12, vcgt_size);
+	memcpy (buf + ICC_HEADER_SIZE + 16, vcgt, vcgt_size);
+
+	return g_bytes_new_take (buf, size);
+}
+
+/* A different curve for each channel, as calibrations have */
+static GBytes *
+make_table_profile (guint channels, guint entries, guint entry_size)
+{
+	gsize size = 18 + channels * entries * entry_size;
+	guint8 *tag = g_malloc0 (size);
+	GBytes *retval;
+	guint c, i;
+
+	memcpy (tag, "vcgt", 4);
+	write_be32 (tag + 8, 0);
+	write_be16 (tag + 12, channels);
+	write_be16 (tag + 14, entries);
+	write_be16 (tag + 16, entry_size);
+	for (c = 0; c < channels; ++c) {
+		guint8 *p = tag + 18 + c * entries * entry_size;
+		for (i = 0; i < entries; ++i) {
+			double x = (double) i / (entries - 1);
+			guint v = (guint) (pow (x, 1.0 / (1.8 + 0.2 * c)) * 0xFFFF + 0.5);
+			if (entry_size == 1)
+				p[i] = v >> 8;
+			else
+				write_be16 (p + 2 * i, v);
+		}
+	}
+
+	retval = make_profile (tag, size);
+	g_free (tag);
+	return retval;
+}
+
+static inline void
+write_s15f16 (guint8 *p, double v)
+{
+	write_be32 (p, (guint32) (gint32) floor (v * 65536.0 + 0.5));
+}
+
+static GBytes *
+make_formula_profile (const double f[3][3])
+{
+	guint8 tag[48];
+	int c;
+
+	memset (tag, 0, sizeof (tag));
+	memcpy (tag, "vcgt", 4);
+	write_be32 (tag + 8, 1);
+	for (c = 0; c < 3; ++c) {
+		write_s15f16 (tag + 12 + 12 * c, f[c][0]);
+		write_s15f16 (tag + 16 + 12 * c, f[c][1]);
+		write_s15f16 (tag + 20 + 12 * c, f[c][2]);
+	}
+	return make_profile (tag, sizeof (tag));
+}
+
+/* Mapped, the way xiccd reads profiles from the store */
+static struct icc_data *
+load_file (const gchar *name, GBytes *bytes)
+{
+	gchar *path = g_build_filename (tmpdir, name, NULL);
+	gsize size;
+	const gchar *buf = g_bytes_get_data (bytes, &size);
+	struct icc_data *data;
+	GError *err = NULL;
+
+	g_file_set_contents (path, buf, size, &err);
+	g_assert_no_error (err);
+	g_ptr_array_add (files, path);
+
+	data = icc_data_load (path, &err);
+	g_assert_no_error (err);
+	return data;
+}
+
+/* Parsed by colord and read by lcms, the way profiles from colord are */
+static struct icc_data *
+load_cd_icc (GBytes *bytes)
+{
+	CdIcc *icc = cd_icc_new ();
+	struct icc_data *data;
+	gsize size;
+	const guint8 *buf = g_bytes_get_data (bytes, &size);
+	GError *err = NULL;
+
+	cd_icc_load_data (icc, buf, size, CD_ICC_LOAD_FLAGS_NONE, &err);
+	g_assert_no_error (err);
+	data = icc_data_new_from_icc (icc);
+	g_object_unref (icc);
+	return data;
+}
+
+static void
+assert_close (const unsigned short *a, const unsigned short *b, int size)
+{
+	int max = 0;
+	int i;
+
+	for (i = 0; i < size; ++i)
+		max = MAX (max, abs ((int) a[i] - (int) b[i]));
+	g_assert_cmpint (max, <=, MAX_DIFF);
+}
+
+static void
+assert_gamma_close (const XRRCrtcGamma *a, const XRRCrtcGamma *b)
+{
+	g_assert_cmpint (a->size, ==, b->size);
+	assert_close (a->red, b->red, a->size);
+	assert_close (a->green, b->green, a->size);
+	assert_close (a->blue, b->blue, a->size);
+}
+
+/* The VCGT decoder against lcms, at every ramp size */
+static void
+compare_with_lcms (const gchar *name, GBytes *bytes)
+{
+	struct icc_data *fast = load_file (name, bytes);
+	struct icc_data *slow = load_cd_icc (bytes);
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (ramp_sizes); ++i) {
+		XRRCrtcGamma *a = XRRAllocGamma (ramp_sizes[i]);
+		XRRCrtcGamma *b = XRRAllocGamma (ramp_sizes[i]);
+
+		icc_to_gamma (a, fast);
+		icc_to_gamma (b, slow);
+		assert_gamma_close (a, b);
+
+		XRRFreeGamma (a);
+		XRRFreeGamma (b);
+	}
+	/* decoded without falling back to lcms */
+	g_assert_null (fast->icc);
+
+	icc_data_unref (fast);
+	icc_data_unref (slow);
+}
+
+static void
+test_vcgt_table (void)
+{
+	static const guint entries[] = { 2, 256, 1024, 4096 };
+	guint i;
+	guint entry_size;
+
+	for (entry_size = 1; entry_size <= 2; ++entry_size) {
+		for (i = 0; i < G_N_ELEMENTS (entries); ++i) {
+			GBytes *bytes = make_table_profile (3, entries[i], entry_size);
+			gchar *name = g_strdup_printf ("table%u-%u.icc",
+						       entry_size * 8, entries[i]);
+			compare_with_lcms (name, bytes);
+			g_free (name);
+			g_bytes_unref (bytes);
+		}
+	}
+}
+
+static void
+test_vcgt_formula (void)
+{
+	/* gamma, min and max of each channel */
+	static const double formulas[][3][3] = {
+		{ { 1.0, 0.0, 1.0 }, { 1.0, 0.0, 1.0 }, { 1.0, 0.0, 1.0 } },
+		{ { 2.2, 0.0, 1.0 }, { 1.8, 0.0, 1.0 }, { 2.4, 0.0, 1.0 } },
+		{ { 0.8, 0.05, 0.95 }, { 1.1, 0.02, 0.9 }, { 0.45, 0.0, 0.8 } },
+	};
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (formulas); ++i) {
+		GBytes *bytes = make_formula_profile (formulas[i]);
+		gchar *name = g_strdup_printf ("formula%u.icc", i);
+		compare_with_lcms (name, bytes);
+		g_free (name);
+		g_bytes_unref (bytes);
+	}
+}
+
+/* lcms refuses one-channel tables, the decoder must not make up a curve */
+static void
+test_vcgt_one_channel (void)
+{
+	GBytes *bytes = make_table_profile (1, 256, 2);
+	struct icc_data *data = load_file ("table-mono.icc", bytes);
+	XRRCrtcGamma *a = XRRAllocGamma (256);
+	XRRCrtcGamma *b = XRRAllocGamma (256);
+
+	icc_to_gamma (a, data);
+	icc_to_gamma (b, NULL);
+	g_assert_nonnull (data->icc);
+	g_assert_cmpmem (a->red, 256 * 2, b->red, 256 * 2);
+	g_assert_cmpmem (a->green, 256 * 2, b->green, 256 * 2);
+	g_assert_cmpmem (a->blue, 256 * 2, b->blue, 256 * 2);
+
+	XRRFreeGamma (a);
+	XRRFreeGamma (b);
+	icc_data_unref (data);
+	g_bytes_unref (bytes);
+}
+
+/* Sizes with a specialised kernel, and their neighbours without */
+static const int special_sizes[] = {
+	255, 256, 257, 1023, 1024, 1025, 4095, 4096, 4097
+};
+
+static void
+test_linear (void)
+{
+	guint i;
+	int j;
+
+	for (i = 0; i < G_N_ELEMENTS (special_sizes); ++i) {
+		XRRCrtcGamma *gamma = XRRAllocGamma (special_sizes[i]);
+		const int max = gamma->size - 1;
+
+		icc_to_gamma (gamma, NULL);
+		for (j = 0; j < gamma->size; ++j) {
+			guint16 v = (guint16) floor (j * 65535.0 / max + 0.5);
+			g_assert_cmpuint (gamma->red[j], ==, v);
+			g_assert_cmpuint (gamma->green[j], ==, v);
+			g_assert_cmpuint (gamma->blue[j], ==, v);
+		}
+		XRRFreeGamma (gamma);
+	}
+}
+
+static void
+assert_formula (const unsigned short *out, int size, const double f[3])
+{
+	int max = 0;
+	int i;
+
+	for (i = 0; i < size; ++i) {
+		double x = (double) i / (size - 1);
+		double v = f[1] + (f[2] - f[1]) * pow (x, f[0]);
+		int want = (int) floor (CLAMP (v, 0.0, 1.0) * 65535.0 + 0.5);
+		max = MAX (max, abs ((int) out[i] - want));
+	}
+	/* sampled in single precision */
+	g_assert_cmpint (max, <=, 1);
+}
+
+/* Full blocks are quantized by the specialised loop, the rest generically */
+static void
+test_quantize (void)
+{
+	/* the last two channels go out of range and are clamped */
+	static const double f[3][3] = {
+		{ 2.2, 0.0, 1.0 }, { 0.7, -0.1, 1.0 }, { 1.5, 0.1, 1.2 }
+	};
+	GBytes *bytes = make_formula_profile (f);
+	struct icc_data *data = load_file ("quantize.icc", bytes);
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (special_sizes); ++i) {
+		XRRCrtcGamma *gamma = XRRAllocGamma (special_sizes[i]);
+
+		icc_to_gamma (gamma, data);
+		assert_formula (gamma->red, gamma->size, f[0]);
+		assert_formula (gamma->green, gamma->size, f[1]);
+		assert_formula (gamma->blue, gamma->size, f[2]);
+		XRRFreeGamma (gamma);
+	}
+	g_assert_null (data->icc);
+
+	icc_data_unref (data);
+	g_bytes_unref (bytes);
+}
+
+int
+main (int argc, char *argv[])
+{
+	int retval;
+	guint i;
+
+	g_test_init (&argc, &argv, NULL);
+
+	tmpdir = g_dir_make_tmp ("xiccd-test-XXXXXX", NULL);
+	g_assert_nonnull (tmpdir);
+	files = g_ptr_array_new_with_free_func (g_free);
+
+	g_test_add_func ("/icc/vcgt/table", test_vcgt_table);
+	g_test_add_func ("/icc/vcgt/formula", test_vcgt_formula);
+	g_test_add_func ("/icc/vcgt/one-channel", test_vcgt_one_channel);
+	g_test_add_func ("/icc/linear", test_linear);
+	g_test_add_func ("/icc/quantize", test_quantize);
+
+	retval = g_test_run ();
+
+	icc_data_clear_cache ();
+	for (i = 0; i < files->len; ++i)
+		g_unlink (g_ptr_array_index (files, i));
+	g_ptr_array_unref (files);
+	g_rmdir (tmpdir);
+	g_free (tmpdir);
+
+	return retval;
+}
+
+/* vim: set ts=8 sw=8 tw=0 : */